@@ -1,98 +1,230 @@
 #include <utility>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <new>
+#include <thread>
+#include <chrono>
 
 #include <assoc.h>
+#include <epoch.h>
+#include <eviction.h>
+#include <segment.h>
+#include <defrag.h>
+#include <compress.h>
+#include <dedup.h>
+#include <flash.h>
 
 #include <jemalloc.h>
 
 namespace cached {
 
-hash_table::hash_table() :
-hash_seed(static_cast<uint32_t>(std::rand())),
-power(10) {
-    this->table = new bucket[1 << this->power];
+// Past this the table does not grow any more.
+static const unsigned int max_power = 30;
+
+static inline uint32_t reverse_bits(uint32_t v) noexcept {
+    v = ((v >> 1) & 0x55555555) | ((v & 0x55555555) << 1);
+    v = ((v >> 2) & 0x33333333) | ((v & 0x33333333) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f) | ((v & 0x0f0f0f0f) << 4);
+    return __builtin_bswap32(v);
 }
 
-lru_queue::lru_queue() :
-length(0),
-item_total_size(0),
-head(nullptr),
-tail(nullptr)
-{ }
+static uint32_t process_hash_seed() noexcept {
+    static const uint32_t seed = static_cast<uint32_t>(std::rand());
+    return seed;
+}
 
-void lru_queue::move_head(item_ptr& it) noexcept {
-    auto prev = it->lru_prev.lock();
-    auto next = it->lru_next;
+hash_table::hash_table() :
+hash_table(eviction_policy::get_instance(),
+           setting::get_instance().max_lru_queue_size)
+{
+    auto &setting = setting::get_instance();
 
-    if (!prev && !next) {
-        this->item_total_size += it->data_size;
+    if (setting.mrc_keys > 0) {
+        this->mrc = new mrc_estimator(setting.max_lru_queue_size, setting.mrc_keys);
     }
 
-    if (prev) {
-        prev->lru_next = next;
+    if (setting.storage == storage_engine::LOG) {
+        segment_store::get_instance().start_cleaner(*this);
     }
 
-    if (next) {
-        next->lru_prev = prev;
+    if (setting.defrag) {
+        defragmenter::get_instance().start(*this);
     }
 
-    it->lru_next = this->head;
-    it->lru_prev = item_weak_ptr();
+    if (setting.compress_cold_age > 0) {
+        value_codec::get_instance().start(*this);
+    }
 
-    if (this->head) {
-        this->head->lru_prev = it;
+    if (setting.flash_path) {
+        flash_store::get_instance().start(*this);
     }
+}
+
+hash_table::hash_table(eviction_policy &policy,
+                       size_t memory_limit,
+                       unsigned int power) :
+hash_seed(process_hash_seed()),
+nitems(0),
+engine_type(setting::get_instance().hash_engine),
+expanding(false),
+expander_started(false),
+hash_type(setting::get_instance().hash_fn),
+hash_fn(get_hash_func(setting::get_instance().hash_fn)),
+digest_keys(setting::get_instance().key_digest),
+policy(policy),
+memory_limit(memory_limit),
+nevictions(0),
+mrc(nullptr) {
+    this->table = bucket_array::create(power, this->engine_type == index_engine::SWISS);
+}
 
-    this->head = it;
+bucket_array *bucket_array::create(unsigned int power, bool sharded) noexcept {
+    auto a = new bucket_array;
+
+    a->power = power;
+    a->buckets = bucket::new_table(a->size());
+    a->shards = sharded ? new swiss_table[a->size()] : nullptr;
+    a->next = nullptr;
+
+    return a;
 }
 
-void lru_queue::remove(item_ptr& it) noexcept {
-    auto prev = it->lru_prev.lock();
-    auto next = it->lru_next;
+void bucket_array::destroy(void *p) noexcept {
+    auto a = static_cast<bucket_array *>(p);
 
-    if (prev) {
-        prev->lru_next = next;
+    bucket::delete_table(a->buckets, a->size());
+    delete[] a->shards;
+    delete a;
+}
+
+bucket::bucket() :
+version(0),
+overflow(nullptr),
+forwarded(false)
+{
+    for (unsigned i = 0; i < nslots; i++) {
+        this->tags[i] = 0;
+        this->slots[i] = nullptr;
     }
+}
 
-    if (next) {
-        next->lru_prev = prev;
+bucket *bucket::new_table(size_t n) noexcept {
+    auto table = static_cast<bucket *>(je_aligned_alloc(sizeof(bucket),
+                                                        n * sizeof(bucket)));
+    for (size_t i = 0; i < n; i++) {
+        new (&table[i]) bucket();
     }
 
-    if (it == this->head) {
-        this->head = nullptr;
+    return table;
+}
+
+void bucket::delete_table(bucket *table, size_t n) noexcept {
+    for (size_t i = 0; i < n; i++) {
+        table[i].~bucket();
     }
 
-    it->lru_next = nullptr;
-    it->lru_prev.reset();
+    je_free(table);
 }
 
-void bucket::insert_item(item_ptr &it) {
-    it->hash_next = this->head;
-    if (this->head) {
-        this->head->hash_prev = it;
+item_ptr bucket::find(std::string &key, uint32_t hv, const uint64_t *digest) const noexcept {
+    auto t = tag(hv);
+
+    for (unsigned i = 0; i < nslots; i++) {
+        auto it = this->slots[i].load(std::memory_order_acquire);
+        if (it && this->tags[i] == t && it->has_key(key, digest)) {
+            return it;
+        }
+    }
+
+    auto it = this->overflow.load(std::memory_order_acquire);
+    while (it && (it->hv != hv || !it->has_key(key, digest))) {
+        it = it->hash_next.load(std::memory_order_acquire);
+    }
+
+    return it;
+}
+
+void bucket::insert_item(item_ptr it) noexcept {
+    this->write_begin();
+
+    for (unsigned i = 0; i < nslots; i++) {
+        if (!this->slots[i].load(std::memory_order_relaxed)) {
+            this->tags[i] = tag(it->hv);
+            this->slots[i].store(it, std::memory_order_release);
+            this->write_end();
+            return;
+        }
+    }
+
+    it->hash_next.store(this->overflow.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+    this->overflow.store(it, std::memory_order_release);
+
+    this->write_end();
+}
+
+void bucket::remove_overflow(item_ptr it) noexcept {
+    auto link = &this->overflow;
+
+    while (auto curr = link->load(std::memory_order_relaxed)) {
+        if (curr == it) {
+            link->store(it->hash_next.load(std::memory_order_relaxed),
+                        std::memory_order_release);
+            return;
+        }
+
+        link = &curr->hash_next;
     }
-    this->head = it;
 }
 
-void bucket::remove(item_ptr& it) {
-    auto prev = it->hash_prev.lock();
-    auto next = it->hash_next;
+void bucket::remove(item_ptr it) noexcept {
+    this->write_begin();
 
-    if (prev) {
-        prev->hash_next = next;
+    for (unsigned i = 0; i < nslots; i++) {
+        if (this->slots[i].load(std::memory_order_relaxed) == it) {
+            // Refill the slot from the chain to keep lookups inline.
+            auto next = this->overflow.load(std::memory_order_relaxed);
+            if (next) {
+                this->overflow.store(next->hash_next.load(std::memory_order_relaxed),
+                                     std::memory_order_relaxed);
+                this->tags[i] = tag(next->hv);
+            }
+
+            this->slots[i].store(next, std::memory_order_release);
+            this->write_end();
+            return;
+        }
     }
 
-    if (next) {
-        next->hash_prev = prev;
+    this->remove_overflow(it);
+    this->write_end();
+}
+
+void bucket::replace(item_ptr old_it, item_ptr new_it) noexcept {
+    this->write_begin();
+
+    for (unsigned i = 0; i < nslots; i++) {
+        if (this->slots[i].load(std::memory_order_relaxed) == old_it) {
+            this->slots[i].store(new_it, std::memory_order_release);
+            this->write_end();
+            return;
+        }
     }
 
-    if (it == this->head) {
-        this->head = nullptr;
+    auto link = &this->overflow;
+    while (auto curr = link->load(std::memory_order_relaxed)) {
+        if (curr == old_it) {
+            new_it->hash_next.store(old_it->hash_next.load(std::memory_order_relaxed),
+                                    std::memory_order_relaxed);
+            link->store(new_it, std::memory_order_release);
+            break;
+        }
+
+        link = &curr->hash_next;
     }
 
-    it->hash_next = nullptr;
-    it->hash_prev.reset();
+    this->write_end();
 }
 
 item::item(std::string &k,
@@ -100,73 +232,907 @@ item::item(std::string &k,
            unsigned int exptime,
            char * new_data,
            size_t data_size) :
-key(std::move(k)),
+item(k, flags, exptime, data_size)
+{
+    std::memcpy(this->data, new_data, data_size);
+}
+
+item::item(std::string &k,
+           uint32_t flags,
+           unsigned int exptime,
+           size_t data_size) :
+item(k, flags, exptime, data_size,
+     hash_table::get_instance().hash(k),
+     nullptr,
+     (char *)je_malloc(data_size),
+     segment_store::no_segment)
+{
+}
+
+std::atomic<uint64_t> item::digest_collisions(0);
+
+item::item(std::string &k,
+           uint32_t flags,
+           unsigned int exptime,
+           size_t data_size,
+           uint32_t hv,
+           const uint64_t *digest,
+           char *data,
+           uint32_t segment) :
+digest{0, 0},
 flags(flags),
 exptime(exptime),
 created_at(std::time(0)),
 cas_key(0),
-data((char *)je_malloc(data_size)),
+data(data),
 data_size(data_size),
-last_access(std::time(0))
+hv(hv),
+last_access(std::time(0)),
+linked(false),
+queue(0),
+freq(0),
+queue_prev(nullptr),
+queue_next(nullptr),
+cost(1),
+heap_index(0),
+priority(0),
+hash_next(nullptr),
+segment(segment),
+chain(nullptr),
+chain_tail(nullptr),
+nchunks(0),
+owns_chain(false),
+raw_size(0),
+shared(nullptr),
+flash_page(flash_store::no_page),
+flash_offset(0)
+{
+    static auto& setting = setting::get_instance();
+
+    if (setting.key_digest) {
+        if (digest) {
+            this->digest[0] = digest[0];
+            this->digest[1] = digest[1];
+        } else {
+            hash_table::get_instance().digest(k, this->digest);
+        }
+
+        if (!setting.key_verify) {
+            return;
+        }
+    }
+
+    this->key = std::move(k);
+}
+
+item_ptr item::allocate(std::string &k,
+                        uint32_t hv,
+                        const uint64_t *digest,
+                        uint32_t flags,
+                        unsigned int exptime,
+                        size_t data_size,
+                        shared_value *v)
+{
+    static auto& setting = setting::get_instance();
+
+    if (setting.storage == storage_engine::LOG) {
+        static auto& store = segment_store::get_instance();
+
+        // The value follows the item in the same log entry, a shared one
+        // takes room only for the item. A file backed arena keeps the key
+        // last, for a restarted server.
+        auto value_size = v ? 0 : data_size;
+        auto key_size = store.file_backed() && !(setting.key_digest && !setting.key_verify)
+                        ? k.size() : 0;
+
+        uint32_t seg;
+        auto p = static_cast<char *>(store.allocate(sizeof(item) + value_size + key_size,
+                                                    hv, seg, key_size));
+
+        if (p) {
+            std::memcpy(p + sizeof(item) + value_size, k.data(), key_size);
+            auto it = new (p) item(k, flags, exptime, data_size, hv, digest,
+                                   v ? v->bytes() : p + sizeof(item), seg);
+            it->shared = v;
+            return it;
+        }
+    }
+
+    auto it = new item(k, flags, exptime, data_size, hv, digest,
+                       v ? v->bytes() : static_cast<char *>(je_malloc(data_size)),
+                       segment_store::no_segment);
+    it->shared = v;
+    return it;
+}
+
+item_ptr item::create(std::string &k,
+                      uint32_t flags,
+                      unsigned int exptime,
+                      size_t data_size)
 {
     static auto& hash_table = hash_table::get_instance();
 
-    this->hash_index = hash_table.hash_index(hash_table.hash(this->key));
-    std::memcpy(this->data, new_data, data_size);
+    return allocate(k, hash_table.hash(k), nullptr, flags, exptime, data_size, nullptr);
+}
+
+item_ptr item::create(const item *like, size_t data_size) {
+    std::string k(like->key);
+
+    return allocate(k, like->hv, like->digest, like->flags,
+                    static_cast<unsigned int>(like->exptime), data_size, nullptr);
+}
+
+item_ptr item::create(std::string &k,
+                      uint32_t flags,
+                      unsigned int exptime,
+                      const char *new_data,
+                      size_t data_size)
+{
+    auto it = create(k, flags, exptime, data_size);
+    std::memcpy(it->data, new_data, data_size);
+
+    return it;
+}
+
+item_ptr item::create(uint32_t hv,
+                      const uint64_t *digest,
+                      uint32_t flags,
+                      unsigned int exptime,
+                      size_t data_size)
+{
+    std::string k;
+
+    return allocate(k, hv, digest, flags, exptime, data_size, nullptr);
+}
+
+item_ptr item::create_chained(std::string &k, uint32_t flags, unsigned int exptime) {
+    return create(k, flags, exptime, 0);
+}
+
+item_ptr item::create_shared(std::string &k,
+                             uint32_t flags,
+                             unsigned int exptime,
+                             shared_value *v)
+{
+    static auto& hash_table = hash_table::get_instance();
+
+    return allocate(k, hash_table.hash(k), nullptr, flags, exptime, v->size, v);
+}
+
+item_ptr item::create_shared(const item *like, shared_value *v) {
+    std::string k(like->key);
+
+    return allocate(k, like->hv, like->digest, like->flags,
+                    static_cast<unsigned int>(like->exptime), v->size, v);
+}
+
+item_ptr item::create_flash(const item *like, uint32_t page, uint32_t offset) {
+    auto it = create(like, 0);
+
+    it->data_size = like->data_size;
+    it->raw_size = like->raw_size;
+    it->flash_page = page;
+    it->flash_offset = offset;
+
+    flash_store::get_instance().add_header(it->total_size());
+
+    return it;
+}
+
+bool item::expired(time_t now) const noexcept {
+    static auto& setting = setting::get_instance();
+
+    if (this->exptime == 0) {
+        return false;
+    }
+
+    if (this->exptime <= static_cast<time_t>(setting.max_exptime)) {
+        return this->created_at + this->exptime <= now;
+    }
+
+    return this->exptime <= now;
+}
+
+void item::destroy(item_ptr it) noexcept {
+    auto seg = it->segment;
+    if (seg == segment_store::no_segment) {
+        delete it;
+        return;
+    }
+
+    static auto& store = segment_store::get_instance();
+
+    // A chained, shared or flash item only took room for itself, and its key
+    // in a file backed arena.
+    auto size = sizeof(item) + (it->chained() || it->shared || it->on_flash() ? 0 : it->data_size)
+                + (store.file_backed() ? it->key.size() : 0);
+    it->~item();
+    store.release(seg, size);
+}
+
+item_ptr item::restore(item *stale, size_t key_size) noexcept {
+    auto data = reinterpret_cast<char *>(stale + 1);
+    std::string k(data + stale->data_size, key_size);
+
+    // Read out before the constructor overwrites them.
+    uint64_t digest[2] = {stale->digest[0], stale->digest[1]};
+    auto exptime = stale->exptime;
+    auto created_at = stale->created_at;
+    auto cas_key = stale->cas_key;
+    auto cost = stale->cost;
+    auto raw_size = stale->raw_size;
+
+    auto it = new (stale) item(k, stale->flags, static_cast<unsigned int>(exptime),
+                               stale->data_size, stale->hv, digest, data, stale->segment);
+
+    it->created_at = created_at;
+    it->cas_key = cas_key;
+    it->cost = cost;
+    it->raw_size = raw_size;
+
+    return it;
+}
+
+item_ptr hash_table::index_find(bucket_array *a,
+                                uint32_t index,
+                                std::string &key,
+                                uint32_t hv,
+                                const uint64_t *digest) noexcept
+{
+    if (this->engine_type == index_engine::SWISS) {
+        return a->shards[index].find(key, hv, digest);
+    }
+
+    return a->buckets[index].find(key, hv, digest);
+}
+
+bool hash_table::index_contains(bucket_array *a, uint32_t index, const item *it, uint32_t hv)
+noexcept
+{
+    if (this->engine_type == index_engine::SWISS) {
+        return a->shards[index].contains(it, hv);
+    }
+
+    auto &bucket = a->buckets[index];
+    for (unsigned i = 0; i < bucket::nslots; i++) {
+        if (bucket.slots[i].load(std::memory_order_relaxed) == it) {
+            return true;
+        }
+    }
+
+    auto curr = bucket.overflow.load(std::memory_order_relaxed);
+    while (curr && curr != it) {
+        curr = curr->hash_next.load(std::memory_order_relaxed);
+    }
+
+    return curr != nullptr;
+}
+
+void hash_table::index_insert(bucket_array *a, uint32_t index, item_ptr it) noexcept {
+    auto &bucket = a->buckets[index];
+
+    if (this->engine_type == index_engine::SWISS) {
+        bucket.write_begin();
+        a->shards[index].insert(it, it->hv);
+        bucket.write_end();
+    } else {
+        bucket.insert_item(it);
+    }
+
+    this->nitems.fetch_add(1, std::memory_order_relaxed);
+}
+
+void hash_table::index_remove(bucket_array *a, uint32_t index, item_ptr it) noexcept {
+    auto &bucket = a->buckets[index];
+
+    if (this->engine_type == index_engine::SWISS) {
+        bucket.write_begin();
+        a->shards[index].erase(it, it->hv);
+        bucket.write_end();
+    } else {
+        bucket.remove(it);
+    }
+
+    this->nitems.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void hash_table::index_replace(bucket_array *a, uint32_t index, item_ptr old_it, item_ptr new_it)
+noexcept
+{
+    auto &bucket = a->buckets[index];
+
+    if (this->engine_type == index_engine::SWISS) {
+        bucket.write_begin();
+        a->shards[index].replace(old_it, new_it, old_it->hv);
+        bucket.write_end();
+    } else {
+        bucket.replace(old_it, new_it);
+    }
 }
 
 item_ptr hash_table::insert_item(std::string &key,
                                  uint32_t flags,
                                  unsigned int exptime,
                                  char *data,
-                                 size_t data_size)
+                                 size_t data_size,
+                                 uint32_t cost)
 {
-    static auto& lru = lru_queue::get_instance();
-    static auto& hash_table = hash_table::get_instance();
+    auto it = item::create(key, flags, exptime, data, data_size);
+    it->cost = cost;
+
+    return this->insert_item(it);
+}
+
+item_ptr hash_table::insert_item(item_ptr it) {
+    return this->insert_item(it, [] {});
+}
+
+void hash_table::inserted(item_ptr it) noexcept {
+    this->policy.on_insert(it);
+    this->sample_update(it);
+    this->evict();
+    this->maybe_expand();
+}
+
+bool hash_table::insert_restored(item_ptr it) noexcept {
+    {
+        uint32_t index;
+        auto a = this->lock_bucket(it->hv, index);
+        spin_guard g(a->buckets[index].mtx, std::adopt_lock);
 
-    auto it = std::make_shared<item>(key, flags, exptime, data,data_size);
+        if (this->index_find(a, index, it->key, it->hv,
+                             this->digest_keys ? it->digest : nullptr))
+        {
+            return false;
+        }
 
-    if (it->exptime > 0) {
-        mtx_guard g(lru.mtx);
-        lru.move_head(it);
+        it->linked = true;
+        this->index_insert(a, index, it);
     }
 
-    auto& bucket = this->get_bucket(it->hash_index);
+    this->inserted(it);
 
-    mtx_guard g(bucket.mtx);
-    bucket.insert_item(it);
+    return true;
+}
 
-    return it;
+bucket_array *hash_table::locate(uint32_t hv, uint32_t &index) noexcept {
+    auto a = this->table.load(std::memory_order_acquire);
+
+    while (true) {
+        index = a->index(hv);
+        if (!a->buckets[index].forwarded.load(std::memory_order_acquire)) {
+            return a;
+        }
+
+        a = a->next;
+    }
+}
+
+bucket_array *hash_table::lock_bucket(uint32_t hv, uint32_t &index) noexcept {
+    while (true) {
+        auto a = this->locate(hv, index);
+        auto &bucket = a->buckets[index];
+
+        bucket.mtx.lock();
+
+        // Moved while we waited for it.
+        if (!bucket.forwarded.load(std::memory_order_relaxed)) {
+            return a;
+        }
+
+        bucket.mtx.unlock();
+    }
+}
+
+void hash_table::maybe_expand() noexcept {
+    auto a = this->table.load(std::memory_order_acquire);
+
+    if (this->nitems.load(std::memory_order_relaxed) <= a->size() * bucket::nslots * 3 / 4
+        || a->power >= max_power || this->expanding.exchange(true))
+    {
+        return;
+    }
+
+    {
+        mtx_guard g(this->expand_mtx);
+
+        if (!this->expander_started) {
+            this->expander_started = true;
+            std::thread(&hash_table::run_expander, this).detach();
+        }
+    }
+
+    this->expand_cv.notify_one();
+}
+
+// Moves one bucket at a time under its lock, so a writer only ever waits for
+// one bucket to move and lookups go on meanwhile. A moved bucket is marked
+// forwarded and lookups follow it to the new array, the old one is retired
+// once nothing is left in it.
+void hash_table::expand() noexcept {
+    static auto& epoch = epoch_manager::get_instance();
+
+    auto a = this->table.load(std::memory_order_acquire);
+    auto next = bucket_array::create(a->power + 1, a->shards != nullptr);
+    a->next = next;
+
+    std::vector<item_ptr> items;
+
+    for (uint32_t i = 0; i < a->size(); i++) {
+        auto &bucket = a->buckets[i];
+
+        {
+            spin_guard g(bucket.mtx);
+
+            items.clear();
+            this->gather(a, i, items);
+
+            // The new buckets are only reached through this one until it
+            // is forwarded, nobody else writes them yet.
+            bucket.write_begin();
+
+            for (auto it : items) {
+                auto index = next->index(it->hv);
+
+                if (next->shards) {
+                    auto &b = next->buckets[index];
+                    b.write_begin();
+                    next->shards[index].insert(it, it->hv);
+                    b.write_end();
+                } else {
+                    next->buckets[index].insert_item(it);
+                }
+            }
+
+            bucket.forwarded.store(true, std::memory_order_release);
+            bucket.write_end();
+        }
+
+        if (i % 1024 == 1023) {
+            epoch.quiescent();
+        }
+    }
+
+    this->table.store(next, std::memory_order_release);
+    epoch.retire(a, bucket_array::destroy);
+}
+
+void hash_table::run_expander() noexcept {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> l(this->expand_mtx);
+            this->expand_cv.wait_for(l, std::chrono::seconds(1), [this] {
+                return this->expanding.load();
+            });
+        }
+
+        // Going offline frees the arrays past their grace period.
+        epoch_guard g;
+
+        if (this->expanding.load()) {
+            this->expand();
+            this->expanding = false;
+        }
+    }
 }
 
 item_ptr hash_table::find_item(std::string &key, bucket *&bp, bool update_lru) {
-    static auto& lru_queue = lru_queue::get_instance();
+    auto hv = this->hash(key);
+
+    uint64_t digest[2];
+    auto dp = this->digest(key, digest);
 
-    auto &bucket = this->get_bucket(key);
+    uint32_t index;
+    auto a = this->lock_bucket(hv, index);
+    auto &bucket = a->buckets[index];
     bp = &bucket;
 
+    auto it = this->index_find(a, index, key, hv, dp);
+    if (!it) {
+        bucket.mtx.unlock();
+        return nullptr;
+    }
+
+    if (update_lru) {
+        this->policy.on_hit(it);
+    }
+
+    return it;
+}
+
+item_ptr hash_table::find_item_nolock(std::string &key) noexcept {
+    return this->find_item_nolock(key, this->hash(key));
+}
+
+item_ptr hash_table::find_item_nolock(std::string &key, uint32_t hv) noexcept {
+    item_ptr it;
+
+    uint64_t digest[2];
+    auto dp = this->digest(key, digest);
+
+    while (true) {
+        uint32_t index;
+        auto a = this->locate(hv, index);
+        auto &bucket = a->buckets[index];
+
+        auto version = bucket.version.load(std::memory_order_acquire);
+        if ((version & 1) || bucket.forwarded.load(std::memory_order_acquire)) {
+            continue;
+        }
+
+        it = this->index_find(a, index, key, hv, dp);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (bucket.version.load(std::memory_order_relaxed) == version) {
+            break;
+        }
+    }
+
+    if (!it) {
+        this->sample_miss(hv);
+        return nullptr;
+    }
+
+    this->policy.on_hit(it);
+    this->sample_access(it);
+
+    return it;
+}
+
+void hash_table::replace_item(bucket &b, item_ptr old_it, item_ptr new_it)
+noexcept
+{
+    static auto& epoch = epoch_manager::get_instance();
+
+    // The bucket is locked, so the item stays where it is found.
+    uint32_t index;
+    auto a = this->locate(old_it->hv, index);
+
+    new_it->linked = true;
+    this->index_replace(a, index, old_it, new_it);
+    old_it->linked = false;
+
+    this->policy.on_replace(old_it, new_it);
+    this->sample_update(new_it);
+
+    epoch.retire(old_it);
+}
+
+void hash_table::remove_item(bucket &b, item_ptr it) noexcept {
+    static auto& epoch = epoch_manager::get_instance();
+
+    uint32_t index;
+    auto a = this->locate(it->hv, index);
+
+    this->index_remove(a, index, it);
+    it->linked = false;
+
+    this->policy.on_remove(it);
+
+    epoch.retire(it);
+}
+
+void hash_table::bucket_items(uint32_t index, std::vector<item_ptr> &out) noexcept {
+    auto a = this->table.load(std::memory_order_acquire);
+    if (index < a->size()) {
+        this->collect(a, index, out);
+    }
+}
+
+void hash_table::hash_items(uint32_t hv, std::vector<item_ptr> &out) noexcept {
+    uint32_t index;
+    auto a = this->lock_bucket(hv, index);
+    spin_guard g(a->buckets[index].mtx, std::adopt_lock);
+
+    this->gather(a, index, out);
+}
+
+uint32_t hash_table::scan(uint32_t cursor, std::vector<item_ptr> &out) noexcept {
+    auto a = this->table.load(std::memory_order_acquire);
+    auto mask = static_cast<uint32_t>(a->size() - 1);
+
+    this->collect(a, cursor & mask, out);
+
+    // Adds one to the reversed cursor, the bits above the mask carry through.
+    cursor |= ~mask;
+    cursor = reverse_bits(cursor);
+    cursor++;
+    return reverse_bits(cursor);
+}
+
+uint32_t hash_table::position(uint32_t hv) noexcept {
+    return reverse_bits(hv);
+}
+
+uint64_t hash_table::walk(uint64_t pos, std::vector<item_ptr> &out) noexcept {
+    auto a = this->table.load(std::memory_order_acquire);
+    auto shift = 32 - a->power;
+
+    this->collect(a, a->index(reverse_bits(static_cast<uint32_t>(pos))), out);
+
+    return ((pos >> shift) + 1) << shift;
+}
+
+void hash_table::collect(bucket_array *a, uint32_t index, std::vector<item_ptr> &out) noexcept {
+    auto &bucket = a->buckets[index];
     bucket.mtx.lock();
-    auto it = bucket.head;
 
-    while (it) {
-        if (it->key == key) {
-            if (update_lru) {
-                mtx_guard g1(lru_queue.mtx);
-                lru_queue.move_head(it);
+    if (bucket.forwarded.load(std::memory_order_relaxed)) {
+        bucket.mtx.unlock();
+
+        this->collect(a->next, index, out);
+        this->collect(a->next, index + static_cast<uint32_t>(a->size()), out);
+        return;
+    }
+
+    this->gather(a, index, out);
+    bucket.mtx.unlock();
+}
+
+void hash_table::gather(bucket_array *a, uint32_t index, std::vector<item_ptr> &out) noexcept {
+    auto &bucket = a->buckets[index];
+
+    if (this->engine_type == index_engine::SWISS) {
+        a->shards[index].for_each([&out](item_ptr it) {
+            out.push_back(it);
+        });
+        return;
+    }
+
+    for (unsigned i = 0; i < bucket::nslots; i++) {
+        if (auto it = bucket.slots[i].load(std::memory_order_relaxed)) {
+            out.push_back(it);
+        }
+    }
+
+    for (auto it = bucket.overflow.load(std::memory_order_relaxed); it;
+         it = it->hash_next.load(std::memory_order_relaxed))
+    {
+        out.push_back(it);
+    }
+}
+
+bool item::fragmented() const noexcept {
+    static auto& setting = setting::get_instance();
+
+    auto needed = (this->data_size + setting.value_chunk_size - 1) / setting.value_chunk_size;
+    return this->nchunks > needed + setting.value_chain_slack;
+}
+
+void item::chain_append(value_chunk *c) noexcept {
+    if (this->chain_tail) {
+        this->chain_tail->next.store(c, std::memory_order_release);
+    } else {
+        this->chain = c;
+    }
+
+    this->chain_tail = c;
+    this->nchunks++;
+    this->data_size += c->size;
+    this->owns_chain = true;
+}
+
+void item::chain_prepend(value_chunk *c) noexcept {
+    c->next.store(this->chain, std::memory_order_relaxed);
+    this->chain = c;
+
+    if (!this->chain_tail) {
+        this->chain_tail = c;
+    }
+
+    this->nchunks++;
+    this->data_size += c->size;
+    this->owns_chain = true;
+}
+
+void item::adopt_chain(item_ptr from) noexcept {
+    this->chain = from->chain;
+    this->chain_tail = from->chain_tail;
+    this->nchunks = from->nchunks;
+    this->data_size = from->data_size;
+    this->owns_chain = from->owns_chain;
+
+    from->owns_chain = false;
+}
+
+void item::compact(const item *from) noexcept {
+    static auto& setting = setting::get_instance();
+
+    value_chunk *c = nullptr;
+    size_t fill = 0;
+    size_t left = from->data_size;
+
+    from->for_each_piece([&](const char *data, size_t size) {
+        while (size > 0) {
+            if (!c) {
+                c = value_chunk::create(nullptr, std::min(left, setting.value_chunk_size));
+                fill = 0;
             }
 
-            return it;
+            auto n = std::min(size, c->size - fill);
+            std::memcpy(c->bytes() + fill, data, n);
+
+            fill += n;
+            left -= n;
+            data += n;
+            size -= n;
+
+            if (fill == c->size) {
+                this->chain_append(c);
+                c = nullptr;
+            }
         }
+    });
+}
+
+relocate_result hash_table::relocate_item(item_ptr it, uint32_t hv,
+                                          time_t evict_before) noexcept
+{
+    static auto& epoch = epoch_manager::get_instance();
 
-        it = it->hash_next;
+    uint32_t index;
+    auto a = this->lock_bucket(hv, index);
+    spin_guard g(a->buckets[index].mtx, std::adopt_lock);
+
+    // Only an indexed item is safe to read, the rest of the log is dead.
+    if (!this->index_contains(a, index, it, hv)) {
+        return relocate_result::GONE;
     }
 
-    bucket.mtx.unlock();
-    return nullptr;
+    if (it->last_access.load(std::memory_order_relaxed) < evict_before) {
+        this->index_remove(a, index, it);
+        it->linked = false;
+
+        this->policy.on_remove(it);
+        this->nevictions.fetch_add(1, std::memory_order_relaxed);
+
+        epoch.retire(it);
+        return relocate_result::EVICTED;
+    }
+
+    item_ptr new_it;
+
+    if (it->on_flash()) {
+        flash_store::get_instance().retain(it->flash_page, it->data_size);
+        new_it = item::create_flash(it, it->flash_page, it->flash_offset);
+    } else if (it->shared) {
+        dedup_store::get_instance().retain(it->shared);
+        new_it = item::create_shared(it, it->shared);
+    } else if (!it->chained()) {
+        new_it = item::create(it, it->data_size);
+        std::memcpy(new_it->data, it->data, it->data_size);
+        new_it->raw_size = it->raw_size;
+    } else {
+        new_it = item::create(it, 0);
+
+        if (it->fragmented()) {
+            new_it->compact(it);
+        } else {
+            new_it->adopt_chain(it);
+        }
+    }
+
+    this->index_relocate(a, index, it, new_it);
+    return relocate_result::MOVED;
+}
+
+bool hash_table::replace_if_indexed(item_ptr it, item_ptr new_it) noexcept {
+    uint32_t index;
+    auto a = this->lock_bucket(it->hv, index);
+    spin_guard g(a->buckets[index].mtx, std::adopt_lock);
+
+    if (!this->index_contains(a, index, it, it->hv)) {
+        return false;
+    }
+
+    this->index_relocate(a, index, it, new_it);
+    return true;
+}
+
+void hash_table::index_relocate(bucket_array *a, uint32_t index, item_ptr it, item_ptr new_it)
+noexcept
+{
+    static auto& epoch = epoch_manager::get_instance();
+
+    new_it->created_at = it->created_at;
+    new_it->last_access = it->last_access.load(std::memory_order_relaxed);
+    new_it->cas_key = it->cas_key;
+    new_it->cost = it->cost;
+
+    new_it->linked = true;
+    this->index_replace(a, index, it, new_it);
+    it->linked = false;
+
+    this->policy.on_relocate(it, new_it);
+
+    epoch.retire(it);
+}
+
+void hash_table::evict() noexcept {
+    static auto& epoch = epoch_manager::get_instance();
+    static auto& setting = setting::get_instance();
+    static auto& store = segment_store::get_instance();
+    static auto& flash = flash_store::get_instance();
+
+    // Out of segments the cleaner is behind, a few extra evictions per write
+    // leave it dead space to reclaim.
+    unsigned extra = 0;
+    auto starved = [&] {
+        return setting.storage == storage_engine::LOG && store.starved() && extra++ < 4;
+    };
+
+    // Headers given another round, bounded in case the values are all far
+    // from the tail.
+    unsigned spared = 0;
+
+    while (this->policy.total_size() > this->memory_limit || starved()) {
+        auto it = this->policy.pick_victim();
+        if (!it) {
+            break;
+        }
+
+        // The value goes to flash and a header takes the item's place,
+        // copied before the bucket is locked.
+        item_ptr header = nullptr;
+        if (setting.flash_path && flash.eligible(it) && !it->expired(std::time(0))) {
+            header = flash.store(it);
+        }
+
+        {
+            uint32_t index;
+            auto a = this->lock_bucket(it->hv, index);
+            spin_guard g(a->buckets[index].mtx, std::adopt_lock);
+
+            // Lost a race with a delete or a replace, which retire it.
+            if (!it->linked.load()) {
+                if (header) {
+                    item::destroy(header);
+                }
+                continue;
+            }
+
+            if (header) {
+                this->index_relocate(a, index, it, header);
+                continue;
+            }
+
+            if (it->on_flash() && flash.headers_size() < this->memory_limit / 2
+                && spared++ < 64 && !it->expired(std::time(0)))
+            {
+                this->policy.on_insert(it);
+                continue;
+            }
+
+            this->index_remove(a, index, it);
+            it->linked = false;
+        }
+
+        this->nevictions.fetch_add(1, std::memory_order_relaxed);
+        epoch.retire(it);
+    }
 }
 
 item::~item() {
-    je_free(this->data);
+    if (this->on_flash()) {
+        auto &flash = flash_store::get_instance();
+        flash.remove_header(this->total_size());
+        flash.release(this->flash_page, this->data_size);
+    }
+
+    if (this->shared) {
+        dedup_store::get_instance().release(this->shared);
+    } else if (this->segment == segment_store::no_segment) {
+        je_free(this->data);
+    }
+
+    if (this->owns_chain) {
+        auto c = this->chain;
+        for (uint32_t i = 0; i < this->nchunks; i++) {
+            auto next = c->next.load(std::memory_order_relaxed);
+            value_chunk::destroy(c);
+            c = next;
+        }
+    }
 }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,187 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sysexits.h>
+
+#include <assoc.h>
+#include <swiss.h>
+#include <hash.h>
+
+using namespace cached;
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const size_t index_slots = 1 << 20;
+static const size_t index_lookups = 1 << 22;
+
+static std::vector<std::string> make_keys(size_t n, const char *prefix) {
+    std::vector<std::string> keys;
+    char buf[64];
+
+    keys.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        std::snprintf(buf, sizeof(buf), "%s:%zu:%zu", prefix, i, i * 2654435761u);
+        keys.emplace_back(buf);
+    }
+
+    return keys;
+}
+
+template<typename F>
+static double ns_per_lookup(std::vector<std::string> &keys, F find) {
+    size_t found = 0;
+    auto start = bench_clock::now();
+
+    for (size_t i = 0; i < index_lookups; i++) {
+        auto &key = keys[(i * 7919) % keys.size()];
+        found += find(key) != nullptr;
+    }
+
+    auto elapsed = std::chrono::duration<double, std::nano>(bench_clock::now() - start);
+
+    // Keep the lookups from being optimized away.
+    if (found == static_cast<size_t>(-1)) {
+        std::puts("");
+    }
+
+    return elapsed.count() / index_lookups;
+}
+
+// Compares the chained buckets with the swiss table engine at a fixed number
+// of slots, chained load factor being items per bucket.
+static void bench_index() {
+    static auto &hash_table = hash_table::get_instance();
+
+    std::printf("%-6s %-8s %12s %12s\n", "load", "engine", "hit ns/op", "miss ns/op");
+
+    for (auto lf : {0.5, 0.6, 0.7, 0.8, 0.9}) {
+        auto n = static_cast<size_t>(index_slots * lf);
+        auto keys = make_keys(n, "hit");
+        auto misses = make_keys(n, "miss");
+
+        std::vector<item_ptr> items;
+        items.reserve(n);
+        for (auto &k : keys) {
+            std::string key(k);
+            items.push_back(new item(key, 0, 0, 8));
+        }
+
+        auto buckets = bucket::new_table(index_slots);
+        for (auto it : items) {
+            buckets[it->hv & (index_slots - 1)].insert_item(it);
+        }
+
+        auto chained_find = [&](std::string &key) {
+            auto hv = hash_table.hash(key);
+            return buckets[hv & (index_slots - 1)].find(key, hv, nullptr);
+        };
+
+        std::printf("%-6.1f %-8s %12.1f %12.1f\n", lf, "chained",
+                    ns_per_lookup(keys, chained_find),
+                    ns_per_lookup(misses, chained_find));
+
+        bucket::delete_table(buckets, index_slots);
+
+        swiss_table swiss;
+        swiss.set_max_load_factor(0.95f);
+        swiss.reserve(index_slots);
+        for (auto it : items) {
+            swiss.insert(it, it->hv);
+        }
+
+        auto swiss_find = [&](std::string &key) {
+            return swiss.find(key, hash_table.hash(key), nullptr);
+        };
+
+        std::printf("%-6.1f %-8s %12.1f %12.1f\n", lf, "swiss",
+                    ns_per_lookup(keys, swiss_find),
+                    ns_per_lookup(misses, swiss_find));
+
+        for (auto it : items) {
+            delete it;
+        }
+    }
+}
+
+static const size_t hash_keys = 4096;
+static const size_t hash_rounds = 256;
+
+template<typename F>
+static void report_hash(const char *name, size_t len, F run) {
+    auto start = bench_clock::now();
+
+    for (size_t r = 0; r < hash_rounds; r++) {
+        run();
+    }
+
+    auto ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+    auto nkeys = static_cast<double>(hash_keys * hash_rounds);
+
+    std::printf("%-6zu %-14s %10.2f %10.2f\n", len, name, ns / nkeys, nkeys * len / ns);
+}
+
+// Hash throughput per key length, for every hash function one key at a time
+// and for murmur3 through the batch interface used by multigets.
+static void bench_hash() {
+    static const hash_function functions[] = {
+            hash_function::MURMUR3_32,
+            hash_function::MURMUR3_X64_128,
+            hash_function::CRC32C,
+            hash_function::WYHASH
+    };
+
+    std::vector<uint32_t> out(hash_keys);
+    std::vector<std::string> keys(hash_keys);
+    uint32_t sink = 0;
+
+    std::printf("%-6s %-14s %10s %10s\n", "len", "function", "ns/key", "GB/s");
+
+    for (size_t len : {8, 16, 32, 64, 128, 250}) {
+        for (size_t i = 0; i < hash_keys; i++) {
+            keys[i].resize(len);
+            for (size_t j = 0; j < len; j++) {
+                keys[i][j] = static_cast<char>('a' + (i * 31 + j * 7) % 26);
+            }
+        }
+
+        for (auto fn : functions) {
+            auto f = get_hash_func(fn);
+
+            report_hash(hash_function_name(fn), len, [&]() {
+                for (auto &key : keys) {
+                    sink += f(key.data(), key.size(), 42);
+                }
+            });
+        }
+
+        report_hash("murmur3 batch", len, [&]() {
+            hash_batch(hash_function::MURMUR3_32, keys.data(), keys.size(), 42, out.data());
+            sink += out[0];
+        });
+    }
+
+    if (sink == 1) {
+        std::puts("");
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <index|hash>\n", argv[0]);
+        return EX_USAGE;
+    }
+
+    if (std::strcmp(argv[1], "index") == 0) {
+        bench_index();
+    } else if (std::strcmp(argv[1], "hash") == 0) {
+        bench_hash();
+    } else {
+        std::fprintf(stderr, "unknown benchmark: %s\n", argv[1]);
+        return EX_USAGE;
+    }
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <bulk.h>
+
+namespace cached {
+
+namespace bulk {
+
+// Several blocks, so a reply is read with a few large reads.
+static const size_t read_size = 4 * 1024 * 1024;
+
+client::client() :
+fd(-1),
+buf(read_size),
+begin(0),
+end(0)
+{
+}
+
+client::~client() {
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+}
+
+bool client::connect(const char *host, const char *port) noexcept {
+    struct addrinfo *ai;
+    struct addrinfo hints;
+
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    auto error = getaddrinfo(host, port, &hints, &ai);
+    if (error != 0) {
+        if (error != EAI_SYSTEM) {
+            std::fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+        } else {
+            std::perror("getaddrinfo()");
+        }
+
+        return false;
+    }
+
+    for (auto p = ai; p; p = p->ai_next) {
+        int sfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (sfd == -1) {
+            continue;
+        }
+
+        if (::connect(sfd, p->ai_addr, p->ai_addrlen) == 0) {
+            int flags = 1;
+            setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &flags, sizeof(flags));
+
+            this->fd = sfd;
+            break;
+        }
+
+        close(sfd);
+    }
+
+    freeaddrinfo(ai);
+
+    if (this->fd == -1) {
+        std::fprintf(stderr, "cannot connect to %s:%s\n", host, port);
+        return false;
+    }
+
+    return true;
+}
+
+bool client::send(const char *data, size_t size) noexcept {
+    while (size > 0) {
+        auto n = write(this->fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            std::perror("write()");
+            return false;
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+bool client::fill() noexcept {
+    if (this->begin > 0) {
+        std::memmove(this->buf.data(), this->buf.data() + this->begin, this->end - this->begin);
+        this->end -= this->begin;
+        this->begin = 0;
+    }
+
+    if (this->end == this->buf.size()) {
+        this->buf.resize(this->buf.size() * 2);
+    }
+
+    while (true) {
+        auto n = read(this->fd, this->buf.data() + this->end, this->buf.size() - this->end);
+        if (n > 0) {
+            this->end += n;
+            return true;
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0) {
+            std::perror("read()");
+        } else {
+            std::fprintf(stderr, "connection closed by the server\n");
+        }
+
+        return false;
+    }
+}
+
+bool client::read_line(std::string &line) noexcept {
+    size_t scanned = this->begin;
+
+    while (true) {
+        auto data = this->buf.data();
+        auto nl = static_cast<char *>(std::memchr(data + scanned, '\n', this->end - scanned));
+
+        if (nl) {
+            size_t last = nl - data;
+            line.assign(data + this->begin,
+                        last - this->begin - (last > this->begin && data[last - 1] == '\r'));
+            this->begin = last + 1;
+            return true;
+        }
+
+        scanned = this->end - this->begin;
+
+        if (!this->fill()) {
+            return false;
+        }
+
+        scanned += this->begin;
+    }
+}
+
+bool client::read_data(std::vector<char> &out, size_t size) noexcept {
+    while (this->end - this->begin < size + 2) {
+        if (!this->fill()) {
+            return false;
+        }
+    }
+
+    out.assign(this->buf.data() + this->begin, this->buf.data() + this->begin + size);
+    this->begin += size + 2;
+    return true;
+}
+
+}
+
+}
@@ -0,0 +1,74 @@
+#include <cstring>
+
+#include <chain.h>
+#include <assoc.h>
+#include <epoch.h>
+
+#include <jemalloc.h>
+
+namespace cached {
+
+value_chunk *value_chunk::create(const char *data, size_t size) noexcept {
+    auto c = static_cast<value_chunk *>(je_malloc(sizeof(value_chunk) + size));
+
+    new (&c->next) std::atomic<value_chunk *>(nullptr);
+    c->size = size;
+
+    if (data) {
+        std::memcpy(c->bytes(), data, size);
+    }
+
+    return c;
+}
+
+void value_chunk::destroy(value_chunk *c) noexcept {
+    je_free(c);
+}
+
+void chain_compactor::schedule(item *it) noexcept {
+    std::call_once(this->started, [this] {
+        this->worker = std::thread(&chain_compactor::run, this);
+        this->worker.detach();
+    });
+
+    mtx_guard g(this->mtx);
+
+    // Still fragmented after its next append, it will be queued again.
+    if (this->pending.size() < max_pending) {
+        this->pending.emplace_back(it, it->hv);
+        this->cv.notify_one();
+    }
+}
+
+void chain_compactor::run() noexcept {
+    static auto &hash_table = hash_table::get_instance();
+
+    std::vector<std::pair<item *, uint32_t>> batch;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> l(this->mtx);
+            this->cv.wait(l, [this] {
+                return !this->pending.empty();
+            });
+
+            batch.swap(this->pending);
+        }
+
+        epoch_guard g;
+
+        for (auto &p : batch) {
+            if (hash_table.relocate_item(p.first, p.second) == relocate_result::MOVED) {
+                this->ncompacted.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        batch.clear();
+    }
+}
+
+void chain_compactor::stats(stats_writer &out) noexcept {
+    out.add("value_chains_compacted", this->ncompacted.load());
+}
+
+}
@@ -0,0 +1,196 @@
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
+#include <time.h>
+
+#include <compress.h>
+#include <setting.h>
+#include <assoc.h>
+#include <epoch.h>
+
+#include <lz4.h>
+
+namespace cached {
+
+// Smaller cold values do not pay for the header and the decoding.
+static const size_t min_cold_size = 128;
+
+static const std::chrono::milliseconds sweep_period(100);
+static const std::chrono::milliseconds sweep_slice(10);
+
+static uint64_t thread_cpu_ns() noexcept {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+value_codec::value_codec() :
+ncompressed(0),
+nincompressible(0),
+ndecompressed(0),
+ncold(0),
+bytes_in(0),
+bytes_out(0),
+compress_ns(0),
+decompress_ns(0)
+{
+}
+
+const char *value_codec::encode(const char *data, size_t size, size_t &encoded_size) noexcept {
+    thread_local std::vector<char> scratch;
+
+    // Anything longer than this is stored as it is.
+    auto limit = size - size / 8;
+    if (limit <= header_size || size > UINT32_MAX) {
+        return nullptr;
+    }
+
+    auto start = thread_cpu_ns();
+
+    scratch.resize(limit);
+    auto n = lz4_compress(data, size, scratch.data() + header_size, limit - header_size);
+
+    if (n > 0) {
+        for (unsigned i = 0; i < header_size; i++) {
+            scratch[i] = static_cast<char>(size >> (8 * i));
+        }
+
+        encoded_size = header_size + n;
+
+        this->ncompressed.fetch_add(1, std::memory_order_relaxed);
+        this->bytes_in.fetch_add(size, std::memory_order_relaxed);
+        this->bytes_out.fetch_add(encoded_size, std::memory_order_relaxed);
+    } else {
+        this->nincompressible.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    this->compress_ns.fetch_add(thread_cpu_ns() - start, std::memory_order_relaxed);
+    return n > 0 ? scratch.data() : nullptr;
+}
+
+item *value_codec::compress(std::string &key,
+                            uint32_t flags,
+                            unsigned int exptime,
+                            const char *data,
+                            size_t size) noexcept
+{
+    size_t n;
+    auto encoded = this->encode(data, size, n);
+    if (!encoded) {
+        return nullptr;
+    }
+
+    auto it = item::create(key, flags, exptime, encoded, n);
+    it->raw_size = size;
+
+    return it;
+}
+
+item *value_codec::compress(const item *from) noexcept {
+    size_t n;
+    auto encoded = this->encode(from->data, from->data_size, n);
+    if (!encoded) {
+        return nullptr;
+    }
+
+    auto it = item::create(from, n);
+    std::memcpy(it->data, encoded, n);
+    it->raw_size = from->data_size;
+
+    return it;
+}
+
+bool value_codec::decompress(const item *it, std::vector<char> &out) noexcept {
+    return this->decompress(it->data, it->data_size, it->raw_size, out);
+}
+
+bool value_codec::decompress(const char *data, size_t size, size_t raw_size,
+                             std::vector<char> &out) noexcept
+{
+    auto start = thread_cpu_ns();
+
+    out.resize(raw_size);
+    auto n = lz4_decompress(data + header_size, size - header_size, out.data(), out.size());
+
+    this->ndecompressed.fetch_add(1, std::memory_order_relaxed);
+    this->decompress_ns.fetch_add(thread_cpu_ns() - start, std::memory_order_relaxed);
+
+    return n >= 0 && static_cast<size_t>(n) == raw_size;
+}
+
+void value_codec::run(hash_table &table) noexcept {
+    static auto &setting = setting::get_instance();
+    static auto &epoch = epoch_manager::get_instance();
+
+    std::vector<item_ptr> items;
+    size_t cursor = 0;
+
+    while (true) {
+        std::this_thread::sleep_for(sweep_period - sweep_slice);
+
+        auto deadline = std::chrono::steady_clock::now() + sweep_slice;
+        auto cold_before = std::time(0) - setting.compress_cold_age;
+        epoch_guard g;
+
+        for (unsigned n = 1; ; n++) {
+            if (cursor >= table.bucket_count()) {
+                cursor = 0;
+                break;
+            }
+
+            items.clear();
+            table.bucket_items(static_cast<uint32_t>(cursor++), items);
+
+            for (auto it : items) {
+                if (it->chained() || it->compressed() || it->shared || it->on_flash()
+                    || it->data_size < min_cold_size
+                    || it->last_access.load(std::memory_order_relaxed) > cold_before)
+                {
+                    continue;
+                }
+
+                auto new_it = this->compress(it);
+                if (!new_it) {
+                    continue;
+                }
+
+                if (table.replace_if_indexed(it, new_it)) {
+                    this->ncold.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    item::destroy(new_it);
+                }
+            }
+
+            if (n % 16 == 0) {
+                epoch.quiescent();
+
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+void value_codec::start(hash_table &table) {
+    this->worker = std::thread(&value_codec::run, this, std::ref(table));
+    this->worker.detach();
+}
+
+void value_codec::stats(stats_writer &out) noexcept {
+    auto in = this->bytes_in.load();
+    auto stored = this->bytes_out.load();
+
+    out.add("compressed_items", this->ncompressed.load());
+    out.add("compressed_cold_items", this->ncold.load());
+    out.add("incompressible_items", this->nincompressible.load());
+    out.add("decompressed_items", this->ndecompressed.load());
+    out.add("compress_bytes_in", in);
+    out.add("compress_bytes_out", stored);
+    out.add("compress_ratio", stored ? static_cast<double>(in) / stored : 0.0);
+    out.add("compress_cpu_usec", this->compress_ns.load() / 1000);
+    out.add("decompress_cpu_usec", this->decompress_ns.load() / 1000);
+}
+
+}
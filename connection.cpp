@@ -1,20 +1,37 @@
 #include <list>
+#include <algorithm>
+#include <cinttypes>
 #include <cstdlib>
 #include <cstring>
 #include <string>
 #include <functional>
 
+#include <limits.h>
+#include <sys/uio.h>
+
 #include <ev.h>
 #include <jemalloc.h>
 
 #include <assoc.h>
+#include <stats.h>
+#include <eviction.h>
+#include <chain.h>
+#include <segment.h>
+#include <defrag.h>
+#include <compress.h>
+#include <dedup.h>
+#include <snapshot.h>
+#include <journal.h>
+#include <flash.h>
+#include <bulk.h>
+#include <lz4.h>
 #include <worker.h>
 #include <setting.h>
 #include <connection.h>
 
 namespace cached {
 
-static auto setting = setting::get_instance();
+static auto &setting = setting::get_instance();
 
 connection::connection(int fd, worker &w) :
 state(connection::conn_state::WAIT_CMD),
@@ -26,6 +43,15 @@ w_unwrite(0),
 ritem_saved(0),
 ritem_buf_len(0),
 ritem_buf(nullptr),
+ritem_chunked(false),
+rchain(nullptr),
+rchain_tail(nullptr),
+rchain_fill(0),
+get_reads(0),
+get_found(false),
+get_return_cas(false),
+dump_next(0),
+dump_records(0),
 parse_state_curr(connection::cmd_parse_state::SWALLOW_SPACE),
 next_parse_state(connection::cmd_parse_state::CMD_NAME),
 worker_base(w),
@@ -52,22 +78,22 @@ void connection::shrink() {
     if (this->r_unparsed > 0) {
         std::memmove(this->rbuf, this->rcurr, this->r_unparsed);
     }
-    this->rcurr = this->rbuf;
 
     if (this->r_unparsed < this->r_size / 2) {
-        this->r_size = std::max(setting.conn_write_buffer_size, this->r_unparsed * 2);
+        this->r_size = std::max(setting.conn_read_buffer_size, this->r_unparsed * 2);
         this->rbuf = static_cast<char *>(je_realloc(this->rbuf, this->r_size));
     }
+    this->rcurr = this->rbuf;
 
     if (this->w_unwrite > 0) {
         std::memmove(this->wbuf, this->wcurr, this->w_unwrite);
     }
-    this->wcurr = this->wbuf;
 
     if (this->w_unwrite < this->w_size / 2) {
         this->w_size = std::max(setting.conn_write_buffer_size, this->w_unwrite * 2);
         this->wbuf = static_cast<char *>(je_realloc(this->wbuf, this->w_size));
     }
+    this->wcurr = this->wbuf;
 
 }
 
@@ -81,10 +107,21 @@ void connection::drive_machine(EV_P_ ev_io *w, int revents) noexcept {
         switch (conn.state) {
             case conn_state::WAIT_CMD:
                 if (--n_req <= 0) {
+                    // Other connections get their turn, what is already
+                    // buffered is not announced again.
+                    if (conn.r_unparsed > 0) {
+                        ev_feed_event(EV_A_ &conn.read_evio, EV_READ);
+                    }
+
                     return;
                 }
 
                 conn.shrink();
+
+                // Pipelined commands may already be buffered.
+                if (conn.r_unparsed > 0) {
+                    conn.state = conn_state::PARSE_CMD;
+                }
                 break;
 
             case conn_state::READ_CMD_BUF:
@@ -103,6 +140,8 @@ void connection::drive_machine(EV_P_ ev_io *w, int revents) noexcept {
                     case read_cmd_result::NOTHING:
                         if (conn.r_unparsed > unparsed_before) {
                             conn.state = conn_state::PARSE_CMD;
+                        } else {
+                            conn.worker_base.conn_idle(conn);
                         }
                         return;
                 }
@@ -120,11 +159,20 @@ void connection::drive_machine(EV_P_ ev_io *w, int revents) noexcept {
 
                     case cmd_parse_result::FINISH:
                         conn.execute_command();
+
+                        // Resumed by flash_read_done().
+                        if (conn.state == conn_state::WAIT_IO) {
+                            return;
+                        }
+
                         conn.state = conn_state::WAIT_CMD;
                         break;
                 }
                 break;
 
+            case conn_state::WAIT_IO:
+                return;
+
             default:
                 break;
         }
@@ -183,12 +231,19 @@ connection::read_cmd_result connection::try_read_command() noexcept {
 }
 
 // StorageCommand:
-//    (set | add | replace | append | prepend) Key Flags Exptime ItemSize \r\n Item \r\n
+//    (set | add | replace | append | prepend) Key Flags Exptime ItemSize [Cost] \r\n Item \r\n
 //    cas Key Flags Exptime Bytes CasKey \r\n Bytes \r\n
 //    delete Key \r\n
 //
 // RetrievalCommand:
 //    (get | gets) Key+ \r\n
+//
+// ScanCommand:
+//    scan Cursor [Count] \r\n
+//
+// BulkCommand:
+//    dump From To \r\n
+//    load Records RawSize Size Age \r\n Block \r\n
 connection::cmd_parse_result connection::try_parse_command() noexcept {
     auto static const & setting = setting::get_instance();
 
@@ -197,8 +252,6 @@ connection::cmd_parse_result connection::try_parse_command() noexcept {
     }
 
     size_t count;
-    char *end, *cr, *dest;
-    std::string key_curr;
     cmd_parse_result np_result;
 
     while (this->r_unparsed > 0 || this->parse_state_curr == cmd_parse_state::SUCCESS)
@@ -223,6 +276,14 @@ connection::cmd_parse_result connection::try_parse_command() noexcept {
                     cmd_parse_success:
                     this->parse_state_curr = cmd_parse_state::SWALLOW_SPACE;
                     this->cmd_key.clear();
+                    this->cmd_cost = 1;
+
+                    // Parsed like a storage command without a key, the
+                    // numbers going to the flags, exptime, size and cost.
+                    if (this->cmd_curr == cmd_type::LOAD) {
+                        this->next_parse_state = cmd_parse_state::FLAG;
+                        this->cmd_cost = 0;
+                    }
                 } else {
                     return cmd_parse_result::BUF_EMPTY;
                 }
@@ -231,7 +292,10 @@ connection::cmd_parse_result connection::try_parse_command() noexcept {
             case cmd_parse_state::KEY:
                 if (this->cmd_curr == cmd_type::GET
                     || this->cmd_curr == cmd_type::GETS
-                    || this->cmd_curr == cmd_type::DELETE)
+                    || this->cmd_curr == cmd_type::DELETE
+                    || this->cmd_curr == cmd_type::STATS
+                    || this->cmd_curr == cmd_type::SCAN
+                    || this->cmd_curr == cmd_type::DUMP)
                 {
                     this->next_parse_state = cmd_parse_state::KEY;
                 } else {
@@ -245,12 +309,15 @@ connection::cmd_parse_result connection::try_parse_command() noexcept {
                     {
                         if (this->cmd_curr == cmd_type::GET
                             || this->cmd_curr == cmd_type::GETS
-                            || this->cmd_curr == cmd_type::DELETE)
+                            || this->cmd_curr == cmd_type::DELETE
+                            || this->cmd_curr == cmd_type::STATS
+                            || this->cmd_curr == cmd_type::SCAN
+                            || this->cmd_curr == cmd_type::DUMP)
                         {
-                            if (key_curr.size() > 0) {
-                                this->cmd_key.push_back(key_curr);
+                            if (this->keybuf.size() > 0) {
+                                this->cmd_key.push_back(this->keybuf);
                                 this->cmd_key.shrink_to_fit();
-                                key_curr.clear();
+                                this->keybuf.clear();
                             }
 
                             this->parse_state_curr = cmd_parse_state::SWALLOW_NEW_LINE;
@@ -261,19 +328,19 @@ connection::cmd_parse_result connection::try_parse_command() noexcept {
                         }
                     }
 
-                    key_curr.append(this->rcurr++, 1);
+                    this->keybuf.append(this->rcurr++, 1);
                     this->r_unparsed--;
                 }
 
-                if (key_curr.size() > setting.max_key_len) {
+                if (this->keybuf.size() > setting.max_key_len) {
                     return cmd_parse_result::ERROR;
                 }
 
                 if (this->r_unparsed > 0 && *this->rcurr == ' ') {
                     this->parse_state_curr = cmd_parse_state::SWALLOW_SPACE;
-                    this->cmd_key.push_back(key_curr);
+                    this->cmd_key.push_back(this->keybuf);
                     this->cmd_key.shrink_to_fit();
-                    key_curr.clear();
+                    this->keybuf.clear();
                 }
 
                 break;
@@ -314,6 +381,25 @@ connection::cmd_parse_result connection::try_parse_command() noexcept {
 
                 break;
 
+            case cmd_parse_state::COST:
+                this->next_parse_state = cmd_parse_state::ITEM;
+
+                // Trailing spaces without a cost.
+                if (*this->rcurr == '\r') {
+                    this->parse_state_curr = cmd_parse_state::SWALLOW_NEW_LINE;
+                    break;
+                }
+
+                if ((np_result = this->try_parse_number(this->cmd_cost))
+                    == cmd_parse_result::FINISH)
+                {
+                    this->parse_state_curr = cmd_parse_state::SWALLOW_NEW_LINE;
+                } else {
+                    return np_result;
+                }
+
+                break;
+
             case cmd_parse_state::ITEM_SIZE:
                 if (this->cmd_curr == cmd_type::CAS) {
                     this->next_parse_state = cmd_parse_state::CAS_KEY;
@@ -324,17 +410,36 @@ connection::cmd_parse_result connection::try_parse_command() noexcept {
                 if ((np_result = this->try_parse_number(this->cmd_item_size))
                     == cmd_parse_result::FINISH)
                 {
-                    if (this->cmd_item_size > setting.max_item_size) {
+                    auto limit = this->cmd_curr == cmd_type::LOAD
+                                 ? bulk::block_limit(setting.max_item_size)
+                                 : setting.max_item_size;
+
+                    if (this->cmd_item_size > limit) {
                         return cmd_parse_result::ERROR;
                     } else {
                         if (this->cmd_curr == cmd_type::CAS) {
                             this->parse_state_curr = cmd_parse_state::SWALLOW_SPACE;
+                        } else if (*this->rcurr == ' ') {
+                            this->parse_state_curr = cmd_parse_state::SWALLOW_SPACE;
+                            this->next_parse_state = cmd_parse_state::COST;
                         } else {
                             this->parse_state_curr = cmd_parse_state::SWALLOW_NEW_LINE;
                         }
 
                         this->ritem_saved = 0;
-                        if (this->cmd_item_size != this->ritem_buf_len) {
+                        this->release_rchain();
+
+                        // Large values stream into chunks as they arrive.
+                        this->ritem_chunked = this->cmd_item_size > setting.value_chunk_size
+                                              && this->cmd_curr != cmd_type::LOAD;
+
+                        // An empty value keeps the buffer, realloc() would
+                        // free it.
+                        if (!this->ritem_chunked && this->cmd_item_size == 0) {
+                            this->ritem_buf_len = 0;
+                        } else if (!this->ritem_chunked
+                                   && this->cmd_item_size != this->ritem_buf_len)
+                        {
                             this->ritem_buf =
                                     static_cast<char *>(
                                             je_realloc(this->ritem_buf,
@@ -353,40 +458,17 @@ connection::cmd_parse_result connection::try_parse_command() noexcept {
 
 
             case cmd_parse_state::ITEM:
-                this->next_parse_state = cmd_parse_state::SUCCESS;
-
-                end = this->rcurr + this->r_unparsed - 1;
-                cr = static_cast<char *>(std::memchr(this->rcurr, '\r',
-                                                           this->r_unparsed));
-                if (cr == NULL) {
-                    count = this->r_unparsed;
-                } else if (end - cr > 0) {
-                    if (cr[1] == '\n') {
-                        count = cr - this->rcurr;
-                        this->parse_state_curr = this->next_parse_state;
-                    } else {
-                        count = (cr + 1) - this->rcurr + 1;
-                    }
-                } else if (cr == this->rcurr) {
-                    return cmd_parse_result::BUF_EMPTY;
-                } else { // cr == this->rcurr + this->r_unparsed - 1
-                    count = cr - this->rcurr;
-                }
+                // Exactly the size announced, values may hold \r\n.
+                count = std::min(this->r_unparsed, this->cmd_item_size - this->ritem_saved);
 
-                if (this->ritem_saved + count > this->ritem_buf_len) {
-                    return cmd_parse_result::ERROR;
-                }
-
-                std::memmove(this->ritem_buf + this->ritem_saved, this->rcurr, count);
-                this->ritem_saved += count;
+                this->ritem_store(this->rcurr, count);
 
+                this->rcurr += count;
                 this->r_unparsed -= count;
 
-                if (this->parse_state_curr != cmd_parse_state::SUCCESS) {
-                    this->rcurr += count;
-                } else {
-                    this->rcurr += count + 2;
-                    this->r_unparsed -= 2;
+                if (this->ritem_saved == this->cmd_item_size) {
+                    this->parse_state_curr = cmd_parse_state::SWALLOW_NEW_LINE;
+                    this->next_parse_state = cmd_parse_state::SUCCESS;
                 }
 
                 break;
@@ -442,6 +524,14 @@ void connection::execute_command() noexcept {
         this->execute_gets();
     } else if (this->cmd_curr == cmd_type::DELETE) {
         this->execute_delete();
+    } else if (this->cmd_curr == cmd_type::STATS) {
+        this->execute_stats();
+    } else if (this->cmd_curr == cmd_type::SCAN) {
+        this->execute_scan();
+    } else if (this->cmd_curr == cmd_type::DUMP) {
+        this->execute_dump();
+    } else if (this->cmd_curr == cmd_type::LOAD) {
+        this->execute_load();
     } else {
         auto it = hash_table.find_item(this->cmd_key[0], bp);
         if (!it) {
@@ -458,13 +548,6 @@ void connection::execute_command() noexcept {
 
         it->last_access = std::time(0);
 
-        if (this->cmd_curr == cmd_type::CAS) {
-            this->execute_cas(it, bp);
-            return;
-        }
-
-        it->update_cas_key();
-
         switch (this->cmd_curr) {
             case cmd_type::SET:
             case cmd_type::REPLACE:
@@ -479,63 +562,239 @@ void connection::execute_command() noexcept {
                 this->execute_prepend_or_append(it, bp, true);
                 break;
 
+            case cmd_type::CAS:
+                this->execute_cas(it, bp);
+                break;
+
             case cmd_type::ADD:
                 this->wbuf_append("EXISTS\r\n");
+                bp->unlock();
                 break;
 
             default:
+                bp->unlock();
                 break;
         }
     }
 }
 
+// VALUE <key> <flags> <bytes> [<cas unique>]\r\n
+static void format_value_line(char *buf, const std::string &key, uint32_t flags, size_t size,
+                              bool return_cas, uint64_t cas_key) noexcept
+{
+    if (return_cas) {
+        std::sprintf(buf,
+                     "VALUE %s %u %zu %" PRIu64 "\r\n",
+                     key.c_str(),
+                     flags,
+                     size,
+                     cas_key);
+    } else {
+        std::sprintf(buf,
+                     "VALUE %s %u %zu\r\n",
+                     key.c_str(),
+                     flags,
+                     size);
+    }
+}
+
 void connection::execute_get(bool return_cas) noexcept {
     static auto &hash_table = hash_table::get_instance();
+    static auto &codec = value_codec::get_instance();
 
-    bool found = false;
-    bucket *bp;
     item_ptr it;
 
-    // VALUE <key> <flags> <bytes> [<cas unique>]\r\n
     char buf[5 + 1 + 250 + 1 + 10 + 1 + 10 + 1 + 20 + 2 + 1];
 
-    for (auto& key : this->cmd_key) {
-        if ((it = hash_table.find_item(key, bp))) {
-            found = true;
-
-            if (return_cas) {
-                std::sprintf(buf,
-                             "VALUE %s %d %ld %lld\r\n",
-                             it->key.c_str(),
-                             it->flags,
-                             it->data_size,
-                             it->cas_key);
+    this->get_found = false;
+    this->get_return_cas = return_cas;
+
+    // Hash the whole multiget up front so the bucket lines can be fetched
+    // while the earlier keys are being served.
+    auto nkeys = this->cmd_key.size();
+    this->cmd_hv.resize(nkeys);
+    hash_table.hash_batch(this->cmd_key.data(), nkeys, this->cmd_hv.data());
+
+    for (size_t i = 0; i < nkeys; i++) {
+        hash_table.prefetch(this->cmd_hv[i]);
+    }
+
+    for (size_t i = 0; i < nkeys; i++) {
+        auto &key = this->cmd_key[i];
+
+        if ((it = hash_table.find_item_nolock(key, this->cmd_hv[i]))) {
+            // Answered in order, after the value read back from flash.
+            if (it->on_flash() || !this->get_slots.empty()) {
+                this->defer_get(key, it, nkeys);
+                continue;
+            }
+
+            auto flags = it->flags;
+            auto size = it->data_size;
+            bool decoded = false;
+
+            // The compress flag of an item tells its client whether the value
+            // is sent compressed, other clients get it decoded.
+            if (!it->compressed()) {
+                flags &= ~setting.compress_flag;
+            } else if (!(flags & setting.compress_flag)) {
+                if (!codec.decompress(it, this->wvalue)) {
+                    continue;
+                }
+
+                size = it->raw_size;
+                decoded = true;
+            }
+
+            this->get_found = true;
+
+            format_value_line(buf, key, flags, size, return_cas, it->cas_key);
+
+            // One gather write per item, straight from its value.
+            this->wiov.clear();
+            this->wiov.push_back({buf, std::strlen(buf)});
+
+            if (decoded) {
+                this->wiov.push_back({this->wvalue.data(), size});
             } else {
-                std::sprintf(buf,
-                             "VALUE %s %d %ld\r\n",
-                             it->key.c_str(),
-                             it->flags,
-                             it->data_size);
+                it->for_each_piece([this](const char *data, size_t size) {
+                    this->wiov.push_back({const_cast<char *>(data), size});
+                });
             }
 
-            this->wbuf_append(buf, std::strlen(buf));
-            this->wbuf_append(it->data, it->data_size);
-            this->wbuf_append("\r\n");
+            this->wiov.push_back({const_cast<char *>("\r\n"), 2});
+            this->wbuf_appendv(this->wiov.data(), this->wiov.size());
+        }
+    }
 
-            bp->unlock();
+    // Further requests wait in the socket until the reads are done.
+    if (this->get_reads > 0) {
+        this->state = conn_state::WAIT_IO;
+        ev_io_stop(this->worker_base.evloop, &this->read_evio);
+        return;
+    }
+
+    this->finish_get();
+}
+
+void connection::defer_get(std::string &key, const item *it, size_t nkeys) noexcept {
+    static auto &flash = flash_store::get_instance();
+
+    // The I/O threads hold on to the reads, the slots must not move.
+    if (this->get_slots.empty()) {
+        this->get_slots.reserve(nkeys);
+    }
+
+    this->get_slots.emplace_back();
+
+    auto &slot = this->get_slots.back();
+    slot.key = key;
+    slot.flags = it->flags;
+    slot.cas_key = it->cas_key;
+    slot.raw_size = it->raw_size;
+
+    auto &r = slot.read;
+
+    // Copied, the worker goes offline before the slot is answered.
+    if (!it->on_flash()) {
+        r.value.clear();
+        it->for_each_piece([&r](const char *data, size_t size) {
+            r.value.insert(r.value.end(), data, data + size);
+        });
+
+        r.ok = true;
+        return;
+    }
+
+    this->locate_read(r, it);
+
+    if (!flash.read(&r)) {
+        this->get_reads++;
+    }
+}
+
+void connection::locate_read(flash_read &r, const item *it) noexcept {
+    r.page = it->flash_page;
+    r.offset = it->flash_offset;
+    r.hv = it->hv;
+    r.size = it->data_size;
+    r.ok = false;
+    r.owner = this;
+    r.complete = connection::flash_complete;
+}
+
+void connection::finish_get() noexcept {
+    static auto &codec = value_codec::get_instance();
+
+    char buf[5 + 1 + 250 + 1 + 10 + 1 + 10 + 1 + 20 + 2 + 1];
+
+    for (auto &slot : this->get_slots) {
+        // Gone from flash in the meantime, a miss.
+        if (!slot.read.ok) {
+            continue;
         }
+
+        auto flags = slot.flags;
+        auto data = slot.read.value.data();
+        auto size = slot.read.value.size();
+
+        if (!slot.raw_size) {
+            flags &= ~setting.compress_flag;
+        } else if (!(flags & setting.compress_flag)) {
+            if (!codec.decompress(data, size, slot.raw_size, this->wvalue)) {
+                continue;
+            }
+
+            data = this->wvalue.data();
+            size = slot.raw_size;
+        }
+
+        this->get_found = true;
+
+        format_value_line(buf, slot.key, flags, size, this->get_return_cas, slot.cas_key);
+
+        this->wiov.clear();
+        this->wiov.push_back({buf, std::strlen(buf)});
+        this->wiov.push_back({data, size});
+        this->wiov.push_back({const_cast<char *>("\r\n"), 2});
+        this->wbuf_appendv(this->wiov.data(), this->wiov.size());
     }
 
-    if (found) {
+    this->get_slots.clear();
+
+    if (this->get_found) {
         this->wbuf_append("END\r\n");
     } else {
         this->wbuf_append("NOT_FOUND\r\n");
     }
 }
 
+void connection::flash_complete(flash_read *r) noexcept {
+    auto conn = static_cast<connection *>(r->owner);
+    conn->worker_base.flash_complete(r);
+}
+
+void connection::flash_read_done(flash_read *r) noexcept {
+    if (--this->get_reads > 0) {
+        return;
+    }
+
+    if (this->cmd_curr == cmd_type::DUMP) {
+        this->finish_dump();
+    } else {
+        this->finish_get();
+    }
+
+    this->state = conn_state::WAIT_CMD;
+    ev_io_start(this->worker_base.evloop, &this->read_evio);
+
+    // Pipelined requests already read are not announced again.
+    ev_feed_event(this->worker_base.evloop, &this->read_evio, EV_READ);
+}
+
 void connection::execute_delete() noexcept {
     static auto &hash_table = hash_table::get_instance();
-    static auto &lru_queue = lru_queue::get_instance();
+    static auto &journal = journal::get_instance();
 
     bucket *bp;
     item_ptr it;
@@ -543,118 +802,729 @@ void connection::execute_delete() noexcept {
 
     for (auto &key : this->cmd_key) {
         if ((it = hash_table.find_item(key, bp, false))) {
-            std::sprintf(buf, "DELETED %s\r\n", it->key.c_str());
+            std::sprintf(buf, "DELETED %s\r\n", key.c_str());
 
-            bp->remove(it);
+            hash_table.remove_item(*bp, it);
+            journal.remove(journal.next_seq(), key);
             bp->unlock();
 
-            lru_queue.remove_with_lock(it);
+            this->wbuf_append(buf, 10 + key.size());
+        }
+    }
+}
+
+// KEY <key>\r\n for each key found, then CURSOR <cursor>\r\n to pass to
+// the next scan, 0 once every bucket was visited. Buckets are visited until
+// count keys were found or ten times as many buckets were, so sparse parts
+// of the table do not make for a long reply.
+void connection::execute_scan() noexcept {
+    static auto &hash_table = hash_table::get_instance();
+
+    if (this->cmd_key.empty() || this->cmd_key.size() > 2) {
+        this->wbuf_append("CLIENT_ERROR bad command line format\r\n");
+        return;
+    }
+
+    char *end;
+    auto cursor = std::strtoul(this->cmd_key[0].c_str(), &end, 10);
+    auto bad = *end || cursor > UINT32_MAX;
 
-            this->wbuf_append(buf, 10 + it->key.size());
+    unsigned long count = 10;
+    if (this->cmd_key.size() == 2) {
+        count = std::strtoul(this->cmd_key[1].c_str(), &end, 10);
+        bad = bad || *end || count == 0;
+    }
+
+    if (bad) {
+        this->wbuf_append("CLIENT_ERROR bad command line format\r\n");
+        return;
+    }
+
+    // Digest keyed items only know their key with key_verify.
+    if (setting.key_digest && !setting.key_verify) {
+        this->wbuf_append("SERVER_ERROR keys are not stored\r\n");
+        return;
+    }
+
+    std::vector<item_ptr> items;
+    auto now = std::time(0);
+    auto next = static_cast<uint32_t>(cursor);
+    unsigned long found = 0;
+
+    for (unsigned long visited = 0; found < count && visited < count * 10; visited++) {
+        items.clear();
+        next = hash_table.scan(next, items);
+
+        for (auto it : items) {
+            if (it->expired(now)) {
+                continue;
+            }
+
+            this->wbuf_append("KEY ");
+            this->wbuf_append(it->key.data(), it->key.size());
+            this->wbuf_append("\r\n");
+            found++;
+        }
+
+        if (next == 0) {
+            break;
         }
     }
+
+    char buf[32];
+    auto n = std::sprintf(buf, "CURSOR %u\r\n", next);
+    this->wbuf_append(buf, n);
 }
 
-void connection::execute_cas(item_ptr &it, bucket *&bp) noexcept {
-    if (this->cmd_cas_key == it->cas_key) {
-        it->update_cas_key();
+// BLOCK <next> <nrecords> <raw_size> <size>\r\n<size bytes>\r\n with the
+// items positioned in [from, to) in position order, a bucket at a time, until
+// the block is full or the range done, see bulk.h.
+void connection::execute_dump() noexcept {
+    static auto &hash_table = hash_table::get_instance();
+    static auto &codec = value_codec::get_instance();
+    static auto &flash = flash_store::get_instance();
+
+    if (this->cmd_key.size() != 2) {
+        this->wbuf_append("CLIENT_ERROR bad command line format\r\n");
+        return;
+    }
+
+    char *end, *end2;
+    uint64_t from = std::strtoull(this->cmd_key[0].c_str(), &end, 10);
+    uint64_t to = std::strtoull(this->cmd_key[1].c_str(), &end2, 10);
+
+    if (*end || *end2 || from >= to || to > bulk::end_position) {
+        this->wbuf_append("CLIENT_ERROR bad command line format\r\n");
+        return;
+    }
+
+    if (setting.key_digest && !setting.key_verify) {
+        this->wbuf_append("SERVER_ERROR keys are not stored\r\n");
+        return;
+    }
+
+    std::vector<item_ptr> items;
+    auto now = std::time(0);
+    auto &raw = this->bulk_raw;
+    uint32_t nrecords = 0;
+    uint64_t pos = from;
+
+    raw.clear();
+
+    // Bytes the records of the values on flash will take once read.
+    size_t deferred = 0;
+    uint64_t last = bulk::end_position;
+
+    while (pos < to && raw.size() + deferred < bulk::block_size) {
+        items.clear();
+        auto first = pos;
+        pos = hash_table.walk(pos, items);
+
+        // In position order, so a full block can end within the bucket.
+        std::sort(items.begin(), items.end(), [](item_ptr a, item_ptr b) {
+            return hash_table::position(a->hv) < hash_table::position(b->hv);
+        });
+
+        for (auto it : items) {
+            uint64_t p = hash_table::position(it->hv);
+            if (p < first || p >= to || it->expired(now)) {
+                continue;
+            }
+
+            // Items sharing a hash value go in the same block.
+            if (raw.size() + deferred >= bulk::block_size && p != last) {
+                pos = p;
+                break;
+            }
+
+            last = p;
 
-        auto new_data = je_realloc(it->data, this->ritem_buf_len);
-        if (!new_data) {
-            this->wbuf_append("ERROR\r\n");
+            uint32_t ttl = 0;
+
+            if (it->exptime > static_cast<time_t>(setting.max_exptime)) {
+                ttl = static_cast<uint32_t>(it->exptime - now);
+            } else if (it->exptime > 0) {
+                ttl = static_cast<uint32_t>(it->created_at + it->exptime - now);
+            }
+
+            // Read back like for a get, the loop does not wait for flash.
+            if (it->on_flash()) {
+                this->get_slots.emplace_back();
+
+                auto &slot = this->get_slots.back();
+                slot.key = it->key;
+                slot.flags = it->flags;
+                slot.raw_size = it->raw_size;
+                slot.ttl = ttl;
+                this->locate_read(slot.read, it);
+
+                deferred += sizeof(bulk::record_header) + it->key.size()
+                            + (it->compressed() ? it->raw_size : it->data_size);
+                continue;
+            }
+
+            const char *value = nullptr;
+            size_t value_size = it->data_size;
+
+            if (it->compressed()) {
+                if (!codec.decompress(it, this->wvalue)) {
+                    continue;
+                }
+
+                value = this->wvalue.data();
+                value_size = it->raw_size;
+            }
+
+            bulk::record_header r;
+            r.flags = it->flags;
+            r.key_size = static_cast<uint16_t>(it->key.size());
+            r.ttl = ttl;
+            r.value_size = static_cast<uint32_t>(value_size);
+
+            auto header = reinterpret_cast<const char *>(&r);
+            raw.insert(raw.end(), header, header + sizeof(r));
+            raw.insert(raw.end(), it->key.begin(), it->key.end());
+
+            if (value) {
+                raw.insert(raw.end(), value, value + value_size);
+            } else {
+                it->for_each_piece([&raw](const char *data, size_t size) {
+                    raw.insert(raw.end(), data, data + size);
+                });
+            }
+
+            nrecords++;
+        }
+    }
+
+    this->dump_next = std::min(pos, to);
+    this->dump_records = nrecords;
+
+    // Started once the slots stop moving, the I/O threads hold on to them.
+    for (auto &slot : this->get_slots) {
+        if (!flash.read(&slot.read)) {
+            this->get_reads++;
+        }
+    }
+
+    // Further requests wait in the socket until the reads are done.
+    if (this->get_reads > 0) {
+        this->state = conn_state::WAIT_IO;
+        ev_io_stop(this->worker_base.evloop, &this->read_evio);
+        return;
+    }
+
+    this->finish_dump();
+}
+
+void connection::finish_dump() noexcept {
+    static auto &codec = value_codec::get_instance();
+
+    auto &raw = this->bulk_raw;
+
+    for (auto &slot : this->get_slots) {
+        // Gone from flash in the meantime.
+        if (!slot.read.ok) {
+            continue;
+        }
+
+        auto value = slot.read.value.data();
+        auto value_size = slot.read.value.size();
+
+        if (slot.raw_size) {
+            if (!codec.decompress(value, value_size, slot.raw_size, this->wvalue)) {
+                continue;
+            }
+
+            value = this->wvalue.data();
+            value_size = slot.raw_size;
+        }
+
+        bulk::record_header r;
+        r.flags = slot.flags;
+        r.key_size = static_cast<uint16_t>(slot.key.size());
+        r.ttl = slot.ttl;
+        r.value_size = static_cast<uint32_t>(value_size);
+
+        auto header = reinterpret_cast<const char *>(&r);
+        raw.insert(raw.end(), header, header + sizeof(r));
+        raw.insert(raw.end(), slot.key.begin(), slot.key.end());
+        raw.insert(raw.end(), value, value + value_size);
+
+        this->dump_records++;
+    }
+
+    this->get_slots.clear();
+
+    // Sent as is unless it gets smaller.
+    auto &packed = this->bulk_packed;
+    packed.resize(raw.size());
+
+    auto data = packed.data();
+    auto size = raw.empty() ? 0 : lz4_compress(raw.data(), raw.size(), data, raw.size() - 1);
+
+    if (size == 0) {
+        data = raw.data();
+        size = raw.size();
+    }
+
+    char buf[96];
+    auto n = std::sprintf(buf, "BLOCK %llu %u %zu %zu\r\n",
+                          static_cast<unsigned long long>(this->dump_next),
+                          this->dump_records, raw.size(), size);
+
+    struct iovec iov[3] = {
+            {buf, static_cast<size_t>(n)},
+            {data, size},
+            {const_cast<char *>("\r\n"), 2}
+    };
+
+    this->wbuf_appendv(iov, 3);
+}
+
+// Stores the records of a dumped block like sets, LOADED <n>\r\n with the
+// number stored. Those whose time to live ran out during the age of the
+// block are left out.
+void connection::execute_load() noexcept {
+    static auto &hash_table = hash_table::get_instance();
+    static auto &codec = value_codec::get_instance();
+    static auto &journal = journal::get_instance();
+
+    auto nrecords = this->cmd_flag;
+    size_t raw_size = this->cmd_exptime;
+    auto age = this->cmd_cost;
+
+    if (raw_size > bulk::block_limit(setting.max_item_size)) {
+        this->wbuf_append("CLIENT_ERROR bad data chunk\r\n");
+        return;
+    }
+
+    const char *p = this->ritem_buf;
+
+    if (raw_size != this->cmd_item_size) {
+        this->bulk_raw.resize(raw_size);
+
+        auto n = lz4_decompress(this->ritem_buf, this->cmd_item_size,
+                                this->bulk_raw.data(), raw_size);
+        if (n < 0 || static_cast<size_t>(n) != raw_size) {
+            this->wbuf_append("CLIENT_ERROR bad data chunk\r\n");
+            return;
+        }
+
+        p = this->bulk_raw.data();
+    }
+
+    auto end = p + raw_size;
+    auto now = std::time(0);
+    uint32_t nloaded = 0;
+
+    for (uint32_t i = 0; i < nrecords; i++) {
+        bulk::record_header r;
+
+        if (static_cast<size_t>(end - p) < sizeof(r)) {
+            break;
+        }
+
+        std::memcpy(&r, p, sizeof(r));
+        p += sizeof(r);
+
+        if (static_cast<size_t>(end - p) < static_cast<size_t>(r.key_size) + r.value_size) {
+            break;
+        }
+
+        std::string key(p, r.key_size);
+        auto value = p + r.key_size;
+        p = value + r.value_size;
+
+        if (r.key_size == 0 || r.key_size > setting.max_key_len
+            || r.value_size > setting.max_item_size
+            || (r.ttl > 0 && r.ttl <= age))
+        {
+            continue;
+        }
+
+        unsigned int exptime = 0;
+        if (r.ttl > 0) {
+            exptime = r.ttl - age;
+
+            if (exptime > setting.max_exptime) {
+                exptime += static_cast<unsigned int>(now);
+            }
+        }
+
+        // Stored like a value just read from a client.
+        std::string k(key);
+        item_ptr it = nullptr;
+
+        if (setting.compress_min_size > 0 && r.value_size >= setting.compress_min_size
+            && r.value_size <= setting.value_chunk_size)
+        {
+            it = codec.compress(k, r.flags, exptime, value, r.value_size);
+        }
+
+        if (!it) {
+            it = snapshot_manager::build_item(k, r.flags, exptime, value, r.value_size, 0);
+        }
+
+        bucket *bp;
+        auto old = hash_table.find_item(key, bp, false);
+
+        if (old) {
+            it->cas_key = old->cas_key;
+            it->update_cas_key();
+
+            hash_table.replace_item(*bp, old, it);
+            journal.put(journal.next_seq(), key, it);
+            bp->unlock();
+
+            hash_table.evict();
         } else {
-            std::memmove(it->data, this->ritem_buf, this->ritem_buf_len);
-            it->data_size = this->ritem_buf_len;
-            this->wbuf_append("STORED\r\n");
+            hash_table.insert_item(it, [&]() {
+                journal.put(journal.next_seq(), key, it);
+            });
         }
+
+        nloaded++;
+    }
+
+    char buf[32];
+    auto n = std::sprintf(buf, "LOADED %u\r\n", nloaded);
+    this->wbuf_append(buf, n);
+}
+
+void connection::execute_stats() noexcept {
+    static auto &hash_table = hash_table::get_instance();
+    static auto &policy = eviction_policy::get_instance();
+
+    stats_writer out;
+
+    out.add("bytes", static_cast<uint64_t>(policy.total_size()));
+    out.add("limit_maxbytes", static_cast<uint64_t>(setting.max_lru_queue_size));
+    out.add("evictions", hash_table.evictions());
+    out.add("curr_items", static_cast<uint64_t>(hash_table.item_count()));
+    out.add("hash_power_level", static_cast<uint64_t>(hash_table.power_level()));
+    out.add("hash_is_expanding", static_cast<uint64_t>(hash_table.is_expanding()));
+    out.add("eviction_policy", policy.name());
+    policy.stats(out);
+
+    if (auto mrc = hash_table.miss_ratio_curve()) {
+        mrc->stats(out);
+    }
+
+    if (setting.storage == storage_engine::LOG) {
+        segment_store::get_instance().stats(out);
+    }
+
+    if (setting.defrag) {
+        defragmenter::get_instance().stats(out);
+    }
+
+    chain_compactor::get_instance().stats(out);
+
+    if (setting.compress_min_size > 0 || setting.compress_cold_age > 0) {
+        value_codec::get_instance().stats(out);
+    }
+
+    if (setting.dedup_min_size > 0) {
+        dedup_store::get_instance().stats(out);
+    }
+
+    if (setting.snapshot_path) {
+        snapshot_manager::get_instance().stats(out);
+    }
+
+    if (setting.journal_path) {
+        journal::get_instance().stats(out);
+    }
+
+    if (setting.flash_path) {
+        flash_store::get_instance().stats(out);
+    }
+
+    out.add("key_storage", setting.key_digest ? "digest" : "full");
+
+    if (setting.key_digest) {
+        out.add("key_verify", static_cast<uint64_t>(setting.key_verify));
+        out.add("key_digest_collisions", item::digest_collisions.load());
+    }
+
+    this->wbuf_append(out.str().data(), out.str().size());
+    this->wbuf_append("END\r\n");
+}
+
+void connection::execute_cas(item_ptr &it, bucket *&bp) noexcept {
+    if (this->cmd_cas_key == it->cas_key) {
+        this->execute_replace(it, bp);
     } else {
         this->wbuf_append("EXISTS\r\n");
+        bp->unlock();
     }
-
-    bp->unlock();
 }
 
 void connection::execute_prepend_or_append(item_ptr &it, bucket *&bp, bool append)
 noexcept
 {
-    auto new_data = je_realloc(this->ritem_buf, this->ritem_buf_len + it->data_size);
+    static auto &hash_table = hash_table::get_instance();
+    static auto &compactor = chain_compactor::get_instance();
+    static auto &codec = value_codec::get_instance();
+    static auto &journal = journal::get_instance();
+    static auto &flash = flash_store::get_instance();
+
+    std::string key(this->cmd_key[0]);
+    auto new_it = item::create_chained(key, it->flags, it->exptime);
+
+    // Only the first append copies the value, into the head of a chain.
+    if (it->chained()) {
+        new_it->adopt_chain(it);
+    } else if (it->on_flash()) {
+        // Read back in place, appending to a cold value is rare enough for
+        // the worker to wait.
+        std::vector<char> stored;
+
+        if (flash.read_value(it, stored)) {
+            if (!it->compressed()) {
+                new_it->chain_append(value_chunk::create(stored.data(), stored.size()));
+            } else if (codec.decompress(stored.data(), stored.size(), it->raw_size, this->wvalue)) {
+                new_it->chain_append(value_chunk::create(this->wvalue.data(), it->raw_size));
+            }
+        }
+    } else if (it->compressed()) {
+        if (codec.decompress(it, this->wvalue)) {
+            new_it->chain_append(value_chunk::create(this->wvalue.data(), it->raw_size));
+        }
+    } else if (it->data_size > 0) {
+        new_it->chain_append(value_chunk::create(it->data, it->data_size));
+    }
+
+    if (this->ritem_chunked) {
+        this->take_rchain(new_it, append);
+    } else if (this->ritem_buf_len > 0) {
+        auto c = value_chunk::create(this->ritem_buf, this->ritem_buf_len);
 
-    if (!new_data) {
-        this->wbuf_append("ERROR\r\n");
-    } else {
         if (append) {
-            std::memmove(it->data + it->data_size, this->ritem_buf, this->ritem_buf_len);
+            new_it->chain_append(c);
         } else {
-            std::memmove(it->data + this->ritem_buf_len, it->data, it->data_size);
-            std::memmove(it->data, this->ritem_buf, this->ritem_buf_len);
+            new_it->chain_prepend(c);
         }
+    }
 
-        it->data_size += this->ritem_buf_len;
+    new_it->cost = it->cost;
+    new_it->cas_key = it->cas_key;
+    new_it->update_cas_key();
 
-        this->wbuf_append("STORED\r\n");
-    }
+    hash_table.replace_item(*bp, it, new_it);
 
+    // The whole value, replaying the record must not append twice.
+    journal.put(journal.next_seq(), this->cmd_key[0], new_it);
     bp->unlock();
+
+    if (new_it->fragmented()) {
+        compactor.schedule(new_it);
+    }
+
+    hash_table.evict();
+
+    this->wbuf_append("STORED\r\n");
 }
 
 void connection::execute_replace(item_ptr &it, bucket *&bp) noexcept {
-    auto new_data = je_realloc(it->data, this->ritem_buf_len);
+    static auto &hash_table = hash_table::get_instance();
+    static auto &journal = journal::get_instance();
 
-    if (!new_data) {
-        this->wbuf_append("ERROR\r\n");
-    } else {
-        std::memmove(it->data, this->ritem_buf, this->ritem_buf_len);
-        it->data_size = this->ritem_buf_len;
+    std::string key(this->cmd_key[0]);
+    auto new_it = this->new_item(key);
 
-        this->wbuf_append("STORED\r\n");
-    }
+    new_it->cost = this->cmd_cost;
+    new_it->cas_key = it->cas_key;
+    new_it->update_cas_key();
 
+    hash_table.replace_item(*bp, it, new_it);
+    journal.put(journal.next_seq(), this->cmd_key[0], new_it);
     bp->unlock();
+
+    hash_table.evict();
+
+    this->wbuf_append("STORED\r\n");
 }
 
 void connection::execute_add() noexcept {
     static auto &hash_table = hash_table::get_instance();
+    static auto &journal = journal::get_instance();
+
+    std::string key(this->cmd_key[0]);
+    auto it = this->new_item(this->cmd_key[0]);
+    it->cost = this->cmd_cost;
 
-    hash_table.insert_item(this->cmd_key[0],
-                           this->cmd_flag,
-                           this->cmd_exptime,
-                           this->ritem_buf,
-                           this->ritem_buf_len);
+    hash_table.insert_item(it, [&]() {
+        journal.put(journal.next_seq(), key, it);
+    });
 
     this->wbuf_append("STORED\r\n");
 }
 
+void connection::ritem_store(const char *data, size_t size) noexcept {
+    if (!this->ritem_chunked) {
+        std::memmove(this->ritem_buf + this->ritem_saved, data, size);
+        this->ritem_saved += size;
+        return;
+    }
+
+    while (size > 0) {
+        if (!this->rchain_tail || this->rchain_fill == this->rchain_tail->size) {
+            auto c = value_chunk::create(nullptr,
+                                         std::min(setting.value_chunk_size,
+                                                  this->cmd_item_size - this->ritem_saved));
+            if (this->rchain_tail) {
+                this->rchain_tail->next.store(c, std::memory_order_relaxed);
+            } else {
+                this->rchain = c;
+            }
+
+            this->rchain_tail = c;
+            this->rchain_fill = 0;
+        }
+
+        auto n = std::min(size, this->rchain_tail->size - this->rchain_fill);
+        std::memcpy(this->rchain_tail->bytes() + this->rchain_fill, data, n);
+
+        this->rchain_fill += n;
+        this->ritem_saved += n;
+        data += n;
+        size -= n;
+    }
+}
+
+void connection::take_rchain(item_ptr it, bool append) noexcept {
+    // A value shorter than announced leaves the last chunk part empty.
+    if (this->rchain_tail) {
+        this->rchain_tail->size = this->rchain_fill;
+    }
+
+    if (append) {
+        for (auto c = this->rchain; c; ) {
+            auto next = c->next.load(std::memory_order_relaxed);
+            c->next.store(nullptr, std::memory_order_relaxed);
+            it->chain_append(c);
+            c = next;
+        }
+    } else {
+        std::vector<value_chunk *> chunks;
+        for (auto c = this->rchain; c; c = c->next.load(std::memory_order_relaxed)) {
+            chunks.push_back(c);
+        }
+
+        for (auto c = chunks.rbegin(); c != chunks.rend(); c++) {
+            it->chain_prepend(*c);
+        }
+    }
+
+    this->rchain = nullptr;
+    this->rchain_tail = nullptr;
+}
+
+void connection::release_rchain() noexcept {
+    for (auto c = this->rchain; c; ) {
+        auto next = c->next.load(std::memory_order_relaxed);
+        value_chunk::destroy(c);
+        c = next;
+    }
+
+    this->rchain = nullptr;
+    this->rchain_tail = nullptr;
+}
+
+item_ptr connection::new_item(std::string &key) noexcept {
+    static auto &codec = value_codec::get_instance();
+    static auto &dedup = dedup_store::get_instance();
+
+    if (!this->ritem_chunked) {
+        if (setting.dedup_min_size > 0 && this->ritem_buf_len >= setting.dedup_min_size) {
+            auto v = dedup.acquire(this->ritem_buf, this->ritem_buf_len);
+            if (v) {
+                return item::create_shared(key, this->cmd_flag, this->cmd_exptime, v);
+            }
+        }
+
+        if (setting.compress_min_size > 0 && this->ritem_buf_len >= setting.compress_min_size) {
+            auto it = codec.compress(key, this->cmd_flag, this->cmd_exptime,
+                                     this->ritem_buf, this->ritem_buf_len);
+            if (it) {
+                return it;
+            }
+        }
+
+        return item::create(key, this->cmd_flag, this->cmd_exptime,
+                            this->ritem_buf, this->ritem_buf_len);
+    }
+
+    auto it = item::create_chained(key, this->cmd_flag, this->cmd_exptime);
+    this->take_rchain(it, true);
+
+    return it;
+}
+
 void connection::wbuf_append(const char *buf, size_t size) noexcept {
     if (this->wcurr > this->wbuf) {
-        std::memmove(this->wbuf, this->wcurr, this->w_size);
+        std::memmove(this->wbuf, this->wcurr, this->w_unwrite);
         this->wcurr = this->wbuf;
     }
 
     if (this->w_unwrite + size > this->w_size) {
-        auto new_ptr = je_realloc(this->wbuf, this->w_size + size);
+        auto new_size = std::max(this->w_size * 2, this->w_unwrite + size);
+        auto new_ptr = je_realloc(this->wbuf, new_size);
         if (!new_ptr) {
             return;
         }
+
         this->wbuf = static_cast<char *>(new_ptr);
+        this->wcurr = this->wbuf;
+        this->w_size = new_size;
     }
 
     std::memcpy(this->wbuf + this->w_unwrite, buf, size);
     this->w_unwrite += size;
 
     if (!this->wevent_bound) {
-        write_again:
+        while (this->w_unwrite > 0) {
+            auto nwrite = write(this->sfd, this->wcurr, this->w_unwrite);
+            if (nwrite <= 0) {
+                ev_io_start(this->worker_base.evloop, &this->write_evio);
+                this->wevent_bound = true;
+                break;
+            }
 
-        auto nwrite = write(this->sfd, this->wcurr, this->w_unwrite);
-        if (nwrite > 0) {
             this->w_unwrite -= nwrite;
-            if (this->w_unwrite > 0) {
-                goto write_again;
+            this->wcurr += nwrite;
+        }
+    }
+}
+
+void connection::wbuf_appendv(struct iovec *iov, size_t n) noexcept {
+    // Nothing queued ahead, so the pieces can go out without being copied.
+    // Whatever the socket does not take is buffered.
+    if (!this->wevent_bound && this->w_unwrite == 0) {
+        while (n > 0) {
+            auto nwrite = writev(this->sfd, iov, static_cast<int>(std::min<size_t>(n, IOV_MAX)));
+            if (nwrite <= 0) {
+                break;
+            }
+
+            while (n > 0 && static_cast<size_t>(nwrite) >= iov->iov_len) {
+                nwrite -= iov->iov_len;
+                iov++;
+                n--;
+            }
+
+            if (n > 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + nwrite;
+                iov->iov_len -= nwrite;
             }
-        } else {
-            ev_io_start(this->worker_base.evloop, &this->write_evio);
-            this->wevent_bound = true;
         }
     }
+
+    for (; n > 0; iov++, n--) {
+        this->wbuf_append(static_cast<const char *>(iov->iov_base), iov->iov_len);
+    }
 }
 
 void connection::write_response(EV_P_ ev_io *w, int revents) noexcept {
@@ -663,21 +1533,22 @@ void connection::write_response(EV_P_ ev_io *w, int revents) noexcept {
     auto conn = reinterpret_cast<connection *>((uint64_t)(w) - offset);
 
     while (conn->w_unwrite > 0) {
-        auto nwrite = write(conn->sfd, conn->wbuf, conn->w_unwrite);
+        auto nwrite = write(conn->sfd, conn->wcurr, conn->w_unwrite);
         if (nwrite > 0) {
             conn->w_unwrite -= nwrite;
             conn->wcurr += nwrite;
-
-            if (conn->w_unwrite <= 0) {
-                ev_io_stop(conn->worker_base.evloop, w);
-                conn->wevent_bound = false;
-            }
         } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
             return;
         } else {
             perror("failed to write response");
+            conn->w_unwrite = 0;
         }
     }
+
+    ev_io_stop(conn->worker_base.evloop, w);
+    conn->wevent_bound = false;
+
+    conn->worker_base.conn_idle(*conn);
 }
 
 connection::~connection() {
@@ -688,6 +1559,8 @@ connection::~connection() {
         close(this->sfd);
     }
 
+    this->release_rchain();
+
     je_free(this->ritem_buf);
     je_free(this->rbuf);
     je_free(this->wbuf);
@@ -0,0 +1,108 @@
+#include <cstring>
+#include <new>
+
+#include <dedup.h>
+#include <murmur3.h>
+
+#include <jemalloc.h>
+
+namespace cached {
+
+dedup_store::dedup_store() :
+nvalues(0),
+nrefs(0),
+stored_bytes(0),
+logical_bytes(0),
+nhits(0),
+ncollisions(0)
+{
+}
+
+shared_value *dedup_store::acquire(const char *data, size_t size) noexcept {
+    uint64_t fp[2];
+    MurmurHash3_x64_128(data, static_cast<int>(size), 0, fp);
+
+    auto &s = this->shards[fp[1] % nshards];
+    std::lock_guard<std::mutex> g(s.mtx);
+
+    auto found = s.values.find(fp[0]);
+    if (found != s.values.end()) {
+        auto v = found->second;
+
+        if (v->fingerprint[1] != fp[1] || v->size != size
+            || std::memcmp(v->bytes(), data, size) != 0)
+        {
+            this->ncollisions.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        v->refs.fetch_add(1, std::memory_order_relaxed);
+
+        this->nhits.fetch_add(1, std::memory_order_relaxed);
+        this->nrefs.fetch_add(1, std::memory_order_relaxed);
+        this->logical_bytes.fetch_add(size, std::memory_order_relaxed);
+        return v;
+    }
+
+    auto v = static_cast<shared_value *>(je_malloc(sizeof(shared_value) + size));
+    v->fingerprint[0] = fp[0];
+    v->fingerprint[1] = fp[1];
+    new (&v->refs) std::atomic<uint32_t>(1);
+    v->size = size;
+    std::memcpy(v->bytes(), data, size);
+
+    s.values.emplace(fp[0], v);
+
+    this->nvalues.fetch_add(1, std::memory_order_relaxed);
+    this->nrefs.fetch_add(1, std::memory_order_relaxed);
+    this->stored_bytes.fetch_add(size, std::memory_order_relaxed);
+    this->logical_bytes.fetch_add(size, std::memory_order_relaxed);
+    return v;
+}
+
+void dedup_store::retain(shared_value *v) noexcept {
+    v->refs.fetch_add(1, std::memory_order_relaxed);
+
+    this->nrefs.fetch_add(1, std::memory_order_relaxed);
+    this->logical_bytes.fetch_add(v->size, std::memory_order_relaxed);
+}
+
+void dedup_store::release(shared_value *v) noexcept {
+    auto size = v->size;
+
+    this->nrefs.fetch_sub(1, std::memory_order_relaxed);
+    this->logical_bytes.fetch_sub(size, std::memory_order_relaxed);
+
+    {
+        // Under the shard lock, so acquire() cannot pick up a dying value.
+        auto &s = this->shards[v->fingerprint[1] % nshards];
+        std::lock_guard<std::mutex> g(s.mtx);
+
+        if (v->refs.fetch_sub(1, std::memory_order_relaxed) != 1) {
+            return;
+        }
+
+        s.values.erase(v->fingerprint[0]);
+    }
+
+    this->nvalues.fetch_sub(1, std::memory_order_relaxed);
+    this->stored_bytes.fetch_sub(size, std::memory_order_relaxed);
+
+    je_free(v);
+}
+
+void dedup_store::stats(stats_writer &out) noexcept {
+    auto stored = this->stored_bytes.load();
+    auto logical = this->logical_bytes.load();
+
+    out.add("dedup_values", this->nvalues.load());
+    out.add("dedup_refs", this->nrefs.load());
+    out.add("dedup_hits", this->nhits.load());
+    out.add("dedup_collisions", this->ncollisions.load());
+    out.add("dedup_stored_bytes", stored);
+    out.add("dedup_logical_bytes", logical);
+    out.add("dedup_saved_bytes", logical > stored ? logical - stored : uint64_t(0));
+    out.add("dedup_ratio", stored ? static_cast<double>(logical) / stored : 0.0);
+}
+
+}
@@ -0,0 +1,213 @@
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+
+#include <defrag.h>
+#include <setting.h>
+#include <assoc.h>
+#include <epoch.h>
+#include <segment.h>
+
+#include <jemalloc.h>
+
+namespace cached {
+
+// Size classes whose runs are on average filled below this are drained.
+static const double min_run_utilization = 0.75;
+
+static const std::chrono::milliseconds defrag_period(100);
+
+template<typename T>
+static bool read_ctl(const char *name, T &value) noexcept {
+    size_t size = sizeof(value);
+    return je_mallctl(name, &value, &size, nullptr, 0) == 0;
+}
+
+defragmenter::defragmenter() :
+narenas(0),
+running(false),
+allocated(0),
+resident(0),
+npasses(0),
+nmoved(0),
+nmoved_bytes(0)
+{
+}
+
+bool defragmenter::load_bins() noexcept {
+    unsigned nbins;
+    if (!read_ctl("arenas.nbins", nbins) || !read_ctl("arenas.narenas", this->narenas)) {
+        return false;
+    }
+
+    this->bin_size.resize(nbins);
+    this->bin_nregs.resize(nbins);
+    this->sparse.assign(nbins, false);
+
+    char name[64];
+    for (unsigned i = 0; i < nbins; i++) {
+        std::snprintf(name, sizeof(name), "arenas.bin.%u.size", i);
+        if (!read_ctl(name, this->bin_size[i])) {
+            return false;
+        }
+
+        std::snprintf(name, sizeof(name), "arenas.bin.%u.nregs", i);
+        if (!read_ctl(name, this->bin_nregs[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool defragmenter::sample() noexcept {
+    static auto &setting = setting::get_instance();
+
+    // Statistics are only refreshed when the epoch is bumped.
+    uint64_t epoch = 1;
+    size_t size = sizeof(epoch);
+    je_mallctl("epoch", &epoch, &size, &epoch, size);
+
+    size_t allocated, resident;
+    if (!read_ctl("stats.allocated", allocated) || !read_ctl("stats.resident", resident)) {
+        return false;
+    }
+
+    this->allocated = allocated;
+    this->resident = resident;
+
+    if (resident * 100 < allocated * (100 + setting.defrag_threshold)) {
+        return false;
+    }
+
+    // stats.arenas.<narenas> merges all arenas.
+    char name[64];
+    bool found = false;
+
+    for (unsigned i = 0; i < this->bin_size.size(); i++) {
+        size_t curregs, curruns;
+
+        std::snprintf(name, sizeof(name), "stats.arenas.%u.bins.%u.curregs", this->narenas, i);
+        if (!read_ctl(name, curregs)) {
+            return false;
+        }
+
+        std::snprintf(name, sizeof(name), "stats.arenas.%u.bins.%u.curruns", this->narenas, i);
+        if (!read_ctl(name, curruns)) {
+            return false;
+        }
+
+        // A single run has nowhere to be compacted into.
+        this->sparse[i] = curruns > 1
+                          && curregs < curruns * this->bin_nregs[i] * min_run_utilization;
+        found = found || this->sparse[i];
+    }
+
+    return found;
+}
+
+bool defragmenter::is_sparse(size_t size) const noexcept {
+    auto bin = std::lower_bound(this->bin_size.begin(), this->bin_size.end(),
+                                std::max<size_t>(size, 1));
+    if (bin == this->bin_size.end()) {
+        return false;
+    }
+
+    return this->sparse[bin - this->bin_size.begin()];
+}
+
+void defragmenter::purge() noexcept {
+    char name[64];
+    std::snprintf(name, sizeof(name), "arena.%u.purge", this->narenas);
+    je_mallctl(name, nullptr, nullptr, nullptr, 0);
+}
+
+void defragmenter::run(hash_table &table) noexcept {
+    static auto &setting = setting::get_instance();
+    static auto &epoch = epoch_manager::get_instance();
+
+    // Cached regions would hand the copies the holes being drained.
+    bool tcache = false;
+    je_mallctl("thread.tcache.enabled", nullptr, nullptr, &tcache, sizeof(tcache));
+
+    if (!this->load_bins()) {
+        std::fprintf(stderr, "defragmentation needs jemalloc statistics, disabled\n");
+        return;
+    }
+
+    auto slice = defrag_period * setting.defrag_cpu / 100;
+    std::vector<item_ptr> items;
+    size_t cursor = 0;
+
+    while (true) {
+        std::this_thread::sleep_for(defrag_period - slice);
+
+        if (!this->running.load()) {
+            if (!this->sample()) {
+                continue;
+            }
+
+            this->running = true;
+            cursor = 0;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + slice;
+        epoch_guard g;
+
+        for (unsigned n = 1; cursor < table.bucket_count(); n++) {
+            items.clear();
+            table.bucket_items(static_cast<uint32_t>(cursor++), items);
+
+            for (auto it : items) {
+                // Log segments are compacted by their own cleaner.
+                if (it->segment != segment_store::no_segment
+                    || !(this->is_sparse(sizeof(item))
+                         || (!it->shared && this->is_sparse(it->data_size))))
+                {
+                    continue;
+                }
+
+                auto size = it->total_size();
+                if (table.relocate_item(it, it->hv) == relocate_result::MOVED) {
+                    this->nmoved.fetch_add(1, std::memory_order_relaxed);
+                    this->nmoved_bytes.fetch_add(size, std::memory_order_relaxed);
+                }
+            }
+
+            if (n % 16 == 0) {
+                epoch.quiescent();
+
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    break;
+                }
+            }
+        }
+
+        if (cursor >= table.bucket_count()) {
+            this->running = false;
+            this->npasses.fetch_add(1, std::memory_order_relaxed);
+            this->purge();
+        }
+    }
+}
+
+void defragmenter::start(hash_table &table) {
+    this->worker = std::thread(&defragmenter::run, this, std::ref(table));
+    this->worker.detach();
+}
+
+void defragmenter::stats(stats_writer &out) noexcept {
+    auto allocated = this->allocated.load();
+    auto resident = this->resident.load();
+
+    out.add("allocator_allocated", allocated);
+    out.add("allocator_resident", resident);
+    out.add("mem_fragmentation_ratio",
+            allocated ? static_cast<double>(resident) / allocated : 0.0);
+    out.add("defrag_running", static_cast<uint64_t>(this->running.load()));
+    out.add("defrag_passes", this->npasses.load());
+    out.add("defrag_moved_items", this->nmoved.load());
+    out.add("defrag_moved_bytes", this->nmoved_bytes.load());
+}
+
+}
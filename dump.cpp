@@ -0,0 +1,299 @@
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <bulk.h>
+
+using namespace cached;
+
+// Streams every item of a server into a dump file for cached-restore.
+//
+// The hash positions are split into connections * ranges ranges. Each
+// connection asks for the first block of all of its ranges at once, and for
+// the next block of a range as soon as one arrives, so it keeps a request
+// in flight for every range not done yet. Blocks go to the file as they
+// come, compressed by the server.
+
+struct dump_file {
+    int fd;
+    std::mutex mtx;
+    bool failed;
+
+    uint64_t nblocks;
+    uint64_t nrecords;
+    uint64_t raw_bytes;
+    uint64_t bytes;
+};
+
+static bool write_all(int fd, const void *buf, size_t n) noexcept {
+    auto p = static_cast<const char *>(buf);
+
+    while (n > 0) {
+        auto written = write(fd, p, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        p += written;
+        n -= written;
+    }
+
+    return true;
+}
+
+static inline uint64_t range_start(uint64_t i, uint64_t nranges) noexcept {
+    return i * bulk::end_position / nranges;
+}
+
+static void dump_ranges(const char *host, const char *port,
+                        uint64_t first, uint64_t count, uint64_t nranges,
+                        dump_file &out) noexcept
+{
+    bulk::client conn;
+
+    if (!conn.connect(host, port)) {
+        std::lock_guard<std::mutex> g(out.mtx);
+        out.failed = true;
+        return;
+    }
+
+    // Requests are answered in order, the ranges they were for queue up.
+    std::deque<uint64_t> inflight;
+    std::string req;
+    char buf[64];
+
+    for (auto i = first; i < first + count; i++) {
+        std::sprintf(buf, "dump %" PRIu64 " %" PRIu64 "\r\n",
+                     range_start(i, nranges), range_start(i + 1, nranges));
+        req.append(buf);
+        inflight.push_back(i);
+    }
+
+    if (!conn.send(req.data(), req.size())) {
+        std::lock_guard<std::mutex> g(out.mtx);
+        out.failed = true;
+        return;
+    }
+
+    std::string line;
+    std::vector<char> data;
+
+    while (!inflight.empty()) {
+        auto i = inflight.front();
+        inflight.pop_front();
+
+        unsigned long long next;
+        bulk::block_header header;
+        std::memset(&header, 0, sizeof(header));
+
+        if (!conn.read_line(line)) {
+            std::lock_guard<std::mutex> g(out.mtx);
+            out.failed = true;
+            return;
+        }
+
+        if (std::sscanf(line.c_str(), "BLOCK %llu %" SCNu32 " %" SCNu32 " %" SCNu32,
+                        &next, &header.nrecords, &header.raw_size, &header.size) != 4
+            || header.size > header.raw_size
+            || !conn.read_data(data, header.size))
+        {
+            std::lock_guard<std::mutex> g(out.mtx);
+            std::fprintf(stderr, "unexpected reply: %s\n", line.c_str());
+            out.failed = true;
+            return;
+        }
+
+        auto end = range_start(i + 1, nranges);
+
+        if (next < end) {
+            auto n = std::sprintf(buf, "dump %llu %" PRIu64 "\r\n", next, end);
+            if (!conn.send(buf, n)) {
+                std::lock_guard<std::mutex> g(out.mtx);
+                out.failed = true;
+                return;
+            }
+
+            inflight.push_back(i);
+        }
+
+        if (header.nrecords == 0) {
+            continue;
+        }
+
+        std::lock_guard<std::mutex> g(out.mtx);
+
+        if (out.failed) {
+            return;
+        }
+
+        if (!write_all(out.fd, &header, sizeof(header))
+            || !write_all(out.fd, data.data(), data.size()))
+        {
+            std::perror("write()");
+            out.failed = true;
+            return;
+        }
+
+        out.nblocks++;
+        out.nrecords += header.nrecords;
+        out.raw_bytes += header.raw_size;
+        out.bytes += sizeof(header) + header.size;
+    }
+}
+
+static void usage(const char *prog) {
+    std::fprintf(stderr,
+                 "usage: %s [options] <file>\n"
+                 "  writes to standard output when file is -\n"
+                 "  -H, --host=<host>        server address, 127.0.0.1 by default\n"
+                 "  -p, --port=<port>        server port, 23333 by default\n"
+                 "  -c, --connections=<n>    connections to dump over, 4 by default\n"
+                 "  -r, --ranges=<n>         ranges each connection keeps a request in\n"
+                 "                           flight for, 16 by default\n"
+                 "  -h, --help               this help\n",
+                 prog);
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    const char *port = "23333";
+    unsigned long connections = 4;
+    unsigned long ranges = 16;
+
+    static const struct option long_opts[] = {
+            {"host",        required_argument, nullptr, 'H'},
+            {"port",        required_argument, nullptr, 'p'},
+            {"connections", required_argument, nullptr, 'c'},
+            {"ranges",      required_argument, nullptr, 'r'},
+            {"help",        no_argument,       nullptr, 'h'},
+            {nullptr, 0,                       nullptr, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "H:p:c:r:h", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'H':
+                host = optarg;
+                break;
+
+            case 'p':
+                port = optarg;
+                break;
+
+            case 'c':
+                connections = std::strtoul(optarg, nullptr, 10);
+                if (connections < 1 || connections > 256) {
+                    std::fprintf(stderr, "connections must be between 1 and 256\n");
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'r':
+                ranges = std::strtoul(optarg, nullptr, 10);
+                if (ranges < 1 || ranges > 1024) {
+                    std::fprintf(stderr, "ranges must be between 1 and 1024\n");
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            default:
+                usage(argv[0]);
+                return EX_USAGE;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    auto path = argv[optind];
+    auto to_stdout = std::strcmp(path, "-") == 0;
+
+    dump_file out;
+    out.failed = false;
+    out.nblocks = 0;
+    out.nrecords = 0;
+    out.raw_bytes = 0;
+    out.bytes = 0;
+
+    out.fd = to_stdout ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out.fd == -1) {
+        std::perror("open()");
+        return EX_CANTCREAT;
+    }
+
+    bulk::file_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, bulk::file_magic, sizeof(header.magic));
+    header.version = bulk::file_version;
+    header.created_at = std::time(0);
+
+    if (!write_all(out.fd, &header, sizeof(header))) {
+        std::perror("write()");
+        return EX_IOERR;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto nranges = static_cast<uint64_t>(connections) * ranges;
+
+    std::vector<std::thread> threads;
+    for (unsigned long i = 0; i < connections; i++) {
+        threads.emplace_back(dump_ranges, host, port, i * ranges, ranges, nranges, std::ref(out));
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    if (!out.failed && !to_stdout && fsync(out.fd) != 0) {
+        std::perror("fsync()");
+        out.failed = true;
+    }
+
+    if (!to_stdout) {
+        close(out.fd);
+    }
+
+    // Half a dump would restore as if it were all of it.
+    if (out.failed) {
+        if (!to_stdout) {
+            unlink(path);
+        }
+
+        return EX_UNAVAILABLE;
+    }
+
+    auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::fprintf(stderr,
+                 "dumped %" PRIu64 " items in %" PRIu64 " blocks, %.1f MB, %.1f MB compressed, "
+                 "in %.2f s, %.1f MB/s\n",
+                 out.nrecords, out.nblocks,
+                 out.raw_bytes / 1048576.0, out.bytes / 1048576.0,
+                 secs, secs > 0 ? out.bytes / 1048576.0 / secs : 0.0);
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <sysexits.h>
+
+#include <epoch.h>
+#include <assoc.h>
+
+namespace cached {
+
+epoch_manager::epoch_manager() :
+global_epoch(1)
+{
+    for (auto &slot : this->slots) {
+        slot.epoch = 0;
+        slot.used = false;
+        slot.nesting = 0;
+    }
+}
+
+epoch_manager::thread_slot &epoch_manager::local_slot() noexcept {
+    static thread_local thread_slot *slot = nullptr;
+
+    if (slot) {
+        return *slot;
+    }
+
+    for (auto &s : this->slots) {
+        bool expected = false;
+        if (s.used.compare_exchange_strong(expected, true)) {
+            slot = &s;
+            return s;
+        }
+    }
+
+    std::fprintf(stderr, "too many threads registered for epoch reclamation\n");
+    std::exit(EX_SOFTWARE);
+}
+
+void epoch_manager::online() noexcept {
+    auto &slot = this->local_slot();
+
+    if (slot.nesting++ == 0) {
+        slot.epoch.store(this->global_epoch.load());
+    }
+}
+
+void epoch_manager::offline() noexcept {
+    auto &slot = this->local_slot();
+
+    if (--slot.nesting == 0) {
+        slot.epoch.store(0, std::memory_order_release);
+        this->reclaim(slot);
+    }
+}
+
+void epoch_manager::quiescent() noexcept {
+    auto &slot = this->local_slot();
+
+    slot.epoch.store(this->global_epoch.load());
+    this->reclaim(slot);
+}
+
+bool epoch_manager::try_advance() noexcept {
+    auto curr = this->global_epoch.load();
+
+    for (auto &slot : this->slots) {
+        auto e = slot.epoch.load();
+        if (e != 0 && e != curr) {
+            return false;
+        }
+    }
+
+    return this->global_epoch.compare_exchange_strong(curr, curr + 1);
+}
+
+static void delete_item(void *it) {
+    item::destroy(static_cast<item *>(it));
+}
+
+void epoch_manager::retire(item *it) noexcept {
+    this->retire(it, delete_item);
+}
+
+void epoch_manager::retire(void *ptr, void (*deleter)(void *)) noexcept {
+    auto &slot = this->local_slot();
+
+    slot.retired.push_back({this->global_epoch.load(), ptr, deleter});
+
+    if (slot.retired.size() >= reclaim_threshold) {
+        this->reclaim(slot);
+    }
+}
+
+void epoch_manager::reclaim(thread_slot &slot) noexcept {
+    if (slot.retired.empty()) {
+        return;
+    }
+
+    this->try_advance();
+
+    auto curr = this->global_epoch.load();
+    if (curr < 3) {
+        return;
+    }
+
+    // Retired batches are in epoch order, so everything safe is a prefix.
+    auto safe = curr - 2;
+    auto end = slot.retired.begin();
+
+    while (end != slot.retired.end() && end->epoch <= safe) {
+        end->deleter(end->ptr);
+        end++;
+    }
+
+    slot.retired.erase(slot.retired.begin(), end);
+}
+
+}
@@ -0,0 +1,741 @@
+#include <ctime>
+#include <algorithm>
+
+#include <eviction.h>
+#include <setting.h>
+
+namespace cached {
+
+enum : uint8_t {
+    QUEUE_NONE = 0,
+    QUEUE_LRU,
+    QUEUE_SMALL,
+    QUEUE_MAIN,
+    QUEUE_WINDOW,
+    QUEUE_HEAP
+};
+
+void item_queue::push_head(item_ptr it) noexcept {
+    it->queue_next = this->head;
+    it->queue_prev = nullptr;
+
+    if (this->head) {
+        this->head->queue_prev = it;
+    } else {
+        this->tail = it;
+    }
+
+    this->head = it;
+
+    this->length++;
+    this->bytes += it->total_size();
+}
+
+void item_queue::remove(item_ptr it) noexcept {
+    auto prev = it->queue_prev;
+    auto next = it->queue_next;
+
+    if (prev) {
+        prev->queue_next = next;
+    } else {
+        this->head = next;
+    }
+
+    if (next) {
+        next->queue_prev = prev;
+    } else {
+        this->tail = prev;
+    }
+
+    it->queue_next = nullptr;
+    it->queue_prev = nullptr;
+
+    this->length--;
+    this->bytes -= it->total_size();
+}
+
+void item_queue::replace(item_ptr old_it, item_ptr new_it) noexcept {
+    auto prev = old_it->queue_prev;
+    auto next = old_it->queue_next;
+
+    new_it->queue_prev = prev;
+    new_it->queue_next = next;
+
+    if (prev) {
+        prev->queue_next = new_it;
+    } else {
+        this->head = new_it;
+    }
+
+    if (next) {
+        next->queue_prev = new_it;
+    } else {
+        this->tail = new_it;
+    }
+
+    old_it->queue_next = nullptr;
+    old_it->queue_prev = nullptr;
+
+    this->bytes += new_it->total_size();
+    this->bytes -= old_it->total_size();
+}
+
+eviction_policy *eviction_policy::create(eviction_type type,
+                                         size_t memory_limit,
+                                         bool admission,
+                                         unsigned admission_window)
+{
+    eviction_policy *policy;
+
+    switch (type) {
+        case eviction_type::S3FIFO:
+            policy = new s3fifo_queue();
+            break;
+
+        case eviction_type::GDSF:
+            policy = new gdsf_queue();
+            break;
+
+        default:
+            policy = new lru_queue();
+    }
+
+    if (admission) {
+        policy = new tinylfu_admission(policy, memory_limit, admission_window);
+    }
+
+    return policy;
+}
+
+eviction_policy& eviction_policy::get_instance() noexcept {
+    static auto &setting = setting::get_instance();
+    static eviction_policy *instance = create(setting.eviction,
+                                              setting.max_lru_queue_size,
+                                              setting.admission,
+                                              setting.admission_window);
+
+    return *instance;
+}
+
+//-----------------------------------------------------------------------------
+
+lru_queue::lru_queue() :
+item_total_size(0)
+{ }
+
+void lru_queue::on_insert(item_ptr it) noexcept {
+    mtx_guard g(this->mtx);
+
+    // Cleared once the item left the index, a late reader must not put a
+    // dead item back.
+    if (!it->linked.load()) {
+        return;
+    }
+
+    if (it->queue == QUEUE_LRU) {
+        if (it == this->queue.front()) {
+            return;
+        }
+
+        this->queue.remove(it);
+    }
+
+    this->queue.push_head(it);
+    it->queue = QUEUE_LRU;
+
+    this->item_total_size = this->queue.total_size();
+}
+
+void lru_queue::on_hit(item_ptr it) noexcept {
+    static const auto& setting = setting::get_instance();
+
+    // Bumping on every read would serialize all readers on the queue lock.
+    auto now = std::time(0);
+    if (now - it->last_access.load(std::memory_order_relaxed)
+        < setting.lru_update_interval)
+    {
+        return;
+    }
+
+    it->last_access.store(now, std::memory_order_relaxed);
+
+    // Only reorders, an item picked as a victim or still in an admission
+    // window is left alone.
+    mtx_guard g(this->mtx);
+    if (it->queue == QUEUE_LRU && it != this->queue.front()) {
+        this->queue.remove(it);
+        this->queue.push_head(it);
+    }
+}
+
+void lru_queue::on_remove(item_ptr it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (it->queue != QUEUE_LRU) {
+        return;
+    }
+
+    this->queue.remove(it);
+    it->queue = QUEUE_NONE;
+
+    this->item_total_size = this->queue.total_size();
+}
+
+void lru_queue::on_replace(item_ptr old_it, item_ptr new_it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (old_it->queue == QUEUE_LRU) {
+        this->queue.remove(old_it);
+        old_it->queue = QUEUE_NONE;
+    }
+
+    if (new_it->linked.load()) {
+        this->queue.push_head(new_it);
+        new_it->queue = QUEUE_LRU;
+    }
+
+    this->item_total_size = this->queue.total_size();
+}
+
+void lru_queue::on_relocate(item_ptr old_it, item_ptr new_it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (old_it->queue == QUEUE_LRU) {
+        this->queue.replace(old_it, new_it);
+        old_it->queue = QUEUE_NONE;
+        new_it->queue = QUEUE_LRU;
+    } else if (new_it->linked.load()) {
+        // The old item was just picked as a victim.
+        this->queue.push_head(new_it);
+        new_it->queue = QUEUE_LRU;
+    }
+
+    // A compressed copy is smaller.
+    this->item_total_size = this->queue.total_size();
+}
+
+item_ptr lru_queue::pick_victim() noexcept {
+    mtx_guard g(this->mtx);
+
+    auto it = this->queue.back();
+    if (it) {
+        this->queue.remove(it);
+        it->queue = QUEUE_NONE;
+        this->item_total_size = this->queue.total_size();
+    }
+
+    return it;
+}
+
+item_ptr lru_queue::peek_victim() noexcept {
+    mtx_guard g(this->mtx);
+    return this->queue.back();
+}
+
+//-----------------------------------------------------------------------------
+
+s3fifo_queue::s3fifo_queue() :
+item_total_size(0)
+{ }
+
+void s3fifo_queue::ghost_insert(uint32_t hv) {
+    // Remember about as many evicted keys as the main queue holds items.
+    auto limit = std::max<size_t>(this->main.size(), 1024);
+
+    while (this->ghost.size() >= limit) {
+        this->ghost_remove(this->ghost.front());
+        this->ghost.pop_front();
+    }
+
+    this->ghost.push_back(hv);
+    this->ghost_index[hv]++;
+}
+
+bool s3fifo_queue::ghost_remove(uint32_t hv) {
+    auto found = this->ghost_index.find(hv);
+    if (found == this->ghost_index.end()) {
+        return false;
+    }
+
+    if (--found->second == 0) {
+        this->ghost_index.erase(found);
+    }
+
+    return true;
+}
+
+void s3fifo_queue::on_insert(item_ptr it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (!it->linked.load() || it->queue != QUEUE_NONE) {
+        return;
+    }
+
+    it->freq = 0;
+
+    // The ghost entry stays in the FIFO and ages out on its own, dropping
+    // it from the index is enough to stop it from matching again.
+    if (this->ghost_remove(it->hv)) {
+        this->main.push_head(it);
+        it->queue = QUEUE_MAIN;
+    } else {
+        this->small.push_head(it);
+        it->queue = QUEUE_SMALL;
+    }
+
+    this->item_total_size = this->small.total_size() + this->main.total_size();
+}
+
+void s3fifo_queue::on_hit(item_ptr it) noexcept {
+    auto freq = it->freq.load(std::memory_order_relaxed);
+    if (freq < max_freq) {
+        it->freq.store(freq + 1, std::memory_order_relaxed);
+    }
+}
+
+void s3fifo_queue::on_remove(item_ptr it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (it->queue == QUEUE_SMALL) {
+        this->small.remove(it);
+    } else if (it->queue == QUEUE_MAIN) {
+        this->main.remove(it);
+    } else {
+        return;
+    }
+
+    it->queue = QUEUE_NONE;
+    this->item_total_size = this->small.total_size() + this->main.total_size();
+}
+
+void s3fifo_queue::on_replace(item_ptr old_it, item_ptr new_it) noexcept {
+    mtx_guard g(this->mtx);
+
+    // An updated key keeps its place and its frequency.
+    uint8_t queue = old_it->queue;
+    new_it->freq = old_it->freq.load(std::memory_order_relaxed);
+
+    if (queue == QUEUE_SMALL) {
+        this->small.replace(old_it, new_it);
+    } else if (queue == QUEUE_MAIN) {
+        this->main.replace(old_it, new_it);
+    } else if (new_it->linked.load()) {
+        // The old item was just picked as a victim, start over.
+        queue = QUEUE_SMALL;
+        new_it->freq = 0;
+        this->small.push_head(new_it);
+    } else {
+        return;
+    }
+
+    old_it->queue = QUEUE_NONE;
+    new_it->queue = queue;
+    this->item_total_size = this->small.total_size() + this->main.total_size();
+}
+
+item_ptr s3fifo_queue::evict_small() noexcept {
+    while (auto it = this->small.back()) {
+        this->small.remove(it);
+
+        if (it->freq.load(std::memory_order_relaxed) > 0) {
+            it->freq = 0;
+            this->main.push_head(it);
+            it->queue = QUEUE_MAIN;
+        } else {
+            this->ghost_insert(it->hv);
+            it->queue = QUEUE_NONE;
+            return it;
+        }
+    }
+
+    return nullptr;
+}
+
+item_ptr s3fifo_queue::evict_main() noexcept {
+    while (auto it = this->main.back()) {
+        this->main.remove(it);
+
+        auto freq = it->freq.load(std::memory_order_relaxed);
+        if (freq > 0) {
+            it->freq = freq - 1;
+            this->main.push_head(it);
+        } else {
+            it->queue = QUEUE_NONE;
+            return it;
+        }
+    }
+
+    return nullptr;
+}
+
+item_ptr s3fifo_queue::pick_victim() noexcept {
+    mtx_guard g(this->mtx);
+
+    auto total = this->small.total_size() + this->main.total_size();
+    item_ptr it = nullptr;
+
+    // Keep the small queue at about a tenth of the cache.
+    if (this->small.total_size() >= total / 10) {
+        it = this->evict_small();
+    }
+
+    if (!it) {
+        it = this->evict_main();
+    }
+
+    if (!it) {
+        it = this->evict_small();
+    }
+
+    this->item_total_size = this->small.total_size() + this->main.total_size();
+    return it;
+}
+
+item_ptr s3fifo_queue::peek_victim() noexcept {
+    mtx_guard g(this->mtx);
+
+    auto total = this->small.total_size() + this->main.total_size();
+    if (this->small.size() > 0 && this->small.total_size() >= total / 10) {
+        return this->small.back();
+    }
+
+    return this->main.size() > 0 ? this->main.back() : this->small.back();
+}
+
+//-----------------------------------------------------------------------------
+
+gdsf_queue::gdsf_queue() :
+inflation(0),
+bytes(0),
+item_total_size(0)
+{ }
+
+void gdsf_queue::sift_up(uint32_t i) noexcept {
+    auto it = this->heap[i];
+
+    while (i > 0) {
+        auto parent = (i - 1) / 2;
+        if (this->heap[parent]->priority <= it->priority) {
+            break;
+        }
+
+        this->heap_set(i, this->heap[parent]);
+        i = parent;
+    }
+
+    this->heap_set(i, it);
+}
+
+void gdsf_queue::sift_down(uint32_t i) noexcept {
+    auto it = this->heap[i];
+    auto n = static_cast<uint32_t>(this->heap.size());
+
+    while (true) {
+        auto child = 2 * i + 1;
+        if (child >= n) {
+            break;
+        }
+
+        if (child + 1 < n && this->heap[child + 1]->priority < this->heap[child]->priority) {
+            child++;
+        }
+
+        if (it->priority <= this->heap[child]->priority) {
+            break;
+        }
+
+        this->heap_set(i, this->heap[child]);
+        i = child;
+    }
+
+    this->heap_set(i, it);
+}
+
+void gdsf_queue::heap_push(item_ptr it) noexcept {
+    it->priority = this->priority_of(it);
+    it->queue = QUEUE_HEAP;
+
+    this->heap.push_back(it);
+    this->sift_up(static_cast<uint32_t>(this->heap.size() - 1));
+
+    this->bytes += it->total_size();
+    this->item_total_size = this->bytes;
+}
+
+void gdsf_queue::heap_remove(item_ptr it) noexcept {
+    auto i = it->heap_index;
+    auto last = this->heap.back();
+
+    this->heap.pop_back();
+
+    if (last != it) {
+        this->heap_set(i, last);
+        this->sift_down(i);
+        this->sift_up(last->heap_index);
+    }
+
+    it->queue = QUEUE_NONE;
+
+    this->bytes -= it->total_size();
+    this->item_total_size = this->bytes;
+}
+
+void gdsf_queue::on_insert(item_ptr it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (!it->linked.load() || it->queue != QUEUE_NONE) {
+        return;
+    }
+
+    it->freq = 1;
+    this->heap_push(it);
+}
+
+void gdsf_queue::on_hit(item_ptr it) noexcept {
+    auto freq = it->freq.load(std::memory_order_relaxed);
+    uint8_t next;
+
+    do {
+        next = static_cast<uint8_t>(std::min<unsigned>((freq & max_freq) + 1, max_freq)
+                                    | freq_dirty);
+    } while (freq != next
+             && !it->freq.compare_exchange_weak(freq, next, std::memory_order_relaxed));
+}
+
+void gdsf_queue::on_remove(item_ptr it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (it->queue == QUEUE_HEAP) {
+        this->heap_remove(it);
+    }
+}
+
+void gdsf_queue::on_replace(item_ptr old_it, item_ptr new_it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (old_it->queue != QUEUE_HEAP) {
+        if (new_it->linked.load()) {
+            new_it->freq = 1;
+            this->heap_push(new_it);
+        }
+
+        return;
+    }
+
+    // The write counts as an access, the new size and cost take effect.
+    auto freq = old_it->freq.load(std::memory_order_relaxed) & max_freq;
+    new_it->freq = static_cast<uint8_t>(std::min<unsigned>(freq + 1, max_freq));
+    new_it->priority = this->priority_of(new_it);
+    new_it->queue = QUEUE_HEAP;
+
+    auto i = old_it->heap_index;
+    this->heap_set(i, new_it);
+    this->sift_down(i);
+    this->sift_up(new_it->heap_index);
+
+    old_it->queue = QUEUE_NONE;
+
+    this->bytes += new_it->total_size();
+    this->bytes -= old_it->total_size();
+    this->item_total_size = this->bytes;
+}
+
+void gdsf_queue::on_relocate(item_ptr old_it, item_ptr new_it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (old_it->queue != QUEUE_HEAP) {
+        if (new_it->linked.load()) {
+            new_it->freq = 1;
+            this->heap_push(new_it);
+        }
+
+        return;
+    }
+
+    new_it->freq = old_it->freq.load(std::memory_order_relaxed);
+    new_it->priority = old_it->priority;
+    new_it->queue = QUEUE_HEAP;
+    this->heap_set(old_it->heap_index, new_it);
+
+    old_it->queue = QUEUE_NONE;
+
+    this->bytes += new_it->total_size();
+    this->bytes -= old_it->total_size();
+    this->item_total_size = this->bytes;
+}
+
+item_ptr gdsf_queue::pick_victim() noexcept {
+    mtx_guard g(this->mtx);
+
+    while (!this->heap.empty()) {
+        auto it = this->heap[0];
+        auto freq = it->freq.load(std::memory_order_relaxed);
+
+        // Read since its priority was computed, requeue with what it is
+        // worth now.
+        if (freq & freq_dirty) {
+            it->freq.fetch_and(max_freq, std::memory_order_relaxed);
+            it->priority = this->priority_of(it);
+            this->sift_down(0);
+            continue;
+        }
+
+        this->inflation = it->priority;
+        this->heap_remove(it);
+
+        return it;
+    }
+
+    return nullptr;
+}
+
+item_ptr gdsf_queue::peek_victim() noexcept {
+    mtx_guard g(this->mtx);
+    return this->heap.empty() ? nullptr : this->heap[0];
+}
+
+void gdsf_queue::stats(stats_writer &out) const noexcept {
+    out.add("gdsf_inflation", this->inflation);
+}
+
+//-----------------------------------------------------------------------------
+
+// Expected mean item size, only used to size the sketch.
+static const size_t sketch_item_size = 256;
+
+tinylfu_admission::tinylfu_admission(eviction_policy *main_policy,
+                                     size_t memory_limit,
+                                     unsigned window_percent) :
+main_policy(main_policy),
+sketch(memory_limit / sketch_item_size),
+window_limit(memory_limit / 100 * window_percent),
+memory_limit(memory_limit),
+window_size(0),
+rejections(0)
+{ }
+
+tinylfu_admission::~tinylfu_admission() {
+    delete this->main_policy;
+}
+
+void tinylfu_admission::window_remove(item_ptr it) noexcept {
+    this->window.remove(it);
+    it->queue = QUEUE_NONE;
+    this->window_size = this->window.total_size();
+}
+
+void tinylfu_admission::on_insert(item_ptr it) noexcept {
+    mtx_guard g(this->mtx);
+
+    this->sketch.increment(it->hv);
+
+    if (!it->linked.load() || it->queue != QUEUE_NONE) {
+        return;
+    }
+
+    this->window.push_head(it);
+    it->queue = QUEUE_WINDOW;
+    this->window_size = this->window.total_size();
+
+    // Admission only matters once something has to go, until then the
+    // window overflows straight into the main policy.
+    while (this->window.total_size() > this->window_limit
+           && this->total_size() <= this->memory_limit)
+    {
+        auto candidate = this->window.back();
+        this->window_remove(candidate);
+        this->main_policy->on_insert(candidate);
+    }
+}
+
+void tinylfu_admission::on_hit(item_ptr it) noexcept {
+    this->sketch.increment(it->hv);
+
+    if (it->queue.load(std::memory_order_relaxed) != QUEUE_WINDOW) {
+        this->main_policy->on_hit(it);
+    }
+}
+
+void tinylfu_admission::on_remove(item_ptr it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (it->queue == QUEUE_WINDOW) {
+        this->window_remove(it);
+    } else {
+        this->main_policy->on_remove(it);
+    }
+}
+
+void tinylfu_admission::on_replace(item_ptr old_it, item_ptr new_it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (old_it->queue == QUEUE_WINDOW) {
+        this->window.replace(old_it, new_it);
+        old_it->queue = QUEUE_NONE;
+        new_it->queue = QUEUE_WINDOW;
+        this->window_size = this->window.total_size();
+    } else {
+        this->main_policy->on_replace(old_it, new_it);
+    }
+}
+
+void tinylfu_admission::on_relocate(item_ptr old_it, item_ptr new_it) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (old_it->queue == QUEUE_WINDOW) {
+        this->window.replace(old_it, new_it);
+        old_it->queue = QUEUE_NONE;
+        new_it->queue = QUEUE_WINDOW;
+        this->window_size = this->window.total_size();
+    } else {
+        this->main_policy->on_relocate(old_it, new_it);
+    }
+}
+
+item_ptr tinylfu_admission::pick_victim() noexcept {
+    mtx_guard g(this->mtx);
+
+    while (this->window.total_size() > this->window_limit) {
+        auto candidate = this->window.back();
+        auto victim = this->main_policy->peek_victim();
+
+        this->window_remove(candidate);
+
+        if (victim && this->sketch.estimate(candidate->hv)
+                      <= this->sketch.estimate(victim->hv))
+        {
+            this->rejections.fetch_add(1, std::memory_order_relaxed);
+            return candidate;
+        }
+
+        this->main_policy->on_insert(candidate);
+    }
+
+    auto it = this->main_policy->pick_victim();
+    if (!it && (it = this->window.back())) {
+        this->window_remove(it);
+    }
+
+    return it;
+}
+
+item_ptr tinylfu_admission::peek_victim() noexcept {
+    mtx_guard g(this->mtx);
+
+    if (this->window.total_size() > this->window_limit) {
+        return this->window.back();
+    }
+
+    auto it = this->main_policy->peek_victim();
+    return it ? it : this->window.back();
+}
+
+void tinylfu_admission::stats(stats_writer &out) const noexcept {
+    this->main_policy->stats(out);
+
+    out.add("admission_window_bytes", static_cast<uint64_t>(this->window_size.load()));
+    out.add("admission_rejections", this->rejections.load());
+    out.add("sketch_bytes", static_cast<uint64_t>(this->sketch.memory_size()));
+}
+
+}
@@ -0,0 +1,618 @@
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <flash.h>
+#include <setting.h>
+#include <assoc.h>
+#include <epoch.h>
+
+namespace cached {
+
+// Unit of writing, records never cross a buffer boundary.
+static const size_t buffer_size = 4 * 1024 * 1024;
+
+static const size_t max_page_size = 64 * 1024 * 1024;
+
+// Full write buffers waiting for the writer before evictions stop coming.
+static const size_t max_pending = 4;
+
+static const unsigned nreaders = 4;
+
+// Pages whose live fraction is above this are dropped rather than compacted.
+static const double max_compact_live = 0.9;
+
+flash_store::flash_store() :
+fd(-1),
+page_size(0),
+npages(0),
+pages(nullptr),
+head(no_page),
+head_offset(0),
+current(nullptr),
+compactor_wakeup(false),
+header_bytes(0),
+nstored(0),
+nstored_bytes(0),
+nrejected(0),
+nwrites(0),
+nwrite_errors(0),
+nreads(0),
+nread_bytes(0),
+nread_errors(0),
+nbuffer_hits(0),
+ncompacted(0),
+nrelocated(0),
+ndropped(0)
+{
+    auto &setting = setting::get_instance();
+
+    if (!setting.flash_path) {
+        return;
+    }
+
+    this->fd = open(setting.flash_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (this->fd == -1) {
+        perror("failed to open the flash file");
+        std::exit(EXIT_FAILURE);
+    }
+
+    // A block device comes with its size, a file is grown sparse.
+    struct stat st;
+    if (fstat(this->fd, &st) == -1
+        || (!S_ISBLK(st.st_mode) && static_cast<size_t>(st.st_size) < setting.flash_size
+            && ftruncate(this->fd, setting.flash_size) == -1))
+    {
+        perror("failed to size the flash file");
+        std::exit(EXIT_FAILURE);
+    }
+
+    this->page_size = std::min(max_page_size,
+                               std::max(buffer_size,
+                                        setting.flash_size / 16 / buffer_size * buffer_size));
+    this->npages = static_cast<uint32_t>(setting.flash_size / this->page_size);
+
+    this->pages = new page_info[this->npages];
+    this->free_list.reserve(this->npages);
+
+    for (auto page = this->npages; page-- > 0; ) {
+        auto &p = this->pages[page];
+
+        p.used = 0;
+        p.live = 0;
+        p.sealed_at = 0;
+        p.state = PAGE_FREE;
+        p.pins = 0;
+
+        this->free_list.push_back(page);
+    }
+}
+
+bool flash_store::eligible(const item *it) const noexcept {
+    static auto &setting = setting::get_instance();
+
+    return this->fd != -1 && !it->on_flash()
+           && it->data_size >= setting.flash_min_size
+           && record_size(it->data_size) <= buffer_size;
+}
+
+char *flash_store::reserve(size_t size, uint32_t hv, uint32_t &page, uint32_t &offset) noexcept {
+    auto total = record_size(size);
+
+    if (this->current && this->current->data.size() + total > buffer_size) {
+        if (this->pending.size() >= max_pending) {
+            return nullptr;
+        }
+
+        this->seal_buffer();
+    }
+
+    if (!this->current) {
+        if (this->head == no_page) {
+            if (this->free_list.size() <= std::max<size_t>(2, this->npages / 8)) {
+                this->compactor_wakeup = true;
+                this->compactor_cv.notify_one();
+            }
+
+            if (this->free_list.empty()) {
+                return nullptr;
+            }
+
+            this->head = this->free_list.back();
+            this->free_list.pop_back();
+            this->head_offset = 0;
+
+            this->pages[this->head].state = PAGE_OPEN;
+            this->pages[this->head].used = 0;
+        }
+
+        this->current = new write_buffer;
+        this->current->page = this->head;
+        this->current->offset = this->head_offset;
+        this->current->data.reserve(buffer_size);
+
+        this->pages[this->head].pins++;
+        this->head_offset += buffer_size;
+    }
+
+    auto b = this->current;
+    auto at = b->data.size();
+
+    page = b->page;
+    offset = static_cast<uint32_t>(b->offset + at);
+
+    b->data.resize(at + total);
+
+    record_header header;
+    std::memset(&header, 0, sizeof(header));
+    header.size = static_cast<uint32_t>(total);
+    header.hv = hv;
+    header.value_size = size;
+    std::memcpy(b->data.data() + at, &header, sizeof(header));
+
+    auto &p = this->pages[page];
+    p.live += total;
+    p.used = offset + total;
+
+    return b->data.data() + at + sizeof(header);
+}
+
+void flash_store::seal_buffer() noexcept {
+    auto b = this->current;
+    this->current = nullptr;
+
+    // A buffer left short ends with an empty record, where the compactor
+    // stops instead of reading what an earlier use of the page left.
+    if (b->data.size() + sizeof(record_header) <= buffer_size) {
+        b->data.resize(b->data.size() + sizeof(record_header), 0);
+    }
+
+    this->pending.push_back(b);
+    this->writer_cv.notify_one();
+
+    if (this->head_offset + buffer_size > this->page_size) {
+        auto &p = this->pages[this->head];
+
+        p.state = PAGE_SEALED;
+        p.sealed_at = std::time(0);
+
+        auto page = this->head;
+        this->head = no_page;
+        this->maybe_free(page);
+    }
+}
+
+void flash_store::maybe_free(uint32_t page) noexcept {
+    auto &p = this->pages[page];
+
+    if ((p.state == PAGE_SEALED || p.state == PAGE_COMPACTED)
+        && p.live.load() == 0 && p.pins == 0)
+    {
+        p.state = PAGE_FREE;
+        p.used = 0;
+        this->free_list.push_back(page);
+    }
+}
+
+void flash_store::unpin(uint32_t page) noexcept {
+    mtx_guard g(this->mtx);
+
+    this->pages[page].pins--;
+    this->maybe_free(page);
+}
+
+item *flash_store::store(const item *it) noexcept {
+    uint32_t page, offset;
+
+    {
+        mtx_guard g(this->mtx);
+
+        auto v = this->reserve(it->data_size, it->hv, page, offset);
+        if (!v) {
+            this->nrejected.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        it->for_each_piece([&v](const char *data, size_t size) {
+            std::memcpy(v, data, size);
+            v += size;
+        });
+    }
+
+    this->nstored.fetch_add(1, std::memory_order_relaxed);
+    this->nstored_bytes.fetch_add(it->data_size, std::memory_order_relaxed);
+
+    return item::create_flash(it, page, offset);
+}
+
+void flash_store::retain(uint32_t page, size_t size) noexcept {
+    this->pages[page].live += record_size(size);
+}
+
+void flash_store::release(uint32_t page, size_t size) noexcept {
+    auto bytes = record_size(size);
+    auto &p = this->pages[page];
+
+    if (p.live.fetch_sub(bytes) != bytes) {
+        return;
+    }
+
+    mtx_guard g(this->mtx);
+    this->maybe_free(page);
+}
+
+bool flash_store::read_buffered(uint32_t page, uint32_t offset, uint32_t hv, size_t size,
+                                std::vector<char> &out) noexcept
+{
+    auto copy = [&](const write_buffer *b) {
+        if (!b || b->page != page || offset < b->offset
+            || offset + record_size(size) > b->offset + b->data.size())
+        {
+            return false;
+        }
+
+        auto p = b->data.data() + (offset - b->offset);
+
+        record_header header;
+        std::memcpy(&header, p, sizeof(header));
+        if (header.hv != hv || header.value_size != size) {
+            return false;
+        }
+
+        out.assign(p + sizeof(header), p + sizeof(header) + size);
+        return true;
+    };
+
+    if (copy(this->current)) {
+        return true;
+    }
+
+    for (auto b : this->pending) {
+        if (copy(b)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool flash_store::read_device(uint32_t page, uint32_t offset, uint32_t hv, size_t size,
+                              std::vector<char> &out) noexcept
+{
+    record_header header;
+    out.resize(size);
+
+    struct iovec iov[2] = {
+        {&header, sizeof(header)},
+        {out.data(), size}
+    };
+
+    auto at = static_cast<off_t>(page) * this->page_size + offset;
+    auto total = sizeof(header) + size;
+
+    ssize_t n;
+    while ((n = preadv(this->fd, iov, 2, at)) == -1 && errno == EINTR) {
+    }
+
+    // A value is read in one go unless the device is failing.
+    if (n != static_cast<ssize_t>(total) || header.hv != hv || header.value_size != size) {
+        this->nread_errors.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    this->nreads.fetch_add(1, std::memory_order_relaxed);
+    this->nread_bytes.fetch_add(total, std::memory_order_relaxed);
+    return true;
+}
+
+bool flash_store::read(flash_read *r) noexcept {
+    {
+        mtx_guard g(this->mtx);
+
+        if (this->read_buffered(r->page, r->offset, r->hv, r->size, r->value)) {
+            this->nbuffer_hits.fetch_add(1, std::memory_order_relaxed);
+            r->ok = true;
+            return true;
+        }
+
+        this->pages[r->page].pins++;
+    }
+
+    {
+        mtx_guard g(this->read_mtx);
+        this->reads.push_back(r);
+    }
+
+    this->read_cv.notify_one();
+    return false;
+}
+
+bool flash_store::read_value(const item *it, std::vector<char> &out) noexcept {
+    {
+        mtx_guard g(this->mtx);
+
+        if (this->read_buffered(it->flash_page, it->flash_offset, it->hv, it->data_size, out)) {
+            this->nbuffer_hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        this->pages[it->flash_page].pins++;
+    }
+
+    auto ok = this->read_device(it->flash_page, it->flash_offset, it->hv, it->data_size, out);
+    this->unpin(it->flash_page);
+
+    return ok;
+}
+
+void flash_store::run_writer() noexcept {
+    while (true) {
+        write_buffer *b;
+        {
+            std::unique_lock<std::mutex> l(this->mtx);
+            this->writer_cv.wait(l, [this] {
+                return !this->pending.empty();
+            });
+
+            // Stays queued, and readable, until it is written.
+            b = this->pending.front();
+        }
+
+        auto at = static_cast<off_t>(b->page) * this->page_size + b->offset;
+
+        for (size_t done = 0; done < b->data.size(); ) {
+            auto n = pwrite(this->fd, b->data.data() + done, b->data.size() - done, at + done);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                perror("flash pwrite()");
+                this->nwrite_errors.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+
+            done += n;
+        }
+
+        this->nwrites.fetch_add(1, std::memory_order_relaxed);
+
+        {
+            mtx_guard g(this->mtx);
+            this->pending.pop_front();
+            this->pages[b->page].pins--;
+            this->maybe_free(b->page);
+        }
+
+        delete b;
+    }
+}
+
+void flash_store::run_reader() noexcept {
+    while (true) {
+        flash_read *r;
+        {
+            std::unique_lock<std::mutex> l(this->read_mtx);
+            this->read_cv.wait(l, [this] {
+                return !this->reads.empty();
+            });
+
+            r = this->reads.front();
+            this->reads.pop_front();
+        }
+
+        r->ok = this->read_device(r->page, r->offset, r->hv, r->size, r->value);
+        this->unpin(r->page);
+
+        r->complete(r);
+    }
+}
+
+uint32_t flash_store::pick_page(bool &drop) noexcept {
+    mtx_guard g(this->mtx);
+
+    if (this->free_list.size() > std::max<size_t>(2, this->npages / 8)) {
+        return no_page;
+    }
+
+    auto best = no_page;
+    auto oldest = no_page;
+
+    for (uint32_t page = 0; page < this->npages; page++) {
+        auto &p = this->pages[page];
+
+        // Still being written out.
+        if (p.state != PAGE_SEALED || p.pins > 0) {
+            continue;
+        }
+
+        if (best == no_page || p.live.load() < this->pages[best].live.load()) {
+            best = page;
+        }
+
+        if (oldest == no_page || p.sealed_at < this->pages[oldest].sealed_at) {
+            oldest = page;
+        }
+    }
+
+    if (best == no_page) {
+        return no_page;
+    }
+
+    // Rewriting a mostly live page would gain next to nothing, the oldest
+    // values make room instead.
+    drop = this->pages[best].live.load() > this->page_size * max_compact_live;
+    auto page = drop ? oldest : best;
+
+    // Pinned, so that it cannot be freed and reused while it is walked.
+    this->pages[page].state = PAGE_COMPACTED;
+    this->pages[page].pins++;
+
+    return page;
+}
+
+void flash_store::compact_page(hash_table &table, uint32_t page, bool drop) noexcept {
+    static auto &epoch = epoch_manager::get_instance();
+
+    std::vector<char> buf(buffer_size);
+    std::vector<item_ptr> items;
+    auto used = this->pages[page].used;
+    auto now = std::time(0);
+    unsigned n = 0;
+
+    for (size_t region = 0; region < used; region += buffer_size) {
+        auto at = static_cast<off_t>(page) * this->page_size + region;
+        auto len = pread(this->fd, buf.data(), buffer_size, at);
+        if (len <= 0) {
+            this->nread_errors.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+
+        for (size_t off = 0; off + sizeof(record_header) <= static_cast<size_t>(len); ) {
+            record_header header;
+            std::memcpy(&header, buf.data() + off, sizeof(header));
+
+            if (header.size == 0 || header.size > len - off
+                || header.size != record_size(header.value_size))
+            {
+                break;
+            }
+
+            auto offset = static_cast<uint32_t>(region + off);
+            off += header.size;
+
+            // Only a value some header points to is live, the bucket tells.
+            items.clear();
+            table.hash_items(header.hv, items);
+
+            for (auto it : items) {
+                if (it->flash_page != page || it->flash_offset != offset) {
+                    continue;
+                }
+
+                char *v = nullptr;
+                uint32_t new_page, new_offset;
+
+                if (!drop && !it->expired(now)) {
+                    mtx_guard g(this->mtx);
+
+                    v = this->reserve(header.value_size, header.hv, new_page, new_offset);
+                    if (v) {
+                        std::memcpy(v, buf.data() + offset - region + sizeof(header),
+                                    header.value_size);
+                    }
+                }
+
+                if (!v) {
+                    if (table.relocate_item(it, header.hv, std::numeric_limits<time_t>::max())
+                        == relocate_result::EVICTED)
+                    {
+                        this->ndropped.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    break;
+                }
+
+                auto new_it = item::create_flash(it, new_page, new_offset);
+                if (table.replace_if_indexed(it, new_it)) {
+                    this->nrelocated.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    item::destroy(new_it);
+                }
+                break;
+            }
+
+            if (++n % 64 == 0) {
+                epoch.quiescent();
+            }
+        }
+    }
+
+    this->ncompacted.fetch_add(1, std::memory_order_relaxed);
+    this->unpin(page);
+}
+
+void flash_store::run_compactor(hash_table &table) noexcept {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> l(this->mtx);
+            this->compactor_cv.wait_for(l, std::chrono::milliseconds(100), [this] {
+                return this->compactor_wakeup;
+            });
+
+            this->compactor_wakeup = false;
+        }
+
+        // Moved and dropped headers are retired by this thread, going
+        // offline frees the ones past their grace period.
+        epoch_guard g;
+
+        bool drop;
+        auto page = this->pick_page(drop);
+        if (page == no_page) {
+            continue;
+        }
+
+        this->compact_page(table, page, drop);
+
+        mtx_guard lg(this->mtx);
+        this->compactor_wakeup = true;
+    }
+}
+
+void flash_store::start(hash_table &table) {
+    if (this->fd == -1) {
+        return;
+    }
+
+    this->writer = std::thread(&flash_store::run_writer, this);
+    this->writer.detach();
+
+    this->compactor = std::thread(&flash_store::run_compactor, this, std::ref(table));
+    this->compactor.detach();
+
+    for (unsigned i = 0; i < nreaders; i++) {
+        this->io_threads.emplace_back(&flash_store::run_reader, this);
+        this->io_threads.back().detach();
+    }
+}
+
+void flash_store::stats(stats_writer &out) noexcept {
+    uint64_t live = 0;
+    for (uint32_t page = 0; page < this->npages; page++) {
+        live += this->pages[page].live.load(std::memory_order_relaxed);
+    }
+
+    size_t nfree;
+    {
+        mtx_guard g(this->mtx);
+        nfree = this->free_list.size();
+    }
+
+    out.add("flash_page_size", static_cast<uint64_t>(this->page_size));
+    out.add("flash_pages", static_cast<uint64_t>(this->npages));
+    out.add("flash_free_pages", static_cast<uint64_t>(nfree));
+    out.add("flash_live_bytes", live);
+    out.add("flash_header_bytes", static_cast<uint64_t>(this->headers_size()));
+    out.add("flash_stored_items", this->nstored.load());
+    out.add("flash_stored_bytes", this->nstored_bytes.load());
+    out.add("flash_rejected_items", this->nrejected.load());
+    out.add("flash_writes", this->nwrites.load());
+    out.add("flash_write_errors", this->nwrite_errors.load());
+    out.add("flash_reads", this->nreads.load());
+    out.add("flash_read_bytes", this->nread_bytes.load());
+    out.add("flash_read_errors", this->nread_errors.load());
+    out.add("flash_buffer_hits", this->nbuffer_hits.load());
+    out.add("flash_compacted_pages", this->ncompacted.load());
+    out.add("flash_relocated_items", this->nrelocated.load());
+    out.add("flash_dropped_items", this->ndropped.load());
+}
+
+}
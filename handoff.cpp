@@ -0,0 +1,236 @@
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <handoff.h>
+#include <setting.h>
+
+namespace cached {
+
+// More listening sockets than any address resolves to.
+static const size_t max_fds = 64;
+
+static bool unix_address(const char *path, struct sockaddr_un &addr) noexcept {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (std::strlen(path) >= sizeof(addr.sun_path)) {
+        std::fprintf(stderr, "handoff path too long: %s\n", path);
+        return false;
+    }
+
+    std::strcpy(addr.sun_path, path);
+    return true;
+}
+
+handoff::handoff() :
+listen_fd(-1),
+predecessor_fd(-1),
+successor_fd(-1),
+successor_wants_clients(false)
+{
+}
+
+bool handoff::send_fds(int sock, char kind, const int *fds, size_t n) noexcept {
+    char control[CMSG_SPACE(max_fds * sizeof(int))];
+    struct iovec iov = {&kind, 1};
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (n > 0) {
+        std::memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+    }
+
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool handoff::recv_fds(int sock, char &kind, std::vector<int> &fds) noexcept {
+    char control[CMSG_SPACE(max_fds * sizeof(int))];
+    struct iovec iov = {&kind, 1};
+
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    if (n == 0) {
+        return false;
+    }
+
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        auto data = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+        fds.insert(fds.end(), data, data + count);
+    }
+
+    return true;
+}
+
+bool handoff::connect_predecessor(std::vector<int> &listeners) noexcept {
+    auto &setting = setting::get_instance();
+
+    struct sockaddr_un addr;
+    if (!unix_address(setting.handoff_path, addr)) {
+        return false;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        std::perror("socket()");
+        return false;
+    }
+
+    // Nobody listening is a cold start.
+    if (connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1) {
+        close(sock);
+        return false;
+    }
+
+    char kind = setting.handoff_clients ? 'C' : 'L';
+    if (!send_fds(sock, kind, nullptr, 0) || !recv_fds(sock, kind, listeners) || kind != 'L') {
+        std::fprintf(stderr, "handoff from %s failed\n", setting.handoff_path);
+
+        for (auto fd : listeners) {
+            close(fd);
+        }
+
+        listeners.clear();
+        close(sock);
+        return false;
+    }
+
+    this->predecessor_fd = sock;
+
+    std::fprintf(stderr, "took over %zu listening sockets from %s\n",
+                 listeners.size(), setting.handoff_path);
+    return true;
+}
+
+int handoff::receive_client() noexcept {
+    if (this->predecessor_fd == -1) {
+        return -1;
+    }
+
+    char kind;
+    std::vector<int> fds;
+
+    while (recv_fds(this->predecessor_fd, kind, fds)) {
+        if (kind == 'C' && fds.size() == 1) {
+            return fds[0];
+        }
+
+        for (auto fd : fds) {
+            close(fd);
+        }
+
+        fds.clear();
+    }
+
+    close(this->predecessor_fd);
+    this->predecessor_fd = -1;
+    return -1;
+}
+
+int handoff::listen() noexcept {
+    auto &setting = setting::get_instance();
+
+    struct sockaddr_un addr;
+    if (!unix_address(setting.handoff_path, addr)) {
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        std::perror("socket()");
+        return -1;
+    }
+
+    // Left behind by the predecessor.
+    unlink(setting.handoff_path);
+
+    if (bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1
+        || ::listen(sock, 1) == -1)
+    {
+        std::perror("handoff socket");
+        close(sock);
+        return -1;
+    }
+
+    this->listen_fd = sock;
+    return sock;
+}
+
+bool handoff::accept_successor(const std::vector<int> &listeners) noexcept {
+    int sock = accept4(this->listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock == -1) {
+        return false;
+    }
+
+    char kind;
+    std::vector<int> none;
+
+    if (!recv_fds(sock, kind, none)
+        || !send_fds(sock, 'L', listeners.data(), listeners.size()))
+    {
+        close(sock);
+        return false;
+    }
+
+    close(this->listen_fd);
+    this->listen_fd = -1;
+
+    std::lock_guard<std::mutex> g(this->mtx);
+    this->successor_fd = sock;
+    this->successor_wants_clients = kind == 'C';
+
+    return true;
+}
+
+void handoff::release_client(int fd) noexcept {
+    {
+        std::lock_guard<std::mutex> g(this->mtx);
+
+        if (this->successor_wants_clients
+            && !send_fds(this->successor_fd, 'C', &fd, 1))
+        {
+            this->successor_wants_clients = false;
+        }
+    }
+
+    close(fd);
+}
+
+}
@@ -0,0 +1,289 @@
+#include <cstring>
+#include <algorithm>
+
+#include <immintrin.h>
+
+#include <hash.h>
+#include <murmur3.h>
+
+namespace cached {
+
+static uint32_t murmur3_32(const char *key, size_t len, uint32_t seed) {
+    uint32_t res;
+    MurmurHash3_x86_32(key, static_cast<int>(len), seed, &res);
+    return res;
+}
+
+static uint32_t murmur3_x64_128(const char *key, size_t len, uint32_t seed) {
+    uint64_t res[2];
+    MurmurHash3_x64_128(key, static_cast<int>(len), seed, res);
+    return static_cast<uint32_t>(res[0] ^ (res[0] >> 32));
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c(const char *key, size_t len, uint32_t seed) {
+    uint64_t crc = ~seed;
+
+    for (; len >= 8; len -= 8, key += 8) {
+        uint64_t v;
+        std::memcpy(&v, key, 8);
+        crc = _mm_crc32_u64(crc, v);
+    }
+
+    for (; len > 0; len--, key++) {
+        crc = _mm_crc32_u8(static_cast<uint32_t>(crc), static_cast<uint8_t>(*key));
+    }
+
+    return ~static_cast<uint32_t>(crc);
+}
+
+//-----------------------------------------------------------------------------
+// 64-bit multiply-mix hash following wyhash (public domain, Wang Yi).
+
+static const uint64_t wyp[4] = {
+        0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+        0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static inline void wymum(uint64_t *a, uint64_t *b) noexcept {
+    __uint128_t r = *a;
+    r *= *b;
+    *a = static_cast<uint64_t>(r);
+    *b = static_cast<uint64_t>(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) noexcept {
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t *p) noexcept {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) noexcept {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k) noexcept {
+    return (static_cast<uint64_t>(p[0]) << 16)
+           | (static_cast<uint64_t>(p[k >> 1]) << 8)
+           | p[k - 1];
+}
+
+static uint64_t wyhash64(const char *key, size_t len, uint64_t seed) noexcept {
+    auto p = reinterpret_cast<const uint8_t *>(key);
+    uint64_t a, b;
+
+    seed ^= wymix(seed ^ wyp[0], wyp[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        auto i = len;
+
+        if (i > 48) {
+            auto see1 = seed, see2 = seed;
+
+            do {
+                seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+
+            seed ^= see1 ^ see2;
+        }
+
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
+
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+static uint32_t wyhash(const char *key, size_t len, uint32_t seed) {
+    auto h = wyhash64(key, len, seed);
+    return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+//-----------------------------------------------------------------------------
+// MurmurHash3_x86_32 over eight keys, one per 32-bit lane.
+
+__attribute__((target("avx2")))
+static inline __m256i rotl32x8(__m256i x, int r) noexcept {
+    return _mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - r));
+}
+
+__attribute__((target("avx2")))
+static void murmur3_32_x8(const std::string *keys,
+                          uint32_t seed,
+                          uint32_t *out) noexcept
+{
+    const auto c1 = _mm256_set1_epi32(0xcc9e2d51);
+    const auto c2 = _mm256_set1_epi32(0x1b873593);
+
+    alignas(32) uint32_t lane[8];
+    alignas(32) uint32_t nblocks[8];
+    alignas(32) const char *data[8];
+    size_t max_blocks = 0;
+
+    for (int i = 0; i < 8; i++) {
+        data[i] = keys[i].data();
+        nblocks[i] = static_cast<uint32_t>(keys[i].size() / 4);
+        max_blocks = std::max<size_t>(max_blocks, nblocks[i]);
+    }
+
+    auto h = _mm256_set1_epi32(seed);
+    auto blocks = _mm256_load_si256(reinterpret_cast<const __m256i *>(nblocks));
+    auto addr_lo = _mm256_load_si256(reinterpret_cast<const __m256i *>(data));
+    auto addr_hi = _mm256_load_si256(reinterpret_cast<const __m256i *>(data + 4));
+    const auto step = _mm256_set1_epi64x(4);
+
+    for (size_t b = 0; b < max_blocks; b++) {
+        auto active = _mm256_cmpgt_epi32(blocks, _mm256_set1_epi32(static_cast<int>(b)));
+
+        // Gather block b of every key that still has one, addresses are
+        // absolute so the base pointer is null.
+        auto lo = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), nullptr, addr_lo,
+                                              _mm256_castsi256_si128(active), 1);
+        auto hi = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), nullptr, addr_hi,
+                                              _mm256_extracti128_si256(active, 1), 1);
+        addr_lo = _mm256_add_epi64(addr_lo, step);
+        addr_hi = _mm256_add_epi64(addr_hi, step);
+
+        auto k = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+        k = _mm256_mullo_epi32(k, c1);
+        k = rotl32x8(k, 15);
+        k = _mm256_mullo_epi32(k, c2);
+
+        auto hn = _mm256_xor_si256(h, k);
+        hn = rotl32x8(hn, 13);
+        hn = _mm256_add_epi32(_mm256_mullo_epi32(hn, _mm256_set1_epi32(5)),
+                              _mm256_set1_epi32(0xe6546b64));
+
+        h = _mm256_blendv_epi8(h, hn, active);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        auto tail = reinterpret_cast<const uint8_t *>(keys[i].data()) + nblocks[i] * 4;
+        uint32_t k1 = 0;
+
+        switch (keys[i].size() & 3) {
+            case 3: k1 ^= tail[2] << 16;
+            case 2: k1 ^= tail[1] << 8;
+            case 1: k1 ^= tail[0];
+        }
+
+        lane[i] = k1;
+    }
+
+    auto k = _mm256_load_si256(reinterpret_cast<const __m256i *>(lane));
+    k = _mm256_mullo_epi32(k, c1);
+    k = rotl32x8(k, 15);
+    k = _mm256_mullo_epi32(k, c2);
+
+    // A zero tail contributes nothing, exactly like the scalar code skipping it.
+    h = _mm256_xor_si256(h, k);
+
+    for (int i = 0; i < 8; i++) {
+        lane[i] = static_cast<uint32_t>(keys[i].size());
+    }
+    h = _mm256_xor_si256(h, _mm256_load_si256(reinterpret_cast<const __m256i *>(lane)));
+
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x85ebca6b));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0xc2b2ae35));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), h);
+}
+
+//-----------------------------------------------------------------------------
+
+hash_func get_hash_func(hash_function fn) noexcept {
+    switch (fn) {
+        case hash_function::MURMUR3_X64_128:
+            return murmur3_x64_128;
+
+        case hash_function::CRC32C:
+            if (__builtin_cpu_supports("sse4.2")) {
+                return crc32c;
+            }
+
+            return murmur3_32;
+
+        case hash_function::WYHASH:
+            return wyhash;
+
+        default:
+            return murmur3_32;
+    }
+}
+
+void key_digest(const std::string &key, uint32_t seed, uint64_t *out) noexcept {
+    MurmurHash3_x64_128(key.data(), static_cast<int>(key.size()), seed, out);
+}
+
+const char *hash_function_name(hash_function fn) noexcept {
+    switch (fn) {
+        case hash_function::MURMUR3_X64_128:
+            return "murmur3-128";
+
+        case hash_function::CRC32C:
+            return "crc32c";
+
+        case hash_function::WYHASH:
+            return "wyhash";
+
+        default:
+            return "murmur3";
+    }
+}
+
+void hash_batch(hash_function fn,
+                const std::string *keys,
+                size_t n,
+                uint32_t seed,
+                uint32_t *out) noexcept
+{
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    size_t i = 0;
+
+    if (fn == hash_function::MURMUR3_32 && has_avx2) {
+        for (; i + 8 <= n; i += 8) {
+            murmur3_32_x8(keys + i, seed, out + i);
+        }
+    }
+
+    auto f = get_hash_func(fn);
+    for (; i < n; i++) {
+        out[i] = f(keys[i].data(), keys[i].size(), seed);
+    }
+}
+
+}
@@ -6,36 +6,146 @@
 #include <atomic>
 #include <string>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <list>
+#include <algorithm>
+#include <vector>
 
 #include <stdint.h>
-#include <murmur3.h>
+#include <hash.h>
+#include <swiss.h>
+#include <mrc.h>
+#include <chain.h>
+#include <flash.h>
+#include <setting.h>
 
 namespace cached {
 
 class item;
+class eviction_policy;
+struct shared_value;
+
+// What hash_table::relocate_item() did with an item.
+enum class relocate_result {
+    GONE,
+    MOVED,
+    EVICTED
+};
 
-typedef std::shared_ptr<item> item_ptr;
-typedef std::weak_ptr<item> item_weak_ptr;
+typedef item * item_ptr;
 typedef std::lock_guard<std::mutex> mtx_guard;
 
-class bucket {
+// Test-and-test-and-set lock small enough to live inside a bucket line.
+class spinlock {
+    std::atomic<uint32_t> word;
+
+public:
+    spinlock() : word(0) { }
+
+    inline void lock() noexcept {
+        for (unsigned spins = 0; ; spins++) {
+            if (this->word.load(std::memory_order_relaxed) == 0
+                && this->word.exchange(1, std::memory_order_acquire) == 0)
+            {
+                return;
+            }
+
+            if (spins >= 64) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    inline void unlock() noexcept {
+        this->word.store(0, std::memory_order_release);
+    }
+};
+
+typedef std::lock_guard<spinlock> spin_guard;
+
+// A bucket is one cache line: its lock, the seqlock version, a few inline
+// slots tagged with 16 bits of the hash so most mismatches are rejected
+// without touching the item, and a chain for whatever does not fit. Once
+// the table grew past it, forwarded tells its items are in the next array.
+class alignas(64) bucket {
+public:
+    static const unsigned nslots = 4;
+
 private:
-    std::mutex mtx;
-    item_ptr head = nullptr;
+    spinlock mtx;
+
+    // Seqlock version, odd while a writer is modifying the bucket.
+    std::atomic<uint32_t> version;
+
+    uint16_t tags[nslots];
+    std::atomic<item *> slots[nslots];
+    std::atomic<item *> overflow;
+    std::atomic<bool> forwarded;
+
+    static inline uint16_t tag(uint32_t hv) noexcept {
+        return static_cast<uint16_t>(hv >> 16);
+    }
+
+    void remove_overflow(item_ptr it) noexcept;
+
+    inline void write_begin() noexcept {
+        this->version.store(this->version.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    inline void write_end() noexcept {
+        this->version.store(this->version.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_release);
+    }
 
 public:
     friend class item;
     friend class hash_table;
 
-    void insert_item(item_ptr &it);
-    void remove(item_ptr &it);
+    bucket();
+
+    // operator new[] does not honour the line alignment before C++17.
+    static bucket *new_table(size_t n) noexcept;
+    static void delete_table(bucket *table, size_t n) noexcept;
+
+    item_ptr find(std::string &key, uint32_t hv, const uint64_t *digest) const noexcept;
+    void insert_item(item_ptr it) noexcept;
+    void remove(item_ptr it) noexcept;
+    void replace(item_ptr old_it, item_ptr new_it) noexcept;
 
     inline void unlock() {
         this->mtx.unlock();
     }
 };
 
+static_assert(sizeof(bucket) == 64, "bucket must fit in one cache line");
+
+// The buckets of a hash table, with their shards for index_engine::SWISS.
+// Growing the table moves the items of each bucket to the two buckets of an
+// array twice as large that take its place.
+struct bucket_array {
+    unsigned int power;
+    bucket *buckets;
+    swiss_table *shards;
+
+    // Where forwarded buckets went, set before the first one is moved.
+    bucket_array *next;
+
+    inline uint32_t index(uint32_t hv) const noexcept {
+        return hv & ((uint32_t(1) << this->power) - 1);
+    }
+
+    inline size_t size() const noexcept {
+        return size_t(1) << this->power;
+    }
+
+    static bucket_array *create(unsigned int power, bool sharded) noexcept;
+
+    static void destroy(void *a) noexcept;
+};
+
 class hash_table {
 public:
     friend class item;
@@ -45,105 +155,278 @@ public:
         return instance;
     }
 
+    // A table of its own, evicting through policy above memory_limit bytes.
+    // Every table shares the process wide hash seed and function.
+    hash_table(eviction_policy &policy, size_t memory_limit, unsigned int power = 10);
+
     hash_table(const hash_table & a) = delete;
     hash_table & operator=(const hash_table & a) = delete;
 
-    inline uint32_t hash(std::string &key) noexcept {
-        uint32_t res;
-        MurmurHash3_x86_32(key.c_str(),
-                           static_cast<int>(key.size()),
-                           this->hash_seed,
-                           &res);
-        return res;
+    inline uint32_t hash(const std::string &key) noexcept {
+        return this->hash_fn(key.data(), key.size(), this->hash_seed);
+    }
+
+    inline void hash_batch(const std::string *keys, size_t n, uint32_t *out) noexcept {
+        cached::hash_batch(this->hash_type, keys, n, this->hash_seed, out);
     }
 
-    uint32_t inline hash_index(uint32_t hv) noexcept {
-        return hv % (1 << power);
+    // The digest items are compared by in digest keyed storage, written to
+    // out, null otherwise.
+    inline const uint64_t *digest(const std::string &key, uint64_t *out) noexcept {
+        if (!this->digest_keys) {
+            return nullptr;
+        }
+
+        key_digest(key, this->hash_seed, out);
+        return out;
     }
 
-    inline bucket& get_bucket(uint32_t index) noexcept {
-        return this->table[index];
+    inline void prefetch(uint32_t hv) noexcept {
+        auto a = this->table.load(std::memory_order_acquire);
+        __builtin_prefetch(&a->buckets[a->index(hv)]);
     }
 
-    inline bucket& get_bucket(std::string& key) noexcept {
-        return this->get_bucket(this->hash_index(this->hash(key)));
+    inline size_t bucket_count() const noexcept {
+        return this->table.load(std::memory_order_acquire)->size();
     }
 
     item_ptr insert_item(std::string &key, uint32_t flags,
                              unsigned int exptime, char *data,
-                             size_t data_size);
+                             size_t data_size, uint32_t cost = 1);
+
+    item_ptr insert_item(item_ptr it);
+
+    // As insert_item, calling locked() once it is indexed and before its
+    // bucket is unlocked, to log it in the order of the key's mutations.
+    template<typename F>
+    item_ptr insert_item(item_ptr it, F locked);
+
+    // Indexes it unless an item is already indexed under its key, for items
+    // restored from a previous process that may have died mid replacement,
+    // or from a snapshot.
+    bool insert_restored(item_ptr it) noexcept;
 
+    // Locked lookup for a mutation, the bucket stays locked when the key is
+    // found. Not a reference of the miss ratio curve, the store is sampled
+    // as it is indexed.
     item_ptr find_item(std::string &key, bucket *&bp, bool update_lru = true);
 
+    // Lock-free lookup, the caller must stay online in the epoch_manager for
+    // as long as it uses the returned item.
+    item_ptr find_item_nolock(std::string &key) noexcept;
+
+    item_ptr find_item_nolock(std::string &key, uint32_t hv) noexcept;
+
+    void replace_item(bucket &b, item_ptr old_it, item_ptr new_it) noexcept;
+
+    void remove_item(bucket &b, item_ptr it) noexcept;
+
+    // Appends the items indexed under bucket index, read under its lock. The
+    // caller must stay online in the epoch_manager while it uses them. A
+    // bucket the table grew past is read from the buckets that replaced it.
+    void bucket_items(uint32_t index, std::vector<item_ptr> &out) noexcept;
+
+    // Appends the items of the bucket hash value hv belongs to, likewise.
+    void hash_items(uint32_t hv, std::vector<item_ptr> &out) noexcept;
+
+    // Appends the items of the bucket cursor points to and returns the cursor
+    // of the next one, 0 once every bucket was visited. Cursors count with
+    // their bits reversed, so the buckets visited before the table grows are
+    // exactly those the ones left come after: a key indexed for the whole
+    // walk is returned at least once.
+    uint32_t scan(uint32_t cursor, std::vector<item_ptr> &out) noexcept;
+
+    // Where hash value hv comes in the order scan() visits the table, its
+    // bits reversed.
+    static uint32_t position(uint32_t hv) noexcept;
+
+    static const uint64_t end_position = uint64_t(1) << 32;
+
+    // Appends the items of the bucket holding position pos and returns the
+    // position the next bucket starts at, end_position after the last. The
+    // bucket may hold items positioned before pos. However the table grows,
+    // a range of positions walked from its start holds the same keys.
+    uint64_t walk(uint64_t pos, std::vector<item_ptr> &out) noexcept;
+
+    // Moves it to a fresh copy if it is still indexed, for the log cleaner
+    // which only knows the item's address and hash. Items last read before
+    // evict_before are evicted instead.
+    relocate_result relocate_item(item_ptr it, uint32_t hv,
+                                  time_t evict_before = 0) noexcept;
+
+    // Puts new_it, an equivalent of it built by the caller, in its place if
+    // it is still indexed. Otherwise new_it is left to the caller.
+    bool replace_if_indexed(item_ptr it, item_ptr new_it) noexcept;
+
+    // Evicts items until the cache fits in its memory limit again. Must be
+    // called without any bucket lock held.
+    void evict() noexcept;
 
     bool inline is_expanding() const noexcept {
-        return this->expanding;
+        return this->expanding.load(std::memory_order_relaxed);
+    }
+
+    inline unsigned int power_level() const noexcept {
+        return this->table.load(std::memory_order_acquire)->power;
+    }
+
+    inline size_t item_count() const noexcept {
+        return this->nitems.load(std::memory_order_relaxed);
+    }
+
+    inline index_engine engine() const noexcept {
+        return this->engine_type;
+    }
+
+    inline uint32_t seed() const noexcept {
+        return this->hash_seed;
+    }
+
+    inline hash_function hash_function_type() const noexcept {
+        return this->hash_type;
+    }
+
+    inline uint64_t evictions() const noexcept {
+        return this->nevictions.load(std::memory_order_relaxed);
+    }
+
+    // Null unless the server estimates its miss ratio curve.
+    inline mrc_estimator *miss_ratio_curve() const noexcept {
+        return this->mrc;
     }
 
 private:
-    size_t nitems;
+    std::atomic<size_t> nitems;
 
-    bucket *table;
-    std::mutex table_lock;
+    // Per bucket open addressing shards are only allocated for
+    // index_engine::SWISS, the bucket then only provides locking.
+    std::atomic<bucket_array *> table;
+    index_engine engine_type;
 
-    bool expanding;
+    // Set while the expander thread moves the buckets to an array twice as
+    // large, once there are more items than inline slots can take.
+    std::atomic<bool> expanding;
+    std::mutex expand_mtx;
+    std::condition_variable expand_cv;
+    bool expander_started;
 
-    unsigned int power = 10;
+    bool digest_keys;
+
+    eviction_policy &policy;
+    size_t memory_limit;
+    std::atomic<uint64_t> nevictions;
+
+    mrc_estimator *mrc;
 
     uint32_t hash_seed;
+    hash_function hash_type;
+    hash_func hash_fn;
 
     hash_table();
-};
 
-class lru_queue {
-    item_ptr head;
-    item_ptr tail;
-    size_t length;
-    std::atomic<size_t> item_total_size;
+    // Gets are the references of the miss ratio curve, which predicts their
+    // hit ratio. Storing an item only moves its key up the stack at its new
+    // size.
+    inline void sample_access(item_ptr it) noexcept;
+    inline void sample_miss(uint32_t hv) noexcept;
+    inline void sample_update(item_ptr it) noexcept;
 
-    std::mutex mtx;
+    // The rest of insert_item, once it is indexed and unlocked.
+    void inserted(item_ptr it) noexcept;
 
-    lru_queue();
+    // The array and index of the bucket holding hv, past forwarded buckets.
+    bucket_array *locate(uint32_t hv, uint32_t &index) noexcept;
 
-public:
-    friend class hash_table;
+    // Locks the bucket holding hv, which stays put until it is unlocked.
+    bucket_array *lock_bucket(uint32_t hv, uint32_t &index) noexcept;
 
-    static lru_queue& get_instance() noexcept {
-        static lru_queue instance;
-        return instance;
-    }
+    // Appends the items of bucket index of a, or of the buckets it was
+    // forwarded to.
+    void collect(bucket_array *a, uint32_t index, std::vector<item_ptr> &out) noexcept;
+
+    void gather(bucket_array *a, uint32_t index, std::vector<item_ptr> &out) noexcept;
 
-    lru_queue(const lru_queue& l) = delete;
-    lru_queue & operator=(const lru_queue& l) = delete;
+    // Grows the table once it holds more items than inline slots.
+    void maybe_expand() noexcept;
 
-    void move_head(item_ptr &it) noexcept;
+    void expand() noexcept;
 
-    void remove(item_ptr &it) noexcept;
+    void run_expander() noexcept;
 
-    inline void remove_with_lock(item_ptr &it) noexcept {
-        mtx_guard g(this->mtx);
-        this->remove(it);
-    };
+    item_ptr index_find(bucket_array *a, uint32_t index, std::string &key, uint32_t hv,
+                        const uint64_t *digest) noexcept;
+    bool index_contains(bucket_array *a, uint32_t index, const item *it, uint32_t hv) noexcept;
+    void index_insert(bucket_array *a, uint32_t index, item_ptr it) noexcept;
+    void index_remove(bucket_array *a, uint32_t index, item_ptr it) noexcept;
+    void index_replace(bucket_array *a, uint32_t index, item_ptr old_it, item_ptr new_it) noexcept;
+
+    // Swaps in a copy of it under the bucket lock, keeping its metadata.
+    void index_relocate(bucket_array *a, uint32_t index, item_ptr it, item_ptr new_it) noexcept;
 };
 
 class item {
 public:
+    // In digest keyed storage the key is only kept with key_verify, and
+    // items are told apart by the digest.
     std::string key;
+    uint64_t digest[2];
     char *data;
     time_t exptime;
     time_t created_at;
-    time_t last_access;
+    std::atomic<time_t> last_access;
 
     uint32_t flags;
     uint64_t cas_key;
     size_t data_size;
 
-    uint32_t hash_index;
+    uint32_t hv;
+
+    // Cleared once the item is unlinked from its bucket. The eviction policy
+    // checks it under its lock so a late reader cannot put a dead item back.
+    std::atomic<bool> linked;
+
+    // Owned by the eviction policy: which of its queues holds the item, an
+    // access counter and the queue links.
+    std::atomic<uint8_t> queue;
+    std::atomic<uint8_t> freq;
+
+    item_ptr queue_prev;
+    item_ptr queue_next;
 
-    item_weak_ptr lru_prev;
-    item_ptr lru_next;
-    item_weak_ptr hash_prev;
-    item_ptr hash_next;
+    // Client supplied cost of a miss, and the size aware policy's priority
+    // and heap slot.
+    uint32_t cost;
+    uint32_t heap_index;
+    double priority;
+    std::atomic<item *> hash_next;
+
+    // Log segment holding the item and its value, segment_store::no_segment
+    // for items on the heap.
+    uint32_t segment;
+
+    // A chained value is the nchunks chunks from chain to chain_tail and
+    // data is unused. Append and prepend hand the chunks over to the item
+    // replacing this one instead of copying them.
+    value_chunk *chain;
+    value_chunk *chain_tail;
+    uint32_t nchunks;
+    bool owns_chain;
+
+    // Size of the value before compression, 0 unless data holds it
+    // compressed by the value_codec.
+    size_t raw_size;
+
+    // Set when data points into a value shared through the dedup_store.
+    shared_value *shared;
+
+    // Flash page holding the value of an item evicted to the flash tier,
+    // flash_store::no_page while the value is in memory, and its offset
+    // there. data is then unused.
+    uint32_t flash_page;
+    uint32_t flash_offset;
+
+    // Digests found equal for different keys by key_verify.
+    static std::atomic<uint64_t> digest_collisions;
 
     ~item();
 
@@ -153,11 +436,195 @@ public:
          char * data,
          size_t data_size);
 
+    item(std::string& key,
+         uint32_t flags,
+         unsigned int exptime,
+         size_t data_size);
+
+    // Allocate from the configured storage engine, items created this way
+    // are freed with destroy().
+    static item_ptr create(std::string& key,
+                           uint32_t flags,
+                           unsigned int exptime,
+                           size_t data_size);
+
+    static item_ptr create(std::string& key,
+                           uint32_t flags,
+                           unsigned int exptime,
+                           const char *data,
+                           size_t data_size);
+
+    // An item with the key, flags and expiry of like, for a key not at hand
+    // in digest keyed storage.
+    static item_ptr create(const item *like, size_t data_size);
+
+    // An item for a key known only by its hash and digest, in digest keyed
+    // storage without key_verify.
+    static item_ptr create(uint32_t hv,
+                           const uint64_t *digest,
+                           uint32_t flags,
+                           unsigned int exptime,
+                           size_t data_size);
+
+    // An item with an empty chained value, see chain_append().
+    static item_ptr create_chained(std::string& key,
+                                   uint32_t flags,
+                                   unsigned int exptime);
+
+    // An item whose value is v, taking over the caller's reference.
+    static item_ptr create_shared(std::string& key,
+                                  uint32_t flags,
+                                  unsigned int exptime,
+                                  shared_value *v);
+
+    static item_ptr create_shared(const item *like, shared_value *v);
+
+    // A header for the value of like written to the flash tier at page and
+    // offset.
+    static item_ptr create_flash(const item *like, uint32_t page, uint32_t offset);
+
+    static void destroy(item_ptr it) noexcept;
+
+    // Rebuilds in place an item a previous process left in a file backed log
+    // arena, followed by its value and key_size bytes of key.
+    static item_ptr restore(item *stale, size_t key_size) noexcept;
+
+    // Whether the item is stored under key, whose digest is given in digest
+    // keyed storage.
+    inline bool has_key(const std::string &key, const uint64_t *key_digest) const noexcept {
+        if (!key_digest) {
+            return this->key == key;
+        }
+
+        if (this->digest[0] != key_digest[0] || this->digest[1] != key_digest[1]) {
+            return false;
+        }
+
+        if (this->key.empty() || this->key == key) {
+            return true;
+        }
+
+        digest_collisions.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    inline bool chained() const noexcept {
+        return this->chain != nullptr;
+    }
+
+    inline bool compressed() const noexcept {
+        return this->raw_size != 0;
+    }
+
+    inline bool on_flash() const noexcept {
+        return this->flash_page != flash_store::no_page;
+    }
+
+    // Chunks beyond what value_chunk_size needs, compact() is due.
+    bool fragmented() const noexcept;
+
+    // Only for an item not yet linked.
+    void chain_append(value_chunk *c) noexcept;
+    void chain_prepend(value_chunk *c) noexcept;
+
+    // Takes over the chained value of from, which must be locked in its
+    // bucket and about to be replaced.
+    void adopt_chain(item_ptr from) noexcept;
+
+    // Copies the value of from into chunks of value_chunk_size bytes.
+    void compact(const item *from) noexcept;
+
+    // Calls fn(data, size) on each piece of the value in order.
+    template<typename F>
+    void for_each_piece(F fn) const {
+        if (!this->chain) {
+            fn(this->data, this->data_size);
+            return;
+        }
+
+        auto remaining = this->data_size;
+        for (auto c = this->chain; ; c = c->next.load(std::memory_order_acquire)) {
+            auto n = std::min(c->size, remaining);
+            fn(c->bytes(), n);
+
+            // The last chunk may already be linked to a newer version's.
+            if ((remaining -= n) == 0) {
+                break;
+            }
+        }
+    }
+
+    // Per the memcached protocol an exptime of up to max_exptime seconds is
+    // relative to the creation time, a larger one is a unix time and 0 never
+    // expires.
+    bool expired(time_t now) const noexcept;
+
     inline void update_cas_key() noexcept {
         this->cas_key++;
     }
+
+    // Memory charged against the cache limit.
+    inline size_t total_size() const noexcept {
+        return sizeof(item) + this->key.size() + (this->on_flash() ? 0 : this->data_size);
+    }
+
+private:
+    item(std::string& key,
+         uint32_t flags,
+         unsigned int exptime,
+         size_t data_size,
+         uint32_t hv,
+         const uint64_t *digest,
+         char *data,
+         uint32_t segment);
+
+    // Room for the item, and for its value unless it is the shared v, from
+    // the configured storage engine. digest is computed from key when null.
+    static item_ptr allocate(std::string& key,
+                             uint32_t hv,
+                             const uint64_t *digest,
+                             uint32_t flags,
+                             unsigned int exptime,
+                             size_t data_size,
+                             shared_value *v);
 };
 
+template<typename F>
+item_ptr hash_table::insert_item(item_ptr it, F locked) {
+    it->linked = true;
+
+    {
+        uint32_t index;
+        auto a = this->lock_bucket(it->hv, index);
+        spin_guard g(a->buckets[index].mtx, std::adopt_lock);
+
+        this->index_insert(a, index, it);
+        locked();
+    }
+
+    this->inserted(it);
+
+    return it;
+}
+
+inline void hash_table::sample_access(item_ptr it) noexcept {
+    if (this->mrc && this->mrc->sampled(it->hv)) {
+        this->mrc->access(it->hv, it->total_size());
+    }
+}
+
+inline void hash_table::sample_miss(uint32_t hv) noexcept {
+    if (this->mrc && this->mrc->sampled(hv)) {
+        this->mrc->miss(hv);
+    }
+}
+
+inline void hash_table::sample_update(item_ptr it) noexcept {
+    if (this->mrc && this->mrc->sampled(it->hv)) {
+        this->mrc->update(it->hv, it->total_size());
+    }
+}
+
 }
 
 #endif //_ASSOC_H
@@ -0,0 +1,110 @@
+#ifndef _BULK_H
+#define _BULK_H
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace cached {
+
+// Bulk export and import of the whole keyspace, by cached-dump and
+// cached-restore, to seed a node or move the data of another cluster.
+//
+// The keyspace is split into ranges of hash_table::position()s, which stay
+// put as the table grows. For the items in positions [from, to)
+//
+//     dump <from> <to>\r\n
+//
+// is answered with one block of records and where to continue,
+//
+//     BLOCK <next> <nrecords> <raw_size> <size>\r\n<size bytes>\r\n
+//
+// next being to once the range is done. A block is LZ4 compressed unless that
+// did not make it smaller, when size is raw_size. The server fills blocks of
+// about block_size bytes a bucket at a time, and clients keep a request in
+// flight for each of many ranges over several connections, so neither side
+// ever waits for a round trip per key.
+//
+//     load <nrecords> <raw_size> <size> <age>\r\n<size bytes>\r\n
+//
+// stores the records of such a block, their time to live shortened by age
+// seconds, and is answered with LOADED <n>\r\n, the number stored.
+//
+// A dump file is a file_header followed by the blocks as they were received,
+// each behind a block_header, so restoring never decompresses.
+namespace bulk {
+
+static const uint64_t end_position = uint64_t(1) << 32;
+
+static const size_t block_size = 256 * 1024;
+
+static const char file_magic[8] = {'C', 'A', 'C', 'H', 'E', 'D', 'B', 'K'};
+static const uint32_t file_version = 1;
+
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    int64_t created_at;
+};
+
+struct block_header {
+    uint32_t nrecords;
+    uint32_t raw_size;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+// Followed by the key and the value as clients see it. ttl is the time left
+// to live in seconds, 0 for items that never expire.
+struct __attribute__((packed)) record_header {
+    uint32_t flags;
+    uint32_t ttl;
+    uint32_t value_size;
+    uint16_t key_size;
+};
+
+static_assert(sizeof(record_header) == 14, "bulk records are 14 bytes");
+
+// The largest block a server taking values of up to max_item_size bytes
+// sends or accepts, a full block and one more record. Blocks end between
+// positions, only keys of the very same hash value could go past it.
+static inline size_t block_limit(size_t max_item_size) noexcept {
+    return block_size + sizeof(record_header) + UINT16_MAX + max_item_size;
+}
+
+// A blocking connection to a server, for the bulk tools.
+class client {
+    int fd;
+    std::vector<char> buf;
+    size_t begin;
+    size_t end;
+
+    // Reads more of the reply into buf, false on EOF or error.
+    bool fill() noexcept;
+
+public:
+    client();
+
+    client(const client &c) = delete;
+    client & operator=(const client &c) = delete;
+
+    ~client();
+
+    bool connect(const char *host, const char *port) noexcept;
+
+    bool send(const char *data, size_t size) noexcept;
+
+    // The next line of the reply, without its \r\n.
+    bool read_line(std::string &line) noexcept;
+
+    // The next size bytes of the reply, then its \r\n.
+    bool read_data(std::vector<char> &out, size_t size) noexcept;
+};
+
+}
+
+}
+
+#endif //_BULK_H
@@ -0,0 +1,71 @@
+#ifndef _CHAIN_H
+#define _CHAIN_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <condition_variable>
+
+#include <stdint.h>
+
+#include <stats.h>
+
+namespace cached {
+
+class item;
+
+// One piece of a chained value. Chunks never change once linked except for
+// next, set on the last chunk by an append while older versions of the item
+// may still be reading, each only up to its own length.
+struct value_chunk {
+    std::atomic<value_chunk *> next;
+    size_t size;
+
+    inline char *bytes() noexcept {
+        return reinterpret_cast<char *>(this + 1);
+    }
+
+    static value_chunk *create(const char *data, size_t size) noexcept;
+
+    static void destroy(value_chunk *c) noexcept;
+};
+
+// Rewrites fragmented chains into chunks of value_chunk_size bytes from a
+// background thread, started on first use. Items are queued by address and
+// hash and moved with hash_table::relocate_item(), so an item replaced in the
+// meantime is simply skipped.
+class chain_compactor {
+    static const size_t max_pending = 4096;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<std::pair<item *, uint32_t>> pending;
+
+    std::once_flag started;
+    std::thread worker;
+
+    std::atomic<uint64_t> ncompacted;
+
+    chain_compactor() : ncompacted(0) { }
+
+    void run() noexcept;
+
+public:
+    static chain_compactor& get_instance() noexcept {
+        static chain_compactor instance;
+        return instance;
+    }
+
+    chain_compactor(const chain_compactor& c) = delete;
+    chain_compactor & operator=(const chain_compactor& c) = delete;
+
+    void schedule(item *it) noexcept;
+
+    void stats(stats_writer &out) noexcept;
+};
+
+}
+
+#endif //_CHAIN_H
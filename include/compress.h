@@ -0,0 +1,89 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include <stats.h>
+
+namespace cached {
+
+class item;
+class hash_table;
+
+// Transparent LZ4 compression of values. A compressed value is stored as the
+// little endian size of the original followed by one LZ4 block, the framing
+// clients opting in through compress_flag receive.
+//
+// Values are compressed when stored if they are at least compress_min_size
+// bytes, and with compress_cold_age set a background thread walks the hash
+// table and swaps the items not read for that long for compressed copies,
+// through hash_table::replace_if_indexed(). Values shrinking by less than an
+// eighth are kept as they are. Chained and deduplicated values are never
+// compressed.
+class value_codec {
+    std::thread worker;
+
+    std::atomic<uint64_t> ncompressed;
+    std::atomic<uint64_t> nincompressible;
+    std::atomic<uint64_t> ndecompressed;
+    std::atomic<uint64_t> ncold;
+
+    std::atomic<uint64_t> bytes_in;
+    std::atomic<uint64_t> bytes_out;
+
+    // Thread CPU time spent in the codec.
+    std::atomic<uint64_t> compress_ns;
+    std::atomic<uint64_t> decompress_ns;
+
+    value_codec();
+
+    // The compressed form of data in a per thread buffer, null if it does
+    // not compress well enough.
+    const char *encode(const char *data, size_t size, size_t &encoded_size) noexcept;
+
+    void run(hash_table &table) noexcept;
+
+public:
+    static const size_t header_size = 4;
+
+    static value_codec& get_instance() noexcept {
+        static value_codec instance;
+        return instance;
+    }
+
+    value_codec(const value_codec& c) = delete;
+    value_codec & operator=(const value_codec& c) = delete;
+
+    // An item holding the value compressed, null if it does not compress
+    // well enough.
+    item *compress(std::string& key,
+                   uint32_t flags,
+                   unsigned int exptime,
+                   const char *data,
+                   size_t size) noexcept;
+
+    // A compressed copy of the item, null if it does not compress well.
+    item *compress(const item *it) noexcept;
+
+    // Decodes the value of a compressed item into out.
+    bool decompress(const item *it, std::vector<char> &out) noexcept;
+
+    // Decodes a compressed value of size bytes, raw_size once decoded, such
+    // as one read back from flash.
+    bool decompress(const char *data, size_t size, size_t raw_size,
+                    std::vector<char> &out) noexcept;
+
+    // Starts compressing cold items.
+    void start(hash_table &table);
+
+    void stats(stats_writer &out) noexcept;
+};
+
+}
+
+#endif //_COMPRESS_H
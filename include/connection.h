@@ -4,8 +4,10 @@
 #include <vector>
 #include <string>
 #include <cstdlib>
+#include <cstring>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <ev.h>
 
 #include <assoc.h>
@@ -20,6 +22,7 @@ public:
         WAIT_CMD,
         READ_CMD_BUF,
         PARSE_CMD,
+        WAIT_IO,
         CLOSED
     };
 
@@ -33,6 +36,7 @@ public:
         ITEM_SIZE,
         ITEM,
         CAS_KEY,
+        COST,
         SUCCESS
     };
 
@@ -58,7 +62,11 @@ public:
         APPEND,
         PREPEND,
         REPLACE,
-        DELETE
+        DELETE,
+        STATS,
+        SCAN,
+        DUMP,
+        LOAD
     };
 
 #define FOREACH_COMMAND(x)\
@@ -70,7 +78,11 @@ public:
     x("append", connection::cmd_type::APPEND)\
     x("prepend", connection::cmd_type::PREPEND)\
     x("replace", connection::cmd_type::REPLACE)\
-    x("delete", connection::cmd_type::DELETE)
+    x("delete", connection::cmd_type::DELETE)\
+    x("stats", connection::cmd_type::STATS)\
+    x("scan", connection::cmd_type::SCAN)\
+    x("dump", connection::cmd_type::DUMP)\
+    x("load", connection::cmd_type::LOAD)
 
 private:
     worker &worker_base;
@@ -84,11 +96,26 @@ private:
     char *wcurr;
     char *wbuf;
     size_t w_unwrite;
+    std::vector<struct iovec> wiov;
+
+    // Compressed values decoded for the client.
+    std::vector<char> wvalue;
+
+    // Records of a bulk dump or load, and the block they are packed in.
+    std::vector<char> bulk_raw;
+    std::vector<char> bulk_packed;
 
     size_t ritem_saved;
     size_t ritem_buf_len;
     char *ritem_buf;
 
+    // Values above value_chunk_size are read into a chain of chunks
+    // instead of ritem_buf, and handed to the new item as they are.
+    bool ritem_chunked;
+    value_chunk *rchain;
+    value_chunk *rchain_tail;
+    size_t rchain_fill;
+
     bool wevent_bound;
 
     conn_state state;
@@ -97,13 +124,41 @@ private:
 
     cmd_type cmd_curr;
     std::vector<std::string> cmd_key;
+    std::vector<uint32_t> cmd_hv;
+
+    // The key being parsed, which may span reads.
+    std::string keybuf;
 
     std::string numbuf;
     uint32_t cmd_flag;
     uint32_t cmd_exptime;
     uint64_t cmd_cas_key;
+    uint32_t cmd_cost;
     size_t cmd_item_size;
 
+    // A get that reaches a value on the flash tier answers the keys from
+    // there on once the reads are done, and stops reading requests until
+    // then. Each key found has a slot holding its value, copied or read.
+    // A dump likewise adds the records of its values on flash to the block
+    // once they are read.
+    struct get_slot {
+        std::string key;
+        uint32_t flags;
+        uint64_t cas_key;
+        size_t raw_size;
+        uint32_t ttl;
+        flash_read read;
+    };
+
+    std::vector<get_slot> get_slots;
+    size_t get_reads;
+    bool get_found;
+    bool get_return_cas;
+
+    // The position the block being dumped continues at, and its records.
+    uint64_t dump_next;
+    uint32_t dump_records;
+
     ev_io read_evio;
     ev_io write_evio;
 
@@ -115,8 +170,27 @@ private:
         this->execute_get(true);
     };
 
+    void defer_get(std::string &key, const item *it, size_t nkeys) noexcept;
+
+    // Points r at the value of it on flash, to be read for this connection.
+    void locate_read(flash_read &r, const item *it) noexcept;
+
+    // Answers the deferred part of a get and ends it.
+    void finish_get() noexcept;
+
     void execute_delete() noexcept;
 
+    void execute_stats() noexcept;
+
+    void execute_scan() noexcept;
+
+    // Adds the deferred records to the block being dumped and sends it.
+    void finish_dump() noexcept;
+
+    void execute_dump() noexcept;
+
+    void execute_load() noexcept;
+
     void execute_add() noexcept;
 
     void execute_prepend_or_append(item_ptr &it,
@@ -127,11 +201,23 @@ private:
 
     void execute_cas(item_ptr &it, bucket *&bp) noexcept;
 
+    void ritem_store(const char *data, size_t size) noexcept;
+
+    void take_rchain(item_ptr it, bool append) noexcept;
+
+    void release_rchain() noexcept;
+
+    // The value just read, as a new unlinked item.
+    item_ptr new_item(std::string &key) noexcept;
+
     void wbuf_append(const char *buf, size_t size) noexcept;
 
     inline void wbuf_append(const char * buf) noexcept {
         this->wbuf_append(buf, std::strlen(buf));
     }
+
+    // Writes the pieces in order, buffering only what the socket refuses.
+    void wbuf_appendv(struct iovec *iov, size_t n) noexcept;
 public:
     int sfd;
     connection(int fd, worker &w);
@@ -146,7 +232,7 @@ public:
 
     template<typename T>
     cmd_parse_result try_parse_number(T &res) noexcept {
-        while (*this->rcurr >= '0' && *this->rcurr <= '9' && this->r_unparsed > 0)
+        while (this->r_unparsed > 0 && *this->rcurr >= '0' && *this->rcurr <= '9')
         {
             this->numbuf.append(this->rcurr, 1);
             this->rcurr++;
@@ -169,8 +255,22 @@ public:
 
     void shrink();
 
+    // Between requests, with nothing buffered either way.
+    inline bool idle() const noexcept {
+        return this->r_unparsed == 0 && this->w_unwrite == 0
+               && (this->state == conn_state::WAIT_CMD
+                   || this->parse_state_curr == cmd_parse_state::CMD_NAME);
+    }
+
     static void drive_machine(EV_P_ ev_io *w, int revents) noexcept;
 
+    // Called on an I/O thread once a read for the connection is done, hands
+    // it over to the worker.
+    static void flash_complete(flash_read *r) noexcept;
+
+    // On the worker's loop, resumes the connection after its last read.
+    void flash_read_done(flash_read *r) noexcept;
+
     static void write_response(EV_P_ ev_io *w, int revents) noexcept;
 
     static inline connection &get_connection(ev_io *w) noexcept {
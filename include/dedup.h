@@ -0,0 +1,76 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include <stdint.h>
+
+#include <stats.h>
+
+namespace cached {
+
+// A value held once for every item storing the same bytes, freed with its
+// last reference.
+struct shared_value {
+    uint64_t fingerprint[2];
+    std::atomic<uint32_t> refs;
+    size_t size;
+
+    inline char *bytes() noexcept {
+        return reinterpret_cast<char *>(this + 1);
+    }
+};
+
+// Content addressed value store. Values of at least dedup_min_size bytes are
+// fingerprinted with MurmurHash3_x64_128 and shared by all the items holding
+// them; a matching fingerprint is confirmed by comparing the bytes.
+//
+// Items never change in place, so a key being modified gets a new item and
+// its old value just loses a reference. Items are still charged their whole
+// value against the memory limit, the saving shows in resident memory and in
+// the stats.
+class dedup_store {
+    static const unsigned nshards = 64;
+
+    struct shard {
+        std::mutex mtx;
+        std::unordered_map<uint64_t, shared_value *> values;
+    };
+
+    shard shards[nshards];
+
+    std::atomic<uint64_t> nvalues;
+    std::atomic<uint64_t> nrefs;
+    std::atomic<uint64_t> stored_bytes;
+    std::atomic<uint64_t> logical_bytes;
+    std::atomic<uint64_t> nhits;
+    std::atomic<uint64_t> ncollisions;
+
+    dedup_store();
+
+public:
+    static dedup_store& get_instance() noexcept {
+        static dedup_store instance;
+        return instance;
+    }
+
+    dedup_store(const dedup_store& d) = delete;
+    dedup_store & operator=(const dedup_store& d) = delete;
+
+    // A reference to the shared copy of data, null if another value has
+    // the same fingerprint.
+    shared_value *acquire(const char *data, size_t size) noexcept;
+
+    // One more reference, the caller must already hold one.
+    void retain(shared_value *v) noexcept;
+
+    void release(shared_value *v) noexcept;
+
+    void stats(stats_writer &out) noexcept;
+};
+
+}
+
+#endif //_DEDUP_H
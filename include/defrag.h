@@ -0,0 +1,74 @@
+#ifndef _DEFRAG_H
+#define _DEFRAG_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include <stats.h>
+
+namespace cached {
+
+class hash_table;
+
+// Active defragmentation of heap items. jemalloc packs small allocations of
+// one size class into runs; after large deletes many runs are left mostly
+// empty but pinned by a few live regions, so resident memory stays well
+// above the live data size.
+//
+// When resident memory exceeds what jemalloc reports as allocated by more
+// than the configured threshold, a background thread walks the hash table a
+// bucket at a time and relocates the items whose size classes have a low run
+// utilization, through hash_table::relocate_item(). The thread runs without a
+// tcache, so the copies are carved from the fullest, lowest runs and the
+// sparse ones drain. It works in slices bounded by a CPU budget, and purges
+// the freed pages after every pass.
+class defragmenter {
+    std::thread worker;
+
+    // Per jemalloc small size class.
+    std::vector<size_t> bin_size;
+    std::vector<uint32_t> bin_nregs;
+    std::vector<bool> sparse;
+    unsigned narenas;
+
+    std::atomic<bool> running;
+    std::atomic<uint64_t> allocated;
+    std::atomic<uint64_t> resident;
+
+    std::atomic<uint64_t> npasses;
+    std::atomic<uint64_t> nmoved;
+    std::atomic<uint64_t> nmoved_bytes;
+
+    defragmenter();
+
+    bool load_bins() noexcept;
+
+    // Refreshes the allocator statistics, true if a pass is worth it.
+    bool sample() noexcept;
+
+    bool is_sparse(size_t size) const noexcept;
+
+    void purge() noexcept;
+
+    void run(hash_table &table) noexcept;
+
+public:
+    static defragmenter& get_instance() noexcept {
+        static defragmenter instance;
+        return instance;
+    }
+
+    defragmenter(const defragmenter& d) = delete;
+    defragmenter & operator=(const defragmenter& d) = delete;
+
+    void start(hash_table &table);
+
+    void stats(stats_writer &out) noexcept;
+};
+
+}
+
+#endif //_DEFRAG_H
@@ -0,0 +1,91 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#include <atomic>
+#include <vector>
+
+#include <stdint.h>
+
+namespace cached {
+
+class item;
+
+// Quiescent state based reclamation for items reachable by lock-free readers.
+//
+// A registered thread is online while it may hold raw item pointers obtained
+// without a bucket lock, and announces a quiescent state when it holds none,
+// which workers do once per event loop iteration. Unlinked items are retired
+// to a per-thread batch tagged with the current epoch and freed once the
+// global epoch has moved two steps past it: by then every online thread has
+// passed a quiescent state since the item was unlinked.
+class epoch_manager {
+    static const unsigned max_threads = 256;
+    static const size_t reclaim_threshold = 256;
+
+    struct retired_ptr {
+        uint64_t epoch;
+        void *ptr;
+        void (*deleter)(void *);
+    };
+
+    struct alignas(64) thread_slot {
+        std::atomic<uint64_t> epoch;
+        std::atomic<bool> used;
+        unsigned nesting;
+
+        std::vector<retired_ptr> retired;
+    };
+
+    std::atomic<uint64_t> global_epoch;
+    thread_slot slots[max_threads];
+
+    epoch_manager();
+
+    thread_slot &local_slot() noexcept;
+
+    bool try_advance() noexcept;
+
+    void reclaim(thread_slot &slot) noexcept;
+
+public:
+    static epoch_manager& get_instance() noexcept {
+        static epoch_manager instance;
+        return instance;
+    }
+
+    epoch_manager(const epoch_manager& e) = delete;
+    epoch_manager & operator=(const epoch_manager& e) = delete;
+
+    void online() noexcept;
+
+    void offline() noexcept;
+
+    void quiescent() noexcept;
+
+    void retire(item *it) noexcept;
+
+    // Retires any other memory reachable by lock-free readers, such as
+    // index arrays replaced on resize.
+    void retire(void *ptr, void (*deleter)(void *)) noexcept;
+};
+
+// Keeps a thread that does not run a worker event loop online for a scope.
+class epoch_guard {
+    epoch_manager &em;
+
+public:
+    epoch_guard() : em(epoch_manager::get_instance()) {
+        this->em.online();
+    }
+
+    epoch_guard(const epoch_guard& g) = delete;
+    epoch_guard & operator=(const epoch_guard& g) = delete;
+
+    ~epoch_guard() {
+        this->em.offline();
+    }
+};
+
+}
+
+#endif //_EPOCH_H
@@ -0,0 +1,307 @@
+#ifndef _EVICTION_H
+#define _EVICTION_H
+
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
+#include <stdint.h>
+
+#include <assoc.h>
+#include <sketch.h>
+#include <stats.h>
+
+namespace cached {
+
+// Intrusive doubly linked list of items through their queue links. Not
+// thread safe, the owning policy serializes access.
+class item_queue {
+    item_ptr head;
+    item_ptr tail;
+    size_t length;
+    size_t bytes;
+
+public:
+    item_queue() : head(nullptr), tail(nullptr), length(0), bytes(0) { }
+
+    void push_head(item_ptr it) noexcept;
+
+    void remove(item_ptr it) noexcept;
+
+    void replace(item_ptr old_it, item_ptr new_it) noexcept;
+
+    inline item_ptr back() const noexcept {
+        return this->tail;
+    }
+
+    inline item_ptr front() const noexcept {
+        return this->head;
+    }
+
+    inline size_t size() const noexcept {
+        return this->length;
+    }
+
+    inline size_t total_size() const noexcept {
+        return this->bytes;
+    }
+};
+
+// Decides which item leaves the cache when it is over its memory limit.
+//
+// hash_table reports every item entering, being read, being replaced and
+// leaving the index. pick_victim() detaches the item it returns from the
+// policy; the caller then unlinks it from the index, and on_remove() must
+// tolerate items that were already detached.
+class eviction_policy {
+public:
+    virtual ~eviction_policy() { }
+
+    virtual void on_insert(item_ptr it) noexcept = 0;
+
+    virtual void on_hit(item_ptr it) noexcept = 0;
+
+    virtual void on_remove(item_ptr it) noexcept = 0;
+
+    virtual void on_replace(item_ptr old_it, item_ptr new_it) noexcept {
+        this->on_remove(old_it);
+        this->on_insert(new_it);
+    }
+
+    // new_it is a copy of old_it moved elsewhere in memory, possibly with its
+    // value compressed, it takes over the old item's place without counting
+    // as an access.
+    virtual void on_relocate(item_ptr old_it, item_ptr new_it) noexcept {
+        this->on_replace(old_it, new_it);
+    }
+
+    virtual item_ptr pick_victim() noexcept = 0;
+
+    // The item pick_victim() would most likely return, left in place.
+    virtual item_ptr peek_victim() noexcept = 0;
+
+    // Bytes held by the items the policy tracks.
+    virtual size_t total_size() const noexcept = 0;
+
+    virtual const char *name() const noexcept = 0;
+
+    virtual void stats(stats_writer &out) const noexcept { }
+
+    static eviction_policy *create(eviction_type type,
+                                   size_t memory_limit,
+                                   bool admission,
+                                   unsigned admission_window);
+
+    static eviction_policy& get_instance() noexcept;
+};
+
+class lru_queue : public eviction_policy {
+    item_queue queue;
+    std::atomic<size_t> item_total_size;
+
+    std::mutex mtx;
+
+public:
+    lru_queue();
+
+    lru_queue(const lru_queue& l) = delete;
+    lru_queue & operator=(const lru_queue& l) = delete;
+
+    void on_insert(item_ptr it) noexcept override;
+
+    void on_hit(item_ptr it) noexcept override;
+
+    void on_remove(item_ptr it) noexcept override;
+
+    void on_replace(item_ptr old_it, item_ptr new_it) noexcept override;
+
+    void on_relocate(item_ptr old_it, item_ptr new_it) noexcept override;
+
+    item_ptr pick_victim() noexcept override;
+
+    item_ptr peek_victim() noexcept override;
+
+    size_t total_size() const noexcept override {
+        return this->item_total_size.load(std::memory_order_relaxed);
+    }
+
+    const char *name() const noexcept override {
+        return "lru";
+    }
+};
+
+// S3-FIFO (Yang et al., SOSP'23): a small probationary FIFO, a main FIFO and
+// a ghost FIFO of recently evicted key hashes. Hits only bump a saturating
+// per-item counter, all queue work happens on insert and eviction.
+class s3fifo_queue : public eviction_policy {
+    static const uint8_t max_freq = 3;
+
+    item_queue small;
+    item_queue main;
+
+    std::deque<uint32_t> ghost;
+    std::unordered_map<uint32_t, uint32_t> ghost_index;
+
+    std::atomic<size_t> item_total_size;
+
+    std::mutex mtx;
+
+    void ghost_insert(uint32_t hv);
+    bool ghost_remove(uint32_t hv);
+
+    item_ptr evict_small() noexcept;
+    item_ptr evict_main() noexcept;
+
+public:
+    s3fifo_queue();
+
+    s3fifo_queue(const s3fifo_queue& l) = delete;
+    s3fifo_queue & operator=(const s3fifo_queue& l) = delete;
+
+    void on_insert(item_ptr it) noexcept override;
+
+    void on_hit(item_ptr it) noexcept override;
+
+    void on_remove(item_ptr it) noexcept override;
+
+    void on_replace(item_ptr old_it, item_ptr new_it) noexcept override;
+
+    item_ptr pick_victim() noexcept override;
+
+    item_ptr peek_victim() noexcept override;
+
+    size_t total_size() const noexcept override {
+        return this->item_total_size.load(std::memory_order_relaxed);
+    }
+
+    const char *name() const noexcept override {
+        return "s3fifo";
+    }
+};
+
+// Greedy-Dual-Size-Frequency: evicts the item with the lowest
+// L + frequency * cost / size, L being the priority of the last victim so
+// that items which stopped being read age out. A hit only bumps the item's
+// counter and marks it, the priority is recomputed when it reaches the top of
+// the heap.
+class gdsf_queue : public eviction_policy {
+    static const uint8_t max_freq = 0x7f;
+    static const uint8_t freq_dirty = 0x80;
+
+    std::vector<item_ptr> heap;
+    double inflation;
+
+    size_t bytes;
+    std::atomic<size_t> item_total_size;
+
+    std::mutex mtx;
+
+    inline double priority_of(item_ptr it) const noexcept {
+        return this->inflation
+               + static_cast<double>(it->freq.load(std::memory_order_relaxed) & max_freq)
+                 * it->cost / it->total_size();
+    }
+
+    inline void heap_set(uint32_t i, item_ptr it) noexcept {
+        this->heap[i] = it;
+        it->heap_index = i;
+    }
+
+    void sift_up(uint32_t i) noexcept;
+    void sift_down(uint32_t i) noexcept;
+
+    void heap_push(item_ptr it) noexcept;
+    void heap_remove(item_ptr it) noexcept;
+
+public:
+    gdsf_queue();
+
+    gdsf_queue(const gdsf_queue& l) = delete;
+    gdsf_queue & operator=(const gdsf_queue& l) = delete;
+
+    void on_insert(item_ptr it) noexcept override;
+
+    void on_hit(item_ptr it) noexcept override;
+
+    void on_remove(item_ptr it) noexcept override;
+
+    void on_replace(item_ptr old_it, item_ptr new_it) noexcept override;
+
+    void on_relocate(item_ptr old_it, item_ptr new_it) noexcept override;
+
+    item_ptr pick_victim() noexcept override;
+
+    item_ptr peek_victim() noexcept override;
+
+    size_t total_size() const noexcept override {
+        return this->item_total_size.load(std::memory_order_relaxed);
+    }
+
+    const char *name() const noexcept override {
+        return "gdsf";
+    }
+
+    void stats(stats_writer &out) const noexcept override;
+};
+
+// W-TinyLFU admission (Einziger et al.) in front of another policy. New items
+// enter a small FIFO window; an item pushed out of the window only displaces
+// the victim of the main policy if the frequency sketch has seen its key more
+// often, otherwise it is evicted itself. With an empty window every new item
+// is judged as soon as the cache is full.
+class tinylfu_admission : public eviction_policy {
+    eviction_policy *main_policy;
+    count_min_sketch sketch;
+
+    item_queue window;
+    size_t window_limit;
+    size_t memory_limit;
+
+    std::atomic<size_t> window_size;
+    std::atomic<uint64_t> rejections;
+
+    std::mutex mtx;
+
+    void window_remove(item_ptr it) noexcept;
+
+public:
+    tinylfu_admission(eviction_policy *main_policy,
+                      size_t memory_limit,
+                      unsigned window_percent);
+
+    tinylfu_admission(const tinylfu_admission& l) = delete;
+    tinylfu_admission & operator=(const tinylfu_admission& l) = delete;
+
+    ~tinylfu_admission();
+
+    void on_insert(item_ptr it) noexcept override;
+
+    void on_hit(item_ptr it) noexcept override;
+
+    void on_remove(item_ptr it) noexcept override;
+
+    void on_replace(item_ptr old_it, item_ptr new_it) noexcept override;
+
+    void on_relocate(item_ptr old_it, item_ptr new_it) noexcept override;
+
+    item_ptr pick_victim() noexcept override;
+
+    item_ptr peek_victim() noexcept override;
+
+    size_t total_size() const noexcept override {
+        return this->window_size.load(std::memory_order_relaxed)
+               + this->main_policy->total_size();
+    }
+
+    const char *name() const noexcept override {
+        return this->main_policy->name();
+    }
+
+    void stats(stats_writer &out) const noexcept override;
+};
+
+}
+
+#endif //_EVICTION_H
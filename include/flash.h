@@ -0,0 +1,224 @@
+#ifndef _FLASH_H
+#define _FLASH_H
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include <stdint.h>
+#include <time.h>
+
+#include <stats.h>
+
+namespace cached {
+
+class item;
+class hash_table;
+
+// A value read back from the flash tier for a connection. complete is
+// called from an I/O thread once value holds it, or ok tells it is gone.
+struct flash_read {
+    uint32_t page;
+    uint32_t offset;
+    uint32_t hv;
+    size_t size;
+
+    std::vector<char> value;
+    bool ok;
+
+    void *owner;
+    void (*complete)(flash_read *r);
+};
+
+// Second tier for cold values on a local file or block device, in the
+// style of memcached's extstore. Instead of dropping an eviction victim,
+// hash_table::evict() copies its value into a write buffer and swaps the
+// item for a header that keeps the key, the metadata and where the value
+// went, charged only for itself. Headers age out of the eviction policy
+// like any item, and dropping one frees its value on flash. One reaching
+// the tail is given another round while headers take less than half the
+// memory, or there would be about as many on flash as there are values
+// in memory.
+//
+// The device is split into pages filled one at a time, in write buffers a
+// writer thread appends with one pwrite each, so the device only sees large
+// sequential writes and evicting never waits for it. A value is served from
+// its buffer until that is written out. Reads go to a pool of I/O threads
+// and complete on the worker's event loop, which meanwhile serves other
+// connections.
+//
+// Like the log segments, a page's live byte count drops as the headers
+// pointing into it are destroyed, and the page is free again at zero. When
+// free pages run low a compactor rewrites the live values of the page with
+// the lowest live fraction and moves their headers, or, when every page is
+// mostly live, drops the oldest page and its items. Evictions that find no
+// free page or a full writer queue drop their victim as without the tier.
+class flash_store {
+public:
+    static const uint32_t no_page = UINT32_MAX;
+
+private:
+    enum : uint8_t {
+        PAGE_FREE = 0,
+        PAGE_OPEN,
+        PAGE_SEALED,
+        PAGE_COMPACTED
+    };
+
+    struct record_header {
+        uint32_t size;
+        uint32_t hv;
+        uint64_t value_size;
+    };
+
+    struct page_info {
+        size_t used;
+        std::atomic<size_t> live;
+        time_t sealed_at;
+        uint8_t state;
+
+        // Pending write buffers and reads in flight, the page is not
+        // reused before they are done.
+        uint32_t pins;
+    };
+
+    struct write_buffer {
+        uint32_t page;
+        size_t offset;
+        std::vector<char> data;
+    };
+
+    int fd;
+    size_t page_size;
+    uint32_t npages;
+    page_info *pages;
+
+    std::mutex mtx;
+    std::vector<uint32_t> free_list;
+
+    // The page being filled, where its next write buffer starts, and the
+    // buffer being filled.
+    uint32_t head;
+    size_t head_offset;
+    write_buffer *current;
+    std::deque<write_buffer *> pending;
+    std::condition_variable writer_cv;
+
+    std::condition_variable compactor_cv;
+    bool compactor_wakeup;
+
+    std::mutex read_mtx;
+    std::deque<flash_read *> reads;
+    std::condition_variable read_cv;
+
+    std::thread writer;
+    std::thread compactor;
+    std::vector<std::thread> io_threads;
+
+    std::atomic<size_t> header_bytes;
+
+    std::atomic<uint64_t> nstored;
+    std::atomic<uint64_t> nstored_bytes;
+    std::atomic<uint64_t> nrejected;
+    std::atomic<uint64_t> nwrites;
+    std::atomic<uint64_t> nwrite_errors;
+    std::atomic<uint64_t> nreads;
+    std::atomic<uint64_t> nread_bytes;
+    std::atomic<uint64_t> nread_errors;
+    std::atomic<uint64_t> nbuffer_hits;
+    std::atomic<uint64_t> ncompacted;
+    std::atomic<uint64_t> nrelocated;
+    std::atomic<uint64_t> ndropped;
+
+    flash_store();
+
+    // Room for a record of a value of size bytes in the current write
+    // buffer, with mtx held. Fails when no page is free or the writer is
+    // behind.
+    char *reserve(size_t size, uint32_t hv, uint32_t &page, uint32_t &offset) noexcept;
+
+    // Queues the current write buffer for the writer, with mtx held.
+    void seal_buffer() noexcept;
+
+    // Frees the page if nothing refers to it any more, with mtx held.
+    void maybe_free(uint32_t page) noexcept;
+
+    void unpin(uint32_t page) noexcept;
+
+    // Copies the value of the record at page and offset into out if it is
+    // still in a write buffer, with mtx held.
+    bool read_buffered(uint32_t page, uint32_t offset, uint32_t hv, size_t size,
+                       std::vector<char> &out) noexcept;
+
+    bool read_device(uint32_t page, uint32_t offset, uint32_t hv, size_t size,
+                     std::vector<char> &out) noexcept;
+
+    uint32_t pick_page(bool &drop) noexcept;
+
+    void compact_page(hash_table &table, uint32_t page, bool drop) noexcept;
+
+    void run_writer() noexcept;
+
+    void run_reader() noexcept;
+
+    void run_compactor(hash_table &table) noexcept;
+
+public:
+    static flash_store& get_instance() noexcept {
+        static flash_store instance;
+        return instance;
+    }
+
+    flash_store(const flash_store& f) = delete;
+    flash_store & operator=(const flash_store& f) = delete;
+
+    // Bytes a value of size bytes takes on flash.
+    static inline size_t record_size(size_t size) noexcept {
+        return (sizeof(record_header) + size + 7) & ~size_t(7);
+    }
+
+    // Whether an eviction victim is worth moving to flash.
+    bool eligible(const item *it) const noexcept;
+
+    // Writes out the value of it, an item about to be evicted, and returns
+    // a header to take its place, null if the value was not taken.
+    item *store(const item *it) noexcept;
+
+    // Accounts one more header for the value at page, for a copy of one.
+    void retain(uint32_t page, size_t size) noexcept;
+
+    // Called with the value size once a header is destroyed.
+    void release(uint32_t page, size_t size) noexcept;
+
+    // Memory taken by the headers, counted as they are created and
+    // destroyed.
+    inline void add_header(size_t size) noexcept {
+        this->header_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    inline void remove_header(size_t size) noexcept {
+        this->header_bytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    inline size_t headers_size() const noexcept {
+        return this->header_bytes.load(std::memory_order_relaxed);
+    }
+
+    // Starts reading r, true if it completed at once, from a write buffer,
+    // and r->complete will not be called.
+    bool read(flash_read *r) noexcept;
+
+    // Reads the value of a header into out, blocking.
+    bool read_value(const item *it, std::vector<char> &out) noexcept;
+
+    void start(hash_table &table);
+
+    void stats(stats_writer &out) noexcept;
+};
+
+}
+
+#endif //_FLASH_H
@@ -0,0 +1,71 @@
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#include <mutex>
+#include <vector>
+
+namespace cached {
+
+// Zero downtime upgrades. A server started with handoff_path connects to
+// the one running there and receives its listening sockets, as SCM_RIGHTS
+// messages over a Unix socket, so pending connections are accepted by the
+// new process instead of being refused. The old one then stops accepting,
+// lets its connections finish their requests and exits; with
+// handoff_clients it passes each idle connection on instead of closing it.
+// A new process that first loads the state left behind accepts meanwhile
+// and serves those connections once it is loaded.
+//
+// Every message is a kind byte with its descriptors: 'L' with the listening
+// sockets, then 'C' with one client connection each. The end of the stream
+// tells the old process is gone.
+class handoff {
+    int listen_fd;
+    int predecessor_fd;
+    int successor_fd;
+    bool successor_wants_clients;
+
+    std::mutex mtx;
+
+    handoff();
+
+    static bool send_fds(int sock, char kind, const int *fds, size_t n) noexcept;
+
+    // One message, false at the end of the stream.
+    static bool recv_fds(int sock, char &kind, std::vector<int> &fds) noexcept;
+
+public:
+    static handoff& get_instance() noexcept {
+        static handoff instance;
+        return instance;
+    }
+
+    handoff(const handoff& h) = delete;
+    handoff & operator=(const handoff& h) = delete;
+
+    // Receives the listening sockets of the server running at handoff_path,
+    // false when there is none.
+    bool connect_predecessor(std::vector<int> &listeners) noexcept;
+
+    // The next client connection the predecessor passes on, -1 once it has
+    // exited.
+    int receive_client() noexcept;
+
+    inline int predecessor() const noexcept {
+        return this->predecessor_fd;
+    }
+
+    // Binds handoff_path for the next upgrade, the descriptor to watch for
+    // it or -1.
+    int listen() noexcept;
+
+    // Accepts the successor and passes it the listening sockets.
+    bool accept_successor(const std::vector<int> &listeners) noexcept;
+
+    // Passes an idle client connection to the successor if it asked for
+    // them, and closes it here.
+    void release_client(int fd) noexcept;
+};
+
+}
+
+#endif //_HANDOFF_H
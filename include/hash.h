@@ -0,0 +1,35 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <cstdlib>
+#include <string>
+
+#include <stdint.h>
+
+#include <setting.h>
+
+namespace cached {
+
+typedef uint32_t (*hash_func)(const char *key, size_t len, uint32_t seed);
+
+// Returns the implementation of fn, falling back to murmur3 when the CPU
+// lacks the instructions it needs.
+hash_func get_hash_func(hash_function fn) noexcept;
+
+const char *hash_function_name(hash_function fn) noexcept;
+
+// 128 bit digest identifying a key in digest keyed storage.
+void key_digest(const std::string &key, uint32_t seed, uint64_t *out) noexcept;
+
+// Hashes n keys at once. murmur3 runs eight keys per AVX2 lane group when
+// available and every function produces the same values as hashing each key
+// on its own.
+void hash_batch(hash_function fn,
+                const std::string *keys,
+                size_t n,
+                uint32_t seed,
+                uint32_t *out) noexcept;
+
+}
+
+#endif //_HASH_H
@@ -0,0 +1,141 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include <stats.h>
+
+namespace cached {
+
+class item;
+class hash_table;
+
+// Durability of what clients store, for keys expensive to regenerate.
+//
+// Every set, add, replace, cas, append, prepend and delete appends a record
+// to a buffer of the worker thread serving it: the whole new state of the
+// item, or its deletion, so replaying a record twice does no harm. Records
+// are numbered and appended while the bucket is locked, which orders the
+// mutations of a key across workers and keeps them in that order across
+// files. A flusher thread takes the buffers every couple of
+// milliseconds and group commits them with one pwritev, calling fdatasync
+// at most every journal_sync milliseconds. Workers never wait for the disk,
+// a crash loses what was not synced yet.
+//
+// Each snapshot starts a new journal file, <journal_path>.<generation>, and
+// the older ones are deleted once it is saved, the snapshot holds what they
+// did. At startup the files left are replayed in order on top of the
+// snapshot, up to the first torn record.
+class journal {
+public:
+    enum : uint32_t {
+        RECORD_PUT = 1,
+        RECORD_REMOVE
+    };
+
+private:
+    struct buffer {
+        std::mutex mtx;
+        std::vector<char> data;
+    };
+
+    bool enabled;
+    std::atomic<uint64_t> seq;
+
+    std::mutex buffers_mtx;
+    std::vector<buffer *> buffers;
+
+    // Held while a batch is written, so rotate() does not switch files
+    // under the flusher.
+    std::mutex flush_mtx;
+    std::vector<std::vector<char>> batch;
+    int fd;
+    uint64_t generation;
+    uint64_t offset;
+    bool dirty;
+    std::chrono::steady_clock::time_point last_sync;
+
+    std::thread flusher;
+
+    std::atomic<uint64_t> nrecords;
+    std::atomic<uint64_t> nbytes;
+    std::atomic<uint64_t> nflushes;
+    std::atomic<uint64_t> nsyncs;
+    std::atomic<uint64_t> nerrors;
+    std::atomic<uint64_t> nreplayed;
+    std::atomic<uint64_t> ntorn;
+
+    journal();
+
+    buffer *local_buffer() noexcept;
+
+    void append(uint64_t seq, uint32_t op, const std::string &key, const item *it) noexcept;
+
+    // Writes out the buffered records, with flush_mtx held.
+    void flush(bool sync) noexcept;
+
+    bool open_generation(uint64_t gen) noexcept;
+
+    std::string file_name(uint64_t gen) const;
+
+    // The generations of the journal files present, in order.
+    std::vector<uint64_t> generations() const;
+
+    void replay_file(hash_table &table, const std::string &name) noexcept;
+
+    void run() noexcept;
+
+public:
+    static journal& get_instance() noexcept {
+        static journal instance;
+        return instance;
+    }
+
+    journal(const journal& j) = delete;
+    journal & operator=(const journal& j) = delete;
+
+    // Numbers the record of a mutation, taken under its bucket lock. 0 when
+    // there is no journal.
+    inline uint64_t next_seq() noexcept {
+        return this->enabled ? this->seq.fetch_add(1, std::memory_order_relaxed) + 1 : 0;
+    }
+
+    inline void put(uint64_t seq, const std::string &key, const item *it) noexcept {
+        if (seq) {
+            this->append(seq, RECORD_PUT, key, it);
+        }
+    }
+
+    inline void remove(uint64_t seq, const std::string &key) noexcept {
+        if (seq) {
+            this->append(seq, RECORD_REMOVE, key, nullptr);
+        }
+    }
+
+    // Replays the files of earlier runs into table unless told otherwise,
+    // then opens a new file and starts the flusher.
+    void start(hash_table &table, bool replay);
+
+    // Writes out and syncs everything logged so far.
+    void sync() noexcept;
+
+    // Continues in a new file. The files before the generation returned are
+    // covered by any snapshot started afterwards.
+    uint64_t rotate() noexcept;
+
+    // Deletes the files before generation gen.
+    void compact(uint64_t gen) noexcept;
+
+    void stats(stats_writer &out) noexcept;
+};
+
+}
+
+#endif //_JOURNAL_H
@@ -0,0 +1,34 @@
+//-----------------------------------------------------------------------------
+// A compact implementation of the LZ4 block format, as specified in
+// lz4_Block_format.md of https://github.com/lz4/lz4. Blocks are readable by
+// LZ4_decompress_safe() and the other way around.
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+
+// Largest block size that compressing size bytes can produce.
+size_t lz4_compress_bound(size_t size);
+
+// Compresses size bytes of src into dst, returns the block size, or 0 if it
+// does not fit in capacity bytes.
+size_t lz4_compress(const char *src, size_t size, char *dst, size_t capacity);
+
+// Decodes the block of size bytes at src into dst, returns the decoded size,
+// or -1 if the block is malformed or does not fit in capacity bytes.
+long lz4_decompress(const char *src, size_t size, char *dst, size_t capacity);
+
+//-----------------------------------------------------------------------------
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LZ4_H_
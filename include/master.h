@@ -1,6 +1,7 @@
 #ifndef _MASTER_H
 #define _MASTER_H
 
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <vector>
@@ -33,6 +34,13 @@ class master {
         listener(int fd, struct sockaddr *address, socklen_t addr_len);
 
         void bind_ev_loop(struct ev_loop *loop);
+
+        // Stops accepting and closes the socket, once it is handed off.
+        void stop(struct ev_loop *loop);
+
+        inline int fd() const noexcept {
+            return this->sfd;
+        }
     };
 
     std::vector<listener> listeners;
@@ -43,9 +51,35 @@ class master {
 
     struct ev_loop *evloop;
 
+    // Client connections passed on by the predecessor or accepted early,
+    // before the workers run.
+    std::vector<int> inherited_conns;
+    std::mutex inherited_mtx;
+
+    // Accepts while the predecessor exits and the state it left behind is
+    // loaded, so that the listen backlog does not overflow meanwhile.
+    std::thread parker;
+    std::atomic<bool> parking;
+
+    void park_new_conns() noexcept;
+
+    ev_io handoff_evio;
+    ev_io predecessor_evio;
+    ev_timer drain_evt;
+    ev_tstamp drain_deadline;
+
+    // Stops accepting and exits once the workers have no connection left.
+    void drain() noexcept;
+
 public:
     master();
 
+    // Takes over the listening sockets of the server running at
+    // handoff_path. With wait_exit its client connections are collected
+    // until it exits, so that the state it leaves behind is final, and new
+    // ones are accepted and held until start_listen().
+    bool take_over(bool wait_exit) noexcept;
+
     int init_listener() noexcept;
 
     void start_listen() noexcept;
@@ -0,0 +1,95 @@
+#ifndef _MRC_H
+#define _MRC_H
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <unordered_map>
+
+#include <stdint.h>
+
+#include <stats.h>
+
+namespace cached {
+
+// Online miss ratio curve estimation with fixed size SHARDS (Waldspurger et
+// al., FAST'15). Keys whose hash maps below a threshold are tracked in a
+// ghost LRU stack, and the byte reuse distance of each sampled access, scaled
+// up by the sampling rate, tells which cache sizes it would have hit in. When
+// more than max_keys keys are tracked the threshold is lowered and the keys
+// above it dropped, so the ghost stack stays bounded.
+class mrc_estimator {
+public:
+    // Cache sizes reported, in multiples of the memory limit.
+    static const unsigned ncurve = 4;
+
+private:
+    static const uint32_t sample_modulus = 1 << 24;
+
+    struct ghost_entry {
+        uint64_t time;
+        uint32_t size;
+        uint32_t sample;
+    };
+
+    std::atomic<uint32_t> threshold;
+
+    size_t memory_limit;
+    size_t max_keys;
+
+    std::mutex mtx;
+
+    std::unordered_map<uint32_t, ghost_entry> ghost;
+    std::set<std::pair<uint32_t, uint32_t>> by_sample;
+
+    // Fenwick tree of tracked bytes by logical access time, a key's bytes
+    // sit at its last access.
+    std::vector<int64_t> tree;
+    uint64_t clock;
+
+    uint64_t refs;
+    uint64_t hits[ncurve];
+
+    void tree_add(uint64_t time, int64_t bytes) noexcept;
+    int64_t tree_sum(uint64_t time) const noexcept;
+
+    void renumber() noexcept;
+
+    void shrink() noexcept;
+
+    // Moves the key to the top of the stack at size bytes, 0 keeping the
+    // size it was last seen at, and counts a reference when asked to.
+    void touch(uint32_t hv, size_t size, bool reference) noexcept;
+
+    static inline uint32_t sample_of(uint32_t hv) noexcept {
+        return (hv * 0x9e3779b1u) >> 8;
+    }
+
+public:
+    mrc_estimator(size_t memory_limit, size_t max_keys, double sample_rate = 0.01);
+
+    mrc_estimator(const mrc_estimator &m) = delete;
+    mrc_estimator & operator=(const mrc_estimator &m) = delete;
+
+    // The only cost paid by accesses to keys left out of the sample.
+    inline bool sampled(uint32_t hv) const noexcept {
+        return sample_of(hv) < this->threshold.load(std::memory_order_relaxed);
+    }
+
+    // A get that found the key, size bytes large.
+    void access(uint32_t hv, size_t size) noexcept;
+
+    // A get that missed. Larger caches would still hold the key if it was
+    // stored since it last entered the stack.
+    void miss(uint32_t hv) noexcept;
+
+    // The key stored at size bytes, not a reference by itself.
+    void update(uint32_t hv, size_t size) noexcept;
+
+    void stats(stats_writer &out) noexcept;
+};
+
+}
+
+#endif //_MRC_H
@@ -0,0 +1,186 @@
+#ifndef _SEGMENT_H
+#define _SEGMENT_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include <stdint.h>
+#include <time.h>
+
+#include <stats.h>
+
+namespace cached {
+
+class hash_table;
+
+// Log-structured item memory in the style of RAMCloud. Items, header and
+// value together, are appended to the head of a fixed set of equally sized
+// segments carved out of one arena, so memory use is bounded by the arena
+// and allocations never fragment.
+//
+// A segment's live byte count drops as its items are destroyed, which only
+// happens once no reader can still see them, and the segment returns to the
+// free list when it reaches zero. A background cleaner relocates the live
+// items of the sealed segments with the lowest live fraction through
+// hash_table::relocate_item(), so the remaining dead space can be reclaimed.
+//
+// When every sealed segment is mostly live the cleaner has nothing to gain
+// and writers start to fall back to the heap. Automove then takes the
+// segment sealed longest ago, the tail of the log, and evicts its items a
+// batch at a time, keeping only those read since it was sealed, so that
+// whole segments go back to the writers under pressure.
+//
+// With log_arena_path the arena is a shared mapping of that file, best kept
+// on /dev/shm, holding each entry's key behind its value and how much of
+// each segment is used. A server restarted in the same boot after a clean
+// detach() then reattaches to it: the items that were indexed are rebuilt
+// where they lie and indexed again, without copying any value. Items on the
+// heap, chained or deduplicated ones are lost, and a file written with
+// another geometry, item layout or hash, or not detached cleanly, is
+// discarded.
+class segment_store {
+public:
+    static const uint32_t no_segment = UINT32_MAX;
+
+private:
+    enum : uint8_t {
+        SEGMENT_FREE = 0,
+        SEGMENT_HEAD,
+        SEGMENT_SEALED,
+        SEGMENT_CLEANED,
+        // Left by the previous process, until reattach() walks it.
+        SEGMENT_PENDING
+    };
+
+    struct entry_header {
+        uint32_t size;
+        uint32_t hv;
+        uint64_t key_size;
+    };
+
+    struct arena_header;
+
+    struct segment {
+        size_t used;
+        std::atomic<size_t> live;
+        time_t sealed_at;
+        uint8_t state;
+    };
+
+    size_t segment_size;
+    uint32_t nsegments;
+
+    char *arena;
+    segment *segments;
+
+    // In a file backed arena, the mapping of the whole file and the used
+    // bytes of each segment kept in it.
+    int arena_fd;
+    char *map_base;
+    size_t map_size;
+    uint64_t *used_table;
+    bool attachable;
+
+    std::atomic<uint64_t> nreattached;
+    uint64_t reattach_usec;
+
+    std::mutex mtx;
+    std::vector<uint32_t> free_list;
+    std::atomic<uint32_t> nfree;
+    uint32_t head;
+
+    std::thread cleaner;
+    std::condition_variable cleaner_cv;
+    bool cleaner_wakeup;
+    // Held by the cleaner while it works on a segment.
+    std::mutex clean_mtx;
+
+    std::atomic<uint64_t> ncleaned;
+    std::atomic<uint64_t> nrelocated;
+    std::atomic<uint64_t> nfallbacks;
+
+    bool automove;
+    std::atomic<uint64_t> nmoves;
+    std::atomic<uint64_t> nmoved_bytes;
+    std::atomic<uint64_t> nrescued;
+
+    segment_store();
+
+    inline char *segment_base(uint32_t seg) const noexcept {
+        return this->arena + seg * this->segment_size;
+    }
+
+    void map_arena(const char *path) noexcept;
+
+    // Empties the arena file and writes a header for this process.
+    void reset_arena() noexcept;
+
+    void reattach_segment(hash_table &table, uint32_t seg) noexcept;
+
+    void free_segment(uint32_t seg) noexcept;
+
+    void drop_live(uint32_t seg, size_t bytes) noexcept;
+
+    uint32_t pick_segment() noexcept;
+
+    uint32_t pick_oldest() noexcept;
+
+    void clean_segment(hash_table &table, uint32_t seg) noexcept;
+
+    void move_segment(hash_table &table, uint32_t seg) noexcept;
+
+    void run_cleaner(hash_table &table) noexcept;
+
+public:
+    static segment_store& get_instance() noexcept {
+        static segment_store instance;
+        return instance;
+    }
+
+    segment_store(const segment_store& s) = delete;
+    segment_store & operator=(const segment_store& s) = delete;
+
+    // Room for an entry of size bytes written for key hash hv, ending with
+    // key_size bytes of key in a file backed arena. Fails when the entry
+    // cannot fit in a segment or no segment is free.
+    void *allocate(size_t size, uint32_t hv, uint32_t &seg, size_t key_size = 0) noexcept;
+
+    // Called with the entry size once the item allocated there is destroyed.
+    void release(uint32_t seg, size_t size) noexcept;
+
+    // Bytes accounted to an entry holding size bytes.
+    static inline size_t entry_size(size_t size) noexcept {
+        return (sizeof(entry_header) + size + 7) & ~size_t(7);
+    }
+
+    // True while no segment is left for the head to move to, eviction then
+    // has to make room instead of the cleaner.
+    inline bool starved() const noexcept {
+        return this->nfree.load(std::memory_order_relaxed) == 0;
+    }
+
+    inline bool file_backed() const noexcept {
+        return this->used_table != nullptr;
+    }
+
+    // Indexes the items a previous process left in the arena file, with
+    // nthreads threads. False, and the file is started afresh, when there is
+    // nothing to reattach to.
+    bool reattach(hash_table &table, unsigned nthreads) noexcept;
+
+    // Marks the arena file clean for the next process of this boot to
+    // reattach to. Nothing may allocate or clean afterwards, the process is
+    // about to exit.
+    void detach() noexcept;
+
+    void start_cleaner(hash_table &table);
+
+    void stats(stats_writer &out) noexcept;
+};
+
+}
+
+#endif //_SEGMENT_H
@@ -1,10 +1,34 @@
 #ifndef _SETTING_H
 #define _SETTING_H
 
+#include <stdint.h>
 #include <sys/socket.h>
 
 namespace cached {
 
+enum class index_engine {
+    CHAINED,
+    SWISS
+};
+
+enum class hash_function {
+    MURMUR3_32,
+    MURMUR3_X64_128,
+    CRC32C,
+    WYHASH
+};
+
+enum class eviction_type {
+    LRU,
+    S3FIFO,
+    GDSF
+};
+
+enum class storage_engine {
+    HEAP,
+    LOG
+};
+
 class setting {
 public:
     int backlog = 1024;
@@ -13,11 +37,87 @@ public:
     int socket_type = SOCK_STREAM;
 
     unsigned int max_exptime = 60 * 60 * 24 * 30;
+    unsigned int lru_update_interval = 60;
 
     size_t max_key_len = 250;
     size_t max_item_size = 1024 * 1024;
+
+    // Appended values and values larger than value_chunk_size are chained,
+    // and rewritten into chunks of this size once they have
+    // value_chain_slack chunks more than that needs.
+    size_t value_chunk_size = 1024 * 1024;
+    unsigned int value_chain_slack = 16;
     size_t max_lru_queue_size = 64 * 1024 * 1024;
 
+    index_engine hash_engine = index_engine::CHAINED;
+    hash_function hash_fn = hash_function::MURMUR3_32;
+    eviction_type eviction = eviction_type::LRU;
+
+    // W-TinyLFU admission filter, window in percent of max_lru_queue_size.
+    bool admission = false;
+    unsigned int admission_window = 1;
+
+    // Ghost keys tracked for miss ratio curve estimation, 0 disables it.
+    size_t mrc_keys = 8192;
+
+    // Item memory, and the segment size of the log structured engine. Its
+    // segments are kept in log_arena_path when set, for warm restarts.
+    storage_engine storage = storage_engine::HEAP;
+    size_t log_segment_size = 2 * 1024 * 1024;
+    bool log_automove = true;
+    const char *log_arena_path = nullptr;
+
+    // Active defragmentation of heap items, started once resident memory is
+    // defrag_threshold percent above the allocated bytes, using at most
+    // defrag_cpu percent of a core.
+    bool defrag = false;
+    unsigned int defrag_threshold = 10;
+    unsigned int defrag_cpu = 25;
+
+    // LZ4 compression of values of at least compress_min_size bytes when
+    // they are stored, and of those not read for compress_cold_age seconds,
+    // 0 disables either. Clients setting compress_flag in an item's flags get
+    // its value as stored, the flag then tells whether it is compressed.
+    size_t compress_min_size = 0;
+    unsigned int compress_cold_age = 0;
+    uint32_t compress_flag = 0;
+
+    // Values of at least dedup_min_size bytes are stored once for all the
+    // items holding them, 0 disables it. They are then never compressed.
+    size_t dedup_min_size = 0;
+
+    // Items keep a 128 bit digest of their key instead of the key, telling
+    // different keys with the same digest apart only with key_verify, which
+    // keeps the key as well.
+    bool key_digest = false;
+    bool key_verify = false;
+
+    // Cache contents are saved to snapshot_path every snapshot_interval
+    // seconds, and loaded from it, or from log_arena_path, at startup by
+    // snapshot_load_threads threads, 0 for one per core.
+    const char *snapshot_path = nullptr;
+    unsigned int snapshot_interval = 3600;
+    unsigned int snapshot_load_threads = 0;
+
+    // Mutations are logged to files named after journal_path and replayed
+    // at startup, synced at least every journal_sync milliseconds, 0 for
+    // every write.
+    const char *journal_path = nullptr;
+    unsigned int journal_sync = 1000;
+
+    // Values of at least flash_min_size bytes evicted from memory go to
+    // flash_path, a file of flash_size bytes or a block device, and only
+    // their keys and metadata stay in memory.
+    const char *flash_path = nullptr;
+    size_t flash_size = 1024 * 1024 * 1024;
+    size_t flash_min_size = 256;
+
+    // Unix socket a new server takes over the listening sockets of the
+    // running one from, and its idle client connections with
+    // handoff_clients.
+    const char *handoff_path = nullptr;
+    bool handoff_clients = false;
+
     size_t conn_read_buffer_size = 2048;
     size_t conn_write_buffer_size = 2048;
 
@@ -0,0 +1,66 @@
+#ifndef _SKETCH_H
+#define _SKETCH_H
+
+#include <atomic>
+#include <cstdlib>
+
+#include <stdint.h>
+
+namespace cached {
+
+// Count-Min sketch of 4-bit counters estimating how often a key hash was
+// seen. Each 64-bit word holds one group of four counters per row, so an
+// update touches four words. Once sample_size increments have been made all
+// counters are halved, letting old popularity fade.
+//
+// Updates are relaxed CAS loops: concurrent increments may be lost, which
+// only makes the estimate a little more approximate.
+class count_min_sketch {
+    static const unsigned depth = 4;
+
+    std::atomic<uint64_t> *table;
+    size_t table_mask;
+    size_t sample_size;
+
+    std::atomic<size_t> additions;
+
+    static inline uint64_t rehash(uint32_t hv) noexcept {
+        uint64_t h = hv * 0x9e3779b97f4a7c15ull;
+        return h ^ (h >> 29);
+    }
+
+    inline size_t index_of(uint64_t h, unsigned row) const noexcept {
+        return static_cast<size_t>((h >> 32) + row * ((h & 0xffffffff) | 1))
+               & this->table_mask;
+    }
+
+    // Nibble of the row's counter inside its word.
+    static inline unsigned offset_of(uint32_t hv, unsigned row) noexcept {
+        return (row * 4 + ((hv >> (row * 8)) & 3)) * 4;
+    }
+
+    bool increment_at(size_t index, unsigned offset) noexcept;
+
+    void reset() noexcept;
+
+public:
+    // Sized for about the given number of distinct items.
+    explicit count_min_sketch(size_t capacity);
+
+    count_min_sketch(const count_min_sketch &s) = delete;
+    count_min_sketch & operator=(const count_min_sketch &s) = delete;
+
+    ~count_min_sketch();
+
+    void increment(uint32_t hv) noexcept;
+
+    unsigned estimate(uint32_t hv) const noexcept;
+
+    inline size_t memory_size() const noexcept {
+        return (this->table_mask + 1) * sizeof(uint64_t);
+    }
+};
+
+}
+
+#endif //_SKETCH_H
@@ -0,0 +1,87 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include <stats.h>
+
+namespace cached {
+
+class item;
+class hash_table;
+
+// Snapshots of the cache contents in snapshot_path.
+//
+// A background thread rewrites the file every snapshot_interval seconds,
+// walking the hash table a bucket at a time so no lock is held for longer
+// than one bucket read; each item is saved as it was when its bucket was
+// visited. The new file is synced and renamed over the old one, so a crash
+// mid-save leaves the previous snapshot in place.
+//
+// The file is a header followed by self-contained blocks of records. At
+// startup load() maps it, and several threads each take whole blocks and
+// insert their items. Items that expired by then are skipped, on save and on
+// load.
+class snapshot_manager {
+    std::thread worker;
+
+    // One save at a time, the periodic one or the last before a handoff.
+    std::mutex save_mtx;
+
+    std::atomic<uint64_t> nsaves;
+    std::atomic<uint64_t> nfailed;
+    std::atomic<uint64_t> last_items;
+    std::atomic<uint64_t> last_bytes;
+    std::atomic<uint64_t> last_time;
+    std::atomic<uint64_t> last_usec;
+
+    std::atomic<uint64_t> nloaded;
+    std::atomic<uint64_t> nexpired;
+    std::atomic<uint64_t> nskipped;
+    std::atomic<uint64_t> load_usec;
+
+    snapshot_manager();
+
+    void load_block(hash_table &table, const char *p, uint32_t nrecords,
+                    bool same_hash) noexcept;
+
+    void run(hash_table &table) noexcept;
+
+public:
+    static snapshot_manager& get_instance() noexcept {
+        static snapshot_manager instance;
+        return instance;
+    }
+
+    snapshot_manager(const snapshot_manager& s) = delete;
+    snapshot_manager & operator=(const snapshot_manager& s) = delete;
+
+    bool save(hash_table &table) noexcept;
+
+    // An item for a value saved as it was stored, chained or shared like a
+    // value just read from a client would be.
+    static item *build_item(std::string &key,
+                            uint32_t flags,
+                            unsigned int exptime,
+                            const char *value,
+                            size_t value_size,
+                            size_t raw_size) noexcept;
+
+    // Fills table from the snapshot, if there is one.
+    bool load(hash_table &table, unsigned nthreads) noexcept;
+
+    // Starts saving every snapshot_interval seconds.
+    void start(hash_table &table);
+
+    void stats(stats_writer &out) noexcept;
+};
+
+}
+
+#endif //_SNAPSHOT_H
@@ -0,0 +1,47 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <string>
+#include <cstdio>
+
+#include <stdint.h>
+
+namespace cached {
+
+// Collects "STAT <name> <value>" lines for the stats command.
+class stats_writer {
+    std::string buf;
+
+    void append(const char *name, const char *value) {
+        this->buf.append("STAT ");
+        this->buf.append(name);
+        this->buf.append(" ");
+        this->buf.append(value);
+        this->buf.append("\r\n");
+    }
+
+public:
+    inline void add(const char *name, const char *value) {
+        this->append(name, value);
+    }
+
+    inline void add(const char *name, uint64_t value) {
+        char num[24];
+        std::snprintf(num, sizeof(num), "%llu", static_cast<unsigned long long>(value));
+        this->append(name, num);
+    }
+
+    inline void add(const char *name, double value) {
+        char num[32];
+        std::snprintf(num, sizeof(num), "%.4f", value);
+        this->append(name, num);
+    }
+
+    inline const std::string &str() const noexcept {
+        return this->buf;
+    }
+};
+
+}
+
+#endif //_STATS_H
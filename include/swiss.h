@@ -0,0 +1,115 @@
+#ifndef _SWISS_H
+#define _SWISS_H
+
+#include <atomic>
+#include <string>
+#include <cstdlib>
+
+#include <stdint.h>
+
+namespace cached {
+
+class item;
+
+// Open addressing index in the style of SwissTable. Slots are grouped by 16,
+// every slot has a control byte holding either a 7-bit fingerprint of the
+// hash or an empty/deleted marker, and a lookup compares a whole group of
+// control bytes at once with SSE2 before touching any item.
+//
+// Writers must be serialized by the caller. find() may run concurrently with
+// writers as long as the caller validates the result with the owning
+// bucket's seqlock and stays online in the epoch_manager, since replaced
+// layouts are retired rather than freed.
+class swiss_table {
+public:
+    static const size_t group_width = 16;
+
+private:
+    static const int8_t ctrl_empty = -128;
+    static const int8_t ctrl_deleted = -2;
+
+    struct layout {
+        size_t ngroups;
+        int8_t *ctrl;
+        item **slots;
+    };
+
+    std::atomic<layout *> tbl;
+    size_t nitems;
+    size_t ndeleted;
+    float max_load_factor;
+
+    static inline uint32_t mix(uint32_t hv) noexcept {
+        hv ^= hv >> 16;
+        hv *= 0x85ebca6b;
+        hv ^= hv >> 13;
+        hv *= 0xc2b2ae35;
+        hv ^= hv >> 16;
+        return hv;
+    }
+
+    static inline int8_t h2(uint32_t h) noexcept {
+        return static_cast<int8_t>(h >> 25);
+    }
+
+    static layout *new_layout(size_t ngroups) noexcept;
+
+    static void free_layout(void *l) noexcept;
+
+    static int8_t insert_slot(layout *l, item *it, uint32_t h) noexcept;
+
+    item **find_slot(const item *it, uint32_t hv) const noexcept;
+
+    void rehash(size_t ngroups) noexcept;
+
+public:
+    swiss_table();
+
+    swiss_table(const swiss_table& s) = delete;
+    swiss_table & operator=(const swiss_table& s) = delete;
+
+    ~swiss_table();
+
+    item *find(const std::string &key, uint32_t hv, const uint64_t *digest) const noexcept;
+
+    // Compares item addresses only, it may point to a dead item.
+    inline bool contains(const item *it, uint32_t hv) const noexcept {
+        return this->find_slot(it, hv) != nullptr;
+    }
+
+    void insert(item *it, uint32_t hv) noexcept;
+
+    bool erase(item *it, uint32_t hv) noexcept;
+
+    bool replace(item *old_it, item *new_it, uint32_t hv) noexcept;
+
+    void reserve(size_t capacity) noexcept;
+
+    inline void set_max_load_factor(float lf) noexcept {
+        this->max_load_factor = lf;
+    }
+
+    inline size_t size() const noexcept {
+        return this->nitems;
+    }
+
+    inline size_t capacity() const noexcept {
+        return this->tbl.load(std::memory_order_relaxed)->ngroups * group_width;
+    }
+
+    // Calls fn on every item, the caller must hold the owning bucket lock.
+    template<typename F>
+    void for_each(F fn) const {
+        auto l = this->tbl.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < l->ngroups * group_width; i++) {
+            if (l->ctrl[i] >= 0) {
+                fn(l->slots[i]);
+            }
+        }
+    }
+};
+
+}
+
+#endif //_SWISS_H
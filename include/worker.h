@@ -3,8 +3,10 @@
 
 #include <list>
 #include <mutex>
+#include <atomic>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <ev.h>
 
@@ -17,6 +19,14 @@ class worker {
     int write_pipe;
     ev_io read_pipe_evio;
 
+    ev_prepare before_block_evp;
+    ev_check after_block_evc;
+
+    // Flash reads done by the I/O threads, for their connections.
+    ev_async flash_evasync;
+    std::mutex flash_mtx;
+    std::vector<flash_read *> flash_done;
+
     std::thread *work_thread;
 
     std::mutex wait_queue_mtx;
@@ -24,6 +34,15 @@ class worker {
 
     std::unordered_map<int, connection> conns;
 
+    // Set once the server is handed off, idle connections are then passed
+    // on, and drained_flag once none is left.
+    bool draining;
+    std::atomic<bool> drained_flag;
+
+    void release_conn(connection& conn) noexcept;
+
+    void check_drained() noexcept;
+
 public:
     struct ev_loop *evloop;
 
@@ -36,12 +55,39 @@ public:
 
     static void recv_master_sig(EV_P_ ev_io *w, int revents) noexcept;
 
+    static void before_block(EV_P_ ev_prepare *w, int revents) noexcept;
+
+    static void after_block(EV_P_ ev_check *w, int revents) noexcept;
+
+    static void recv_flash_reads(EV_P_ ev_async *w, int revents) noexcept;
+
+    // Hands a finished read over to the loop, from any thread.
+    void flash_complete(flash_read *r) noexcept;
+
     void run_thread();
 
     static void run(worker& w) noexcept;
 
     void inline remove_conn(connection& conn) noexcept {
         this->conns.erase(conn.sfd);
+
+        if (this->draining) {
+            this->check_drained();
+        }
+    }
+
+    // Tells the worker to let go of its connections as they become idle.
+    void drain() noexcept;
+
+    inline bool drained() const noexcept {
+        return this->drained_flag.load(std::memory_order_acquire);
+    }
+
+    // Called by a connection waiting for its next request.
+    void inline conn_idle(connection& conn) noexcept {
+        if (this->draining && conn.idle()) {
+            this->release_conn(conn);
+        }
     }
 };
 
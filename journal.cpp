@@ -0,0 +1,490 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <journal.h>
+#include <snapshot.h>
+#include <setting.h>
+#include <assoc.h>
+#include <epoch.h>
+#include <murmur3.h>
+
+namespace cached {
+
+static const char file_magic[8] = {'C', 'A', 'C', 'H', 'E', 'D', 'J', 'L'};
+static const uint32_t file_version = 1;
+
+static const std::chrono::milliseconds flush_period(2);
+
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+// Followed by the key and, for RECORD_PUT, the value as stored. The checksum
+// covers the whole record past itself.
+struct record_header {
+    uint32_t checksum;
+    uint32_t op;
+    uint64_t size;
+    uint64_t seq;
+    int64_t exptime;
+    int64_t created_at;
+    uint64_t cas_key;
+    uint64_t value_size;
+    uint64_t raw_size;
+    uint32_t flags;
+    uint32_t key_size;
+    uint32_t cost;
+};
+
+static uint32_t record_checksum(const char *record, size_t size) noexcept {
+    uint32_t sum;
+    MurmurHash3_x86_32(record + sizeof(uint32_t), static_cast<int>(size - sizeof(uint32_t)),
+                       0, &sum);
+    return sum;
+}
+
+journal::journal() :
+enabled(setting::get_instance().journal_path != nullptr),
+seq(0),
+fd(-1),
+generation(0),
+offset(0),
+dirty(false),
+nrecords(0),
+nbytes(0),
+nflushes(0),
+nsyncs(0),
+nerrors(0),
+nreplayed(0),
+ntorn(0)
+{
+}
+
+journal::buffer *journal::local_buffer() noexcept {
+    thread_local buffer *local = nullptr;
+
+    if (!local) {
+        local = new buffer;
+
+        std::lock_guard<std::mutex> g(this->buffers_mtx);
+        this->buffers.push_back(local);
+    }
+
+    return local;
+}
+
+void journal::append(uint64_t seq, uint32_t op, const std::string &key, const item *it) noexcept {
+    record_header r;
+    std::memset(&r, 0, sizeof(r));
+
+    r.op = op;
+    r.seq = seq;
+    r.key_size = static_cast<uint32_t>(key.size());
+
+    if (it) {
+        r.exptime = it->exptime;
+        r.created_at = it->created_at;
+        r.cas_key = it->cas_key;
+        r.value_size = it->data_size;
+        r.raw_size = it->raw_size;
+        r.flags = it->flags;
+        r.cost = it->cost;
+    }
+
+    r.size = sizeof(r) + r.key_size + r.value_size;
+
+    auto b = this->local_buffer();
+    std::lock_guard<std::mutex> g(b->mtx);
+
+    auto off = b->data.size();
+    b->data.resize(off + r.size);
+
+    auto p = b->data.data() + off;
+    std::memcpy(p + sizeof(r), key.data(), r.key_size);
+
+    if (it) {
+        auto v = p + sizeof(r) + r.key_size;
+        it->for_each_piece([&v](const char *data, size_t size) {
+            std::memcpy(v, data, size);
+            v += size;
+        });
+    }
+
+    std::memcpy(p, &r, sizeof(r));
+    r.checksum = record_checksum(p, r.size);
+    std::memcpy(p, &r.checksum, sizeof(r.checksum));
+
+    this->nrecords.fetch_add(1, std::memory_order_relaxed);
+}
+
+void journal::flush(bool sync) noexcept {
+    static auto &setting = setting::get_instance();
+
+    {
+        std::lock_guard<std::mutex> g(this->buffers_mtx);
+        this->batch.resize(this->buffers.size());
+
+        // All at once, so each key's records up to some point go to this
+        // file and the rest to the next, rotate() cuts no key's history out
+        // of order.
+        for (auto b : this->buffers) {
+            b->mtx.lock();
+        }
+
+        // The workers get last round's emptied vectors back.
+        for (size_t i = 0; i < this->buffers.size(); i++) {
+            this->batch[i].swap(this->buffers[i]->data);
+            this->buffers[i]->mtx.unlock();
+        }
+    }
+
+    std::vector<struct iovec> iov;
+    size_t total = 0;
+
+    for (auto &data : this->batch) {
+        if (!data.empty()) {
+            iov.push_back({data.data(), data.size()});
+            total += data.size();
+        }
+    }
+
+    size_t done = 0;
+    for (size_t i = 0; i < iov.size(); ) {
+        auto n = pwritev(this->fd, &iov[i], static_cast<int>(std::min<size_t>(iov.size() - i, IOV_MAX)),
+                         static_cast<off_t>(this->offset + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            std::perror("journal pwritev()");
+            this->nerrors.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+
+        done += n;
+
+        while (i < iov.size() && static_cast<size_t>(n) >= iov[i].iov_len) {
+            n -= iov[i].iov_len;
+            i++;
+        }
+
+        if (i < iov.size()) {
+            iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + n;
+            iov[i].iov_len -= n;
+        }
+    }
+
+    // A failed write leaves a torn record, replay stops there.
+    this->offset += done;
+
+    for (auto &data : this->batch) {
+        data.clear();
+    }
+
+    if (total > 0) {
+        this->dirty = true;
+        this->nbytes.fetch_add(done, std::memory_order_relaxed);
+        this->nflushes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+
+    if (this->dirty
+        && (sync || now - this->last_sync >= std::chrono::milliseconds(setting.journal_sync)))
+    {
+        if (fdatasync(this->fd) == 0) {
+            this->nsyncs.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            this->nerrors.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        this->dirty = false;
+        this->last_sync = now;
+    }
+}
+
+std::string journal::file_name(uint64_t gen) const {
+    std::string name(setting::get_instance().journal_path);
+    name.append(".");
+    name.append(std::to_string(gen));
+
+    return name;
+}
+
+std::vector<uint64_t> journal::generations() const {
+    std::string path(setting::get_instance().journal_path);
+    std::vector<uint64_t> gens;
+
+    auto slash = path.rfind('/');
+    auto dir = slash == std::string::npos ? std::string(".")
+                                          : path.substr(0, std::max<size_t>(slash, 1));
+    auto prefix = (slash == std::string::npos ? path : path.substr(slash + 1)) + ".";
+
+    auto d = opendir(dir.c_str());
+    if (!d) {
+        return gens;
+    }
+
+    while (auto e = readdir(d)) {
+        auto name = e->d_name;
+        if (std::strncmp(name, prefix.c_str(), prefix.size()) != 0) {
+            continue;
+        }
+
+        auto digits = name + prefix.size();
+        char *end;
+        auto gen = std::strtoull(digits, &end, 10);
+
+        if (*digits && !*end) {
+            gens.push_back(gen);
+        }
+    }
+
+    closedir(d);
+
+    std::sort(gens.begin(), gens.end());
+    return gens;
+}
+
+bool journal::open_generation(uint64_t gen) noexcept {
+    auto name = this->file_name(gen);
+
+    int new_fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (new_fd == -1) {
+        std::perror("journal open()");
+        return false;
+    }
+
+    file_header header;
+    std::memcpy(header.magic, file_magic, sizeof(header.magic));
+    header.version = file_version;
+    header.reserved = 0;
+
+    if (pwrite(new_fd, &header, sizeof(header), 0) != sizeof(header)) {
+        std::perror("journal pwrite()");
+        close(new_fd);
+        return false;
+    }
+
+    if (this->fd != -1) {
+        close(this->fd);
+    }
+
+    this->fd = new_fd;
+    this->generation = gen;
+    this->offset = sizeof(header);
+    this->dirty = true;
+
+    return true;
+}
+
+void journal::replay_file(hash_table &table, const std::string &name) noexcept {
+    static auto &epoch = epoch_manager::get_instance();
+
+    int rfd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (rfd == -1) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(rfd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(file_header)) {
+        close(rfd);
+        return;
+    }
+
+    size_t size = st.st_size;
+    auto base = static_cast<const char *>(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, rfd, 0));
+    close(rfd);
+
+    if (base == MAP_FAILED) {
+        std::perror("mmap()");
+        return;
+    }
+
+    if (std::memcmp(base, file_magic, sizeof(file_magic)) != 0) {
+        std::fprintf(stderr, "%s is not a journal, ignored\n", name.c_str());
+        munmap(const_cast<char *>(base), size);
+        return;
+    }
+
+    // Workers wrote their buffers one after the other, the sequence numbers
+    // give the order the mutations took.
+    std::vector<std::pair<uint64_t, size_t>> records;
+
+    for (size_t off = sizeof(file_header); off < size; ) {
+        record_header r;
+        if (size - off < sizeof(r)) {
+            this->ntorn.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+
+        std::memcpy(&r, base + off, sizeof(r));
+
+        if (r.size < sizeof(r) || r.size > size - off
+            || r.size != sizeof(r) + r.key_size + r.value_size
+            || record_checksum(base + off, r.size) != r.checksum)
+        {
+            this->ntorn.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+
+        records.emplace_back(r.seq, off);
+        off += r.size;
+    }
+
+    std::stable_sort(records.begin(), records.end(),
+                     [](const std::pair<uint64_t, size_t> &a, const std::pair<uint64_t, size_t> &b) {
+                         return a.first < b.first;
+                     });
+
+    auto now = std::time(0);
+    epoch_guard g;
+
+    for (size_t i = 0; i < records.size(); i++) {
+        record_header r;
+        std::memcpy(&r, base + records[i].second, sizeof(r));
+
+        auto p = base + records[i].second + sizeof(r);
+        std::string key(p, r.key_size);
+
+        bucket *bp;
+        auto old = table.find_item(key, bp, false);
+
+        if (r.op == RECORD_REMOVE) {
+            if (old) {
+                table.remove_item(*bp, old);
+                bp->unlock();
+            }
+        } else {
+            std::string k(key);
+            auto it = snapshot_manager::build_item(k, r.flags, static_cast<unsigned int>(r.exptime),
+                                                   p + r.key_size, r.value_size, r.raw_size);
+            it->created_at = r.created_at;
+            it->cas_key = r.cas_key;
+            it->cost = r.cost;
+
+            if (it->expired(now)) {
+                if (old) {
+                    table.remove_item(*bp, old);
+                    bp->unlock();
+                }
+
+                item::destroy(it);
+            } else if (old) {
+                table.replace_item(*bp, old, it);
+                bp->unlock();
+                table.evict();
+            } else {
+                table.insert_item(it);
+            }
+        }
+
+        this->nreplayed.fetch_add(1, std::memory_order_relaxed);
+
+        if (i % 64 == 63) {
+            epoch.quiescent();
+        }
+    }
+
+    munmap(const_cast<char *>(base), size);
+}
+
+void journal::start(hash_table &table, bool replay) {
+    auto gens = this->generations();
+
+    if (replay) {
+        auto start = std::chrono::steady_clock::now();
+
+        for (auto gen : gens) {
+            this->replay_file(table, this->file_name(gen));
+        }
+
+        if (!gens.empty()) {
+            std::fprintf(stderr, "replayed %llu journal records in %.1fs\n",
+                         static_cast<unsigned long long>(this->nreplayed.load()),
+                         std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+
+    if (!this->open_generation(gens.empty() ? 1 : gens.back() + 1)) {
+        std::exit(EXIT_FAILURE);
+    }
+
+    this->last_sync = std::chrono::steady_clock::now();
+
+    this->flusher = std::thread(&journal::run, this);
+    this->flusher.detach();
+}
+
+void journal::run() noexcept {
+    while (true) {
+        std::this_thread::sleep_for(flush_period);
+
+        std::lock_guard<std::mutex> g(this->flush_mtx);
+        this->flush(false);
+    }
+}
+
+void journal::sync() noexcept {
+    std::lock_guard<std::mutex> g(this->flush_mtx);
+
+    if (this->fd != -1) {
+        this->flush(true);
+    }
+}
+
+uint64_t journal::rotate() noexcept {
+    std::lock_guard<std::mutex> g(this->flush_mtx);
+
+    // Whatever was logged so far goes to the old file.
+    this->flush(true);
+    this->open_generation(this->generation + 1);
+
+    return this->generation;
+}
+
+void journal::compact(uint64_t gen) noexcept {
+    for (auto g : this->generations()) {
+        if (g < gen) {
+            unlink(this->file_name(g).c_str());
+        }
+    }
+}
+
+void journal::stats(stats_writer &out) noexcept {
+    uint64_t backlog = 0;
+    {
+        std::lock_guard<std::mutex> g(this->buffers_mtx);
+
+        for (auto b : this->buffers) {
+            std::lock_guard<std::mutex> bg(b->mtx);
+            backlog += b->data.size();
+        }
+    }
+
+    out.add("journal_generation", this->generation);
+    out.add("journal_records", this->nrecords.load());
+    out.add("journal_bytes", this->nbytes.load());
+    out.add("journal_backlog_bytes", backlog);
+    out.add("journal_flushes", this->nflushes.load());
+    out.add("journal_syncs", this->nsyncs.load());
+    out.add("journal_write_errors", this->nerrors.load());
+    out.add("journal_replayed_records", this->nreplayed.load());
+    out.add("journal_torn_records", this->ntorn.load());
+}
+
+}
@@ -0,0 +1,230 @@
+//-----------------------------------------------------------------------------
+// LZ4 block format. A block is a series of sequences, each a token whose high
+// nibble is the literal length and low nibble the match length minus 4, the
+// literals, a 2 byte little endian match offset and the match length. Either
+// length overflowing its nibble continues in bytes of 255. The last sequence
+// only has literals, and ends the block.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+//-----------------------------------------------------------------------------
+
+#define MIN_MATCH     4
+#define LAST_LITERALS 5  // The last 5 bytes are always literals
+#define MF_LIMIT      12 // and no match starts in the last 12.
+#define MAX_OFFSET    65535
+
+#define HASH_LOG      12
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static inline uint8_t *write_length(uint8_t *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+//-----------------------------------------------------------------------------
+
+size_t lz4_compress_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+size_t lz4_compress(const char *source, size_t size, char *dest, size_t capacity)
+{
+    const uint8_t *src = (const uint8_t *)source;
+    const uint8_t *end = src + size;
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+
+    uint8_t *op = (uint8_t *)dest;
+    uint8_t *oend = op + capacity;
+
+    // Positions of the last occurrence of each hashed 4 byte sequence.
+    uint32_t table[1 << HASH_LOG];
+
+    if (size > MF_LIMIT) {
+        const uint8_t *mflimit = end - MF_LIMIT;
+        const uint8_t *matchlimit = end - LAST_LITERALS;
+
+        memset(table, 0, sizeof(table));
+        ip++;
+
+        while (ip < mflimit) {
+            uint32_t h = hash4(read32(ip));
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip++;
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            const uint8_t *p = ip + MIN_MATCH;
+            const uint8_t *r = ref + MIN_MATCH;
+            while (p < matchlimit && *p == *r) {
+                p++;
+                r++;
+            }
+
+            size_t litlen = (size_t)(ip - anchor);
+            size_t mlen = (size_t)(p - ip) - MIN_MATCH;
+
+            if ((size_t)(oend - op) < 1 + litlen / 255 + 1 + litlen + 2 + mlen / 255 + 1) {
+                return 0;
+            }
+
+            uint8_t *token = op++;
+
+            if (litlen >= 15) {
+                *token = 15 << 4;
+                op = write_length(op, litlen - 15);
+            } else {
+                *token = (uint8_t)(litlen << 4);
+            }
+
+            memcpy(op, anchor, litlen);
+            op += litlen;
+
+            uint16_t offset = (uint16_t)(ip - ref);
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+
+            if (mlen >= 15) {
+                *token |= 15;
+                op = write_length(op, mlen - 15);
+            } else {
+                *token |= (uint8_t)mlen;
+            }
+
+            ip = anchor = p;
+
+            if (ip < mflimit) {
+                table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+            }
+        }
+    }
+
+    size_t litlen = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + litlen / 255 + 1 + litlen) {
+        return 0;
+    }
+
+    if (litlen >= 15) {
+        *op++ = 15 << 4;
+        op = write_length(op, litlen - 15);
+    } else {
+        *op++ = (uint8_t)(litlen << 4);
+    }
+
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    return (size_t)(op - (uint8_t *)dest);
+}
+
+long lz4_decompress(const char *source, size_t size, char *dest, size_t capacity)
+{
+    const uint8_t *ip = (const uint8_t *)source;
+    const uint8_t *iend = ip + size;
+
+    uint8_t *op = (uint8_t *)dest;
+    uint8_t *oend = op + capacity;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t litlen = token >> 4;
+
+        if (litlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+
+                b = *ip++;
+                litlen += b;
+            } while (b == 255);
+        }
+
+        if (litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        memcpy(op, ip, litlen);
+        op += litlen;
+        ip += litlen;
+
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dest)) {
+            return -1;
+        }
+
+        size_t mlen = token & 15;
+
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+
+        mlen += MIN_MATCH;
+
+        if (mlen > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        // Matches may overlap their own output.
+        const uint8_t *match = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, match, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) {
+                *op++ = *match++;
+            }
+        }
+    }
+
+    return (long)(op - (uint8_t *)dest);
+}
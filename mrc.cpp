@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <iterator>
+
+#include <mrc.h>
+
+namespace cached {
+
+static const double curve_sizes[mrc_estimator::ncurve] = {0.5, 1, 2, 4};
+static const char *curve_names[mrc_estimator::ncurve] = {
+        "mrc_hit_ratio_0.5x",
+        "mrc_hit_ratio_1x",
+        "mrc_hit_ratio_2x",
+        "mrc_hit_ratio_4x"
+};
+
+// Halve the counters past this many sampled accesses, so the estimate
+// follows the current workload.
+static const uint64_t refs_decay = 1 << 22;
+
+mrc_estimator::mrc_estimator(size_t memory_limit, size_t max_keys, double sample_rate) :
+threshold(static_cast<uint32_t>(sample_modulus * sample_rate)),
+memory_limit(memory_limit),
+max_keys(max_keys),
+tree(4 * max_keys + 1, 0),
+clock(0),
+refs(0),
+hits()
+{ }
+
+void mrc_estimator::tree_add(uint64_t time, int64_t bytes) noexcept {
+    for (; time < this->tree.size(); time += time & -time) {
+        this->tree[time] += bytes;
+    }
+}
+
+int64_t mrc_estimator::tree_sum(uint64_t time) const noexcept {
+    int64_t sum = 0;
+
+    for (; time > 0; time -= time & -time) {
+        sum += this->tree[time];
+    }
+
+    return sum;
+}
+
+// Out of logical time, give the tracked keys times 1..n in their order.
+void mrc_estimator::renumber() noexcept {
+    std::vector<ghost_entry *> entries;
+    entries.reserve(this->ghost.size());
+
+    for (auto &g : this->ghost) {
+        entries.push_back(&g.second);
+    }
+
+    std::sort(entries.begin(), entries.end(), [](ghost_entry *a, ghost_entry *b) {
+        return a->time < b->time;
+    });
+
+    std::fill(this->tree.begin(), this->tree.end(), 0);
+
+    this->clock = 0;
+    for (auto e : entries) {
+        e->time = ++this->clock;
+        this->tree_add(e->time, e->size);
+    }
+}
+
+void mrc_estimator::shrink() noexcept {
+    while (this->ghost.size() > this->max_keys) {
+        auto top = std::prev(this->by_sample.end())->first;
+        this->threshold.store(top, std::memory_order_relaxed);
+
+        while (!this->by_sample.empty()) {
+            auto last = std::prev(this->by_sample.end());
+            if (last->first < top) {
+                break;
+            }
+
+            auto found = this->ghost.find(last->second);
+            this->tree_add(found->second.time, -static_cast<int64_t>(found->second.size));
+            this->ghost.erase(found);
+            this->by_sample.erase(last);
+        }
+    }
+}
+
+void mrc_estimator::touch(uint32_t hv, size_t size, bool reference) noexcept {
+    std::lock_guard<std::mutex> g(this->mtx);
+
+    auto sample = sample_of(hv);
+    auto threshold = this->threshold.load(std::memory_order_relaxed);
+    if (sample >= threshold) {
+        return;
+    }
+
+    if (reference && ++this->refs >= refs_decay) {
+        this->refs /= 2;
+        for (auto &h : this->hits) {
+            h /= 2;
+        }
+    }
+
+    auto found = this->ghost.find(hv);
+    if (found != this->ghost.end()) {
+        auto &e = found->second;
+
+        if (size == 0) {
+            size = e.size;
+        }
+
+        if (reference) {
+            // Bytes of the keys touched since, and its own.
+            auto distance = this->tree_sum(this->clock) - this->tree_sum(e.time) + size;
+            auto scaled = static_cast<double>(distance) * sample_modulus / threshold;
+
+            for (unsigned i = 0; i < ncurve; i++) {
+                if (scaled <= this->memory_limit * curve_sizes[i]) {
+                    this->hits[i]++;
+                }
+            }
+        }
+
+        this->tree_add(e.time, -static_cast<int64_t>(e.size));
+        e.size = 0;
+    } else if (size == 0) {
+        // A miss on a key never stored, a cold miss at every size.
+        return;
+    } else {
+        found = this->ghost.emplace(hv, ghost_entry{0, 0, sample}).first;
+        this->by_sample.emplace(sample, hv);
+    }
+
+    if (this->clock + 1 >= this->tree.size()) {
+        this->renumber();
+    }
+
+    auto &e = found->second;
+    e.time = ++this->clock;
+    e.size = static_cast<uint32_t>(size);
+    this->tree_add(e.time, e.size);
+
+    this->shrink();
+}
+
+void mrc_estimator::access(uint32_t hv, size_t size) noexcept {
+    this->touch(hv, size, true);
+}
+
+void mrc_estimator::miss(uint32_t hv) noexcept {
+    this->touch(hv, 0, true);
+}
+
+void mrc_estimator::update(uint32_t hv, size_t size) noexcept {
+    this->touch(hv, size, false);
+}
+
+void mrc_estimator::stats(stats_writer &out) noexcept {
+    std::lock_guard<std::mutex> g(this->mtx);
+
+    out.add("mrc_sample_rate",
+            static_cast<double>(this->threshold.load()) / sample_modulus);
+    out.add("mrc_tracked_keys", static_cast<uint64_t>(this->ghost.size()));
+    out.add("mrc_sampled_refs", this->refs);
+
+    for (unsigned i = 0; i < ncurve; i++) {
+        out.add(curve_names[i],
+                this->refs ? static_cast<double>(this->hits[i]) / this->refs : 0.0);
+    }
+}
+
+}
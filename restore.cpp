@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <bulk.h>
+
+using namespace cached;
+
+// Loads a file written by cached-dump into a server.
+//
+// Connections take the next block of the file in turn and send it as it
+// is, still compressed, keeping up to window blocks in flight each before
+// waiting for the oldest to be answered. The time to live of the items is
+// shortened by the age of the dump.
+
+// Larger blocks than any server sends mean a damaged file.
+static const uint32_t max_block_size = 256 * 1024 * 1024;
+
+struct restore_file {
+    int fd;
+    std::mutex mtx;
+    bool eof;
+    bool failed;
+    uint32_t age;
+
+    uint64_t nblocks;
+    uint64_t nrecords;
+    uint64_t nloaded;
+    uint64_t bytes;
+};
+
+// Reads n bytes, 0 at the end of the file, -1 on a short or failed read.
+static int read_all(int fd, void *buf, size_t n) noexcept {
+    auto p = static_cast<char *>(buf);
+    size_t got = 0;
+
+    while (got < n) {
+        auto r = read(fd, p + got, n - got);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            std::perror("read()");
+            return -1;
+        }
+
+        if (r == 0) {
+            if (got == 0) {
+                return 0;
+            }
+
+            std::fprintf(stderr, "truncated dump file\n");
+            return -1;
+        }
+
+        got += r;
+    }
+
+    return 1;
+}
+
+// The next block of the file as a load request in req, false once there is
+// none left or the file is damaged.
+static bool next_block(restore_file &in, std::vector<char> &req, uint32_t &nrecords) noexcept {
+    std::lock_guard<std::mutex> g(in.mtx);
+
+    if (in.eof || in.failed) {
+        return false;
+    }
+
+    bulk::block_header header;
+
+    auto res = read_all(in.fd, &header, sizeof(header));
+    if (res == 0) {
+        in.eof = true;
+        return false;
+    }
+
+    if (res < 0 || header.size > header.raw_size || header.raw_size > max_block_size) {
+        if (res > 0) {
+            std::fprintf(stderr, "damaged dump file\n");
+        }
+
+        in.failed = true;
+        return false;
+    }
+
+    char line[96];
+    auto n = std::sprintf(line, "load %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32 "\r\n",
+                          header.nrecords, header.raw_size, header.size, in.age);
+
+    req.resize(n + header.size + 2);
+    std::memcpy(req.data(), line, n);
+
+    if (read_all(in.fd, req.data() + n, header.size) <= 0 && header.size > 0) {
+        std::fprintf(stderr, "truncated dump file\n");
+        in.failed = true;
+        return false;
+    }
+
+    std::memcpy(req.data() + n + header.size, "\r\n", 2);
+
+    nrecords = header.nrecords;
+    in.nblocks++;
+    in.nrecords += header.nrecords;
+    in.bytes += sizeof(header) + header.size;
+
+    return true;
+}
+
+static void restore_blocks(const char *host, const char *port, unsigned long window,
+                           restore_file &in) noexcept
+{
+    bulk::client conn;
+
+    auto fail = [&in]() {
+        std::lock_guard<std::mutex> g(in.mtx);
+        in.failed = true;
+    };
+
+    if (!conn.connect(host, port)) {
+        fail();
+        return;
+    }
+
+    std::vector<char> req;
+    std::string line;
+    unsigned long inflight = 0;
+    uint64_t nloaded = 0;
+    uint32_t nrecords;
+    bool more = true;
+
+    while (more || inflight > 0) {
+        if (more && inflight < window) {
+            more = next_block(in, req, nrecords);
+
+            if (more) {
+                if (!conn.send(req.data(), req.size())) {
+                    fail();
+                    return;
+                }
+
+                inflight++;
+            }
+
+            continue;
+        }
+
+        unsigned long n;
+
+        if (!conn.read_line(line)) {
+            fail();
+            return;
+        }
+
+        if (std::sscanf(line.c_str(), "LOADED %lu", &n) != 1) {
+            std::fprintf(stderr, "unexpected reply: %s\n", line.c_str());
+            fail();
+            return;
+        }
+
+        nloaded += n;
+        inflight--;
+    }
+
+    std::lock_guard<std::mutex> g(in.mtx);
+    in.nloaded += nloaded;
+}
+
+static void usage(const char *prog) {
+    std::fprintf(stderr,
+                 "usage: %s [options] <file>\n"
+                 "  reads standard input when file is -\n"
+                 "  -H, --host=<host>        server address, 127.0.0.1 by default\n"
+                 "  -p, --port=<port>        server port, 23333 by default\n"
+                 "  -c, --connections=<n>    connections to load over, 4 by default\n"
+                 "  -w, --window=<n>         blocks each connection keeps in flight,\n"
+                 "                           8 by default\n"
+                 "  -h, --help               this help\n",
+                 prog);
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    const char *port = "23333";
+    unsigned long connections = 4;
+    unsigned long window = 8;
+
+    static const struct option long_opts[] = {
+            {"host",        required_argument, nullptr, 'H'},
+            {"port",        required_argument, nullptr, 'p'},
+            {"connections", required_argument, nullptr, 'c'},
+            {"window",      required_argument, nullptr, 'w'},
+            {"help",        no_argument,       nullptr, 'h'},
+            {nullptr, 0,                       nullptr, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "H:p:c:w:h", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'H':
+                host = optarg;
+                break;
+
+            case 'p':
+                port = optarg;
+                break;
+
+            case 'c':
+                connections = std::strtoul(optarg, nullptr, 10);
+                if (connections < 1 || connections > 256) {
+                    std::fprintf(stderr, "connections must be between 1 and 256\n");
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'w':
+                window = std::strtoul(optarg, nullptr, 10);
+                if (window < 1 || window > 1024) {
+                    std::fprintf(stderr, "window must be between 1 and 1024\n");
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            default:
+                usage(argv[0]);
+                return EX_USAGE;
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    auto path = argv[optind];
+    auto from_stdin = std::strcmp(path, "-") == 0;
+
+    restore_file in;
+    in.eof = false;
+    in.failed = false;
+    in.nblocks = 0;
+    in.nrecords = 0;
+    in.nloaded = 0;
+    in.bytes = 0;
+
+    in.fd = from_stdin ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (in.fd == -1) {
+        std::perror("open()");
+        return EX_NOINPUT;
+    }
+
+    bulk::file_header header;
+
+    if (read_all(in.fd, &header, sizeof(header)) <= 0
+        || std::memcmp(header.magic, bulk::file_magic, sizeof(header.magic)) != 0
+        || header.version != bulk::file_version)
+    {
+        std::fprintf(stderr, "%s is not a dump file\n", path);
+        return EX_DATAERR;
+    }
+
+    in.age = static_cast<uint32_t>(std::max<int64_t>(0, std::time(0) - header.created_at));
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned long i = 0; i < connections; i++) {
+        threads.emplace_back(restore_blocks, host, port, window, std::ref(in));
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    if (!from_stdin) {
+        close(in.fd);
+    }
+
+    if (in.failed) {
+        std::fprintf(stderr, "restore incomplete, %" PRIu64 " items loaded\n", in.nloaded);
+        return EX_UNAVAILABLE;
+    }
+
+    auto secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::fprintf(stderr,
+                 "restored %" PRIu64 " of %" PRIu64 " items in %" PRIu64 " blocks, "
+                 "%.1f MB in %.2f s, %.1f MB/s\n",
+                 in.nloaded, in.nrecords, in.nblocks,
+                 in.bytes / 1048576.0, secs, secs > 0 ? in.bytes / 1048576.0 / secs : 0.0);
+
+    return 0;
+}
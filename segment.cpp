@@ -0,0 +1,611 @@
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <segment.h>
+#include <setting.h>
+#include <assoc.h>
+#include <epoch.h>
+
+namespace cached {
+
+// Segments whose live fraction is above this are not worth cleaning.
+static const double max_clean_live = 0.9;
+
+static const char arena_magic[8] = {'C', 'A', 'C', 'H', 'E', 'D', 'A', 'R'};
+static const uint32_t arena_version = 2;
+
+static const size_t boot_id_size = 36;
+
+// First page of an arena file, followed by the used table and, from the next
+// page boundary on, the segments.
+struct segment_store::arena_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t item_size;
+    uint64_t segment_size;
+    uint32_t nsegments;
+    uint32_t hash_seed;
+    uint32_t hash_fn;
+    uint32_t key_mode;
+    // Set by detach() and cleared once a process maps the file, with the
+    // boot the pages were written in.
+    uint32_t clean;
+    char boot_id[boot_id_size];
+};
+
+static uint32_t key_mode() noexcept {
+    auto &setting = setting::get_instance();
+    return (setting.key_digest ? 1 : 0) | (setting.key_verify ? 2 : 0);
+}
+
+// The id of this boot, false when the kernel does not tell.
+static bool read_boot_id(char *out) noexcept {
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    auto n = read(fd, out, boot_id_size);
+    close(fd);
+
+    return n == static_cast<ssize_t>(boot_id_size);
+}
+
+segment_store::segment_store() :
+arena_fd(-1),
+map_base(nullptr),
+map_size(0),
+used_table(nullptr),
+attachable(false),
+nreattached(0),
+reattach_usec(0),
+nfree(0),
+head(no_segment),
+cleaner_wakeup(false),
+ncleaned(0),
+nrelocated(0),
+nfallbacks(0),
+nmoves(0),
+nmoved_bytes(0),
+nrescued(0)
+{
+    auto &setting = setting::get_instance();
+
+    this->automove = setting.log_automove;
+
+    this->segment_size = setting.log_segment_size;
+
+    // Headroom for dead entries awaiting the cleaner, plus the head and the
+    // segment being cleaned.
+    auto n = setting.max_lru_queue_size / this->segment_size;
+    this->nsegments = static_cast<uint32_t>(n + n / 8 + 2);
+
+    if (setting.log_arena_path) {
+        this->map_arena(setting.log_arena_path);
+    } else {
+        this->arena = static_cast<char *>(mmap(nullptr,
+                                               this->nsegments * this->segment_size,
+                                               PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                               -1, 0));
+        if (this->arena == MAP_FAILED) {
+            perror("failed to map the segment arena");
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    this->segments = new segment[this->nsegments];
+    this->free_list.reserve(this->nsegments);
+
+    for (auto seg = this->nsegments; seg-- > 0; ) {
+        auto &s = this->segments[seg];
+
+        s.live = 0;
+
+        // Entries in the file wait for reattach(), nothing is allocated
+        // from their segments until then.
+        if (this->attachable && this->used_table[seg] > 0) {
+            s.used = this->used_table[seg];
+            s.state = SEGMENT_PENDING;
+            continue;
+        }
+
+        s.used = 0;
+        s.state = SEGMENT_FREE;
+        this->free_list.push_back(seg);
+    }
+
+    this->nfree = static_cast<uint32_t>(this->free_list.size());
+}
+
+void segment_store::map_arena(const char *path) noexcept {
+    auto table_size = this->nsegments * sizeof(uint64_t);
+    auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    auto offset = (sizeof(arena_header) + table_size + page - 1) / page * page;
+
+    this->map_size = offset + this->nsegments * this->segment_size;
+
+    this->arena_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (this->arena_fd == -1) {
+        perror("failed to open the arena file");
+        std::exit(EXIT_FAILURE);
+    }
+
+    struct stat st;
+    bool same_size = fstat(this->arena_fd, &st) == 0
+                     && static_cast<size_t>(st.st_size) == this->map_size;
+
+    if (!same_size && ftruncate(this->arena_fd, this->map_size) == -1) {
+        perror("failed to size the arena file");
+        std::exit(EXIT_FAILURE);
+    }
+
+    this->map_base = static_cast<char *>(mmap(nullptr, this->map_size,
+                                              PROT_READ | PROT_WRITE, MAP_SHARED,
+                                              this->arena_fd, 0));
+    if (this->map_base == MAP_FAILED) {
+        perror("failed to map the arena file");
+        std::exit(EXIT_FAILURE);
+    }
+
+    this->used_table = reinterpret_cast<uint64_t *>(this->map_base + sizeof(arena_header));
+    this->arena = this->map_base + offset;
+
+    auto header = reinterpret_cast<arena_header *>(this->map_base);
+    char boot_id[boot_id_size];
+
+    // Only a file left by a clean detach in this boot is whole, after a
+    // crash or a reboot its pages are whatever was written back.
+    this->attachable = same_size
+                       && std::memcmp(header->magic, arena_magic, sizeof(arena_magic)) == 0
+                       && header->version == arena_version
+                       && header->item_size == sizeof(item)
+                       && header->segment_size == this->segment_size
+                       && header->nsegments == this->nsegments
+                       && header->key_mode == key_mode()
+                       && header->clean
+                       && read_boot_id(boot_id)
+                       && std::memcmp(header->boot_id, boot_id, boot_id_size) == 0;
+
+    for (uint32_t seg = 0; this->attachable && seg < this->nsegments; seg++) {
+        this->attachable = this->used_table[seg] <= this->segment_size;
+    }
+
+    if (!this->attachable) {
+        this->reset_arena();
+    }
+
+    header->clean = 0;
+}
+
+void segment_store::reset_arena() noexcept {
+    // Truncating drops every stale entry, and the pages backing them.
+    if (ftruncate(this->arena_fd, 0) == -1 || ftruncate(this->arena_fd, this->map_size) == -1) {
+        perror("failed to reset the arena file");
+        std::exit(EXIT_FAILURE);
+    }
+
+    auto header = reinterpret_cast<arena_header *>(this->map_base);
+
+    std::memcpy(header->magic, arena_magic, sizeof(arena_magic));
+    header->version = arena_version;
+    header->item_size = sizeof(item);
+    header->segment_size = this->segment_size;
+    header->nsegments = this->nsegments;
+    header->key_mode = key_mode();
+    header->clean = 0;
+}
+
+void segment_store::free_segment(uint32_t seg) noexcept {
+    auto &s = this->segments[seg];
+
+    s.state = SEGMENT_FREE;
+    s.used = 0;
+    if (this->used_table) {
+        this->used_table[seg] = 0;
+    }
+    this->free_list.push_back(seg);
+    this->nfree = static_cast<uint32_t>(this->free_list.size());
+}
+
+void *segment_store::allocate(size_t size, uint32_t hv, uint32_t &seg, size_t key_size) noexcept {
+    auto total = entry_size(size);
+    if (total > this->segment_size) {
+        this->nfallbacks.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    mtx_guard g(this->mtx);
+
+    if (this->head == no_segment
+        || this->segments[this->head].used + total > this->segment_size)
+    {
+        if (this->head != no_segment) {
+            auto &s = this->segments[this->head];
+
+            s.state = SEGMENT_SEALED;
+            s.sealed_at = std::time(0);
+            if (s.live.load() == 0) {
+                this->free_segment(this->head);
+            }
+
+            this->head = no_segment;
+        }
+
+        if (this->free_list.size() <= this->nsegments / 10) {
+            this->cleaner_wakeup = true;
+            this->cleaner_cv.notify_one();
+        }
+
+        if (this->free_list.empty()) {
+            this->nfallbacks.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        this->head = this->free_list.back();
+        this->free_list.pop_back();
+        this->nfree = static_cast<uint32_t>(this->free_list.size());
+        this->segments[this->head].state = SEGMENT_HEAD;
+    }
+
+    auto &s = this->segments[this->head];
+    auto header = reinterpret_cast<entry_header *>(this->segment_base(this->head) + s.used);
+
+    header->size = static_cast<uint32_t>(total);
+    header->hv = hv;
+    header->key_size = key_size;
+
+    s.used += total;
+    s.live += total;
+    seg = this->head;
+
+    if (this->used_table) {
+        this->used_table[seg] = s.used;
+    }
+
+    return header + 1;
+}
+
+void segment_store::release(uint32_t seg, size_t size) noexcept {
+    this->drop_live(seg, entry_size(size));
+}
+
+void segment_store::drop_live(uint32_t seg, size_t bytes) noexcept {
+    auto &s = this->segments[seg];
+
+    if (s.live.fetch_sub(bytes) != bytes) {
+        return;
+    }
+
+    mtx_guard g(this->mtx);
+
+    if ((s.state == SEGMENT_SEALED || s.state == SEGMENT_CLEANED) && s.live.load() == 0) {
+        this->free_segment(seg);
+    }
+}
+
+uint32_t segment_store::pick_segment() noexcept {
+    mtx_guard g(this->mtx);
+
+    auto best = no_segment;
+    auto best_live = static_cast<size_t>(this->segment_size * max_clean_live);
+
+    for (uint32_t seg = 0; seg < this->nsegments; seg++) {
+        auto &s = this->segments[seg];
+        auto live = s.live.load(std::memory_order_relaxed);
+
+        if (s.state == SEGMENT_SEALED && live < best_live) {
+            best = seg;
+            best_live = live;
+        }
+    }
+
+    if (best != no_segment) {
+        // Pinned with one extra live byte, so that the segment cannot be
+        // freed and reused while the cleaner walks it.
+        this->segments[best].state = SEGMENT_CLEANED;
+        this->segments[best].live += 1;
+    }
+
+    return best;
+}
+
+uint32_t segment_store::pick_oldest() noexcept {
+    mtx_guard g(this->mtx);
+
+    auto oldest = no_segment;
+    for (uint32_t seg = 0; seg < this->nsegments; seg++) {
+        auto &s = this->segments[seg];
+
+        if (s.state == SEGMENT_SEALED
+            && (oldest == no_segment || s.sealed_at < this->segments[oldest].sealed_at))
+        {
+            oldest = seg;
+        }
+    }
+
+    if (oldest != no_segment) {
+        this->segments[oldest].state = SEGMENT_CLEANED;
+        this->segments[oldest].live += 1;
+    }
+
+    return oldest;
+}
+
+void segment_store::clean_segment(hash_table &table, uint32_t seg) noexcept {
+    auto p = this->segment_base(seg);
+
+    // Sealed, so nothing is appended behind the cleaner's back.
+    auto end = p + this->segments[seg].used;
+
+    while (p < end) {
+        auto header = reinterpret_cast<entry_header *>(p);
+
+        if (table.relocate_item(reinterpret_cast<item *>(header + 1), header->hv)
+            == relocate_result::MOVED)
+        {
+            this->nrelocated.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        p += header->size;
+    }
+
+    this->drop_live(seg, 1);
+
+    this->ncleaned.fetch_add(1, std::memory_order_relaxed);
+}
+
+void segment_store::move_segment(hash_table &table, uint32_t seg) noexcept {
+    static auto &epoch = epoch_manager::get_instance();
+    static const unsigned batch = 64;
+
+    auto p = this->segment_base(seg);
+    auto end = p + this->segments[seg].used;
+
+    // With no free segment a rescued item would only land on the heap.
+    auto evict_before = this->starved() ? std::numeric_limits<time_t>::max()
+                                        : this->segments[seg].sealed_at;
+
+    for (unsigned n = 1; p < end; n++) {
+        auto header = reinterpret_cast<entry_header *>(p);
+
+        switch (table.relocate_item(reinterpret_cast<item *>(header + 1),
+                                    header->hv, evict_before))
+        {
+            case relocate_result::MOVED:
+                this->nrescued.fetch_add(1, std::memory_order_relaxed);
+                break;
+
+            case relocate_result::EVICTED:
+                this->nmoved_bytes.fetch_add(header->size, std::memory_order_relaxed);
+                break;
+
+            case relocate_result::GONE:
+                break;
+        }
+
+        // Lets the grace period advance while a large segment is drained.
+        if (n % batch == 0) {
+            epoch.quiescent();
+        }
+
+        p += header->size;
+    }
+
+    this->drop_live(seg, 1);
+    this->nmoves.fetch_add(1, std::memory_order_relaxed);
+}
+
+void segment_store::run_cleaner(hash_table &table) noexcept {
+    auto reserve = std::max<size_t>(2, this->nsegments / 10);
+    uint64_t fallbacks = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> l(this->mtx);
+            this->cleaner_cv.wait_for(l, std::chrono::milliseconds(100), [this] {
+                return this->cleaner_wakeup;
+            });
+
+            this->cleaner_wakeup = false;
+            if (this->free_list.size() >= reserve) {
+                continue;
+            }
+        }
+
+        // Relocated items are retired by this thread, going offline frees
+        // the ones past their grace period.
+        epoch_guard g;
+        std::lock_guard<std::mutex> cg(this->clean_mtx);
+
+        auto seg = this->pick_segment();
+        if (seg != no_segment) {
+            this->clean_segment(table, seg);
+        } else if (this->automove
+                   && (this->starved() || this->nfallbacks.load() != fallbacks)
+                   && (seg = this->pick_oldest()) != no_segment)
+        {
+            this->move_segment(table, seg);
+        }
+
+        fallbacks = this->nfallbacks.load();
+
+        if (seg != no_segment) {
+            mtx_guard lg(this->mtx);
+            this->cleaner_wakeup = true;
+        }
+    }
+}
+
+void segment_store::reattach_segment(hash_table &table, uint32_t seg) noexcept {
+    auto &s = this->segments[seg];
+    auto p = this->segment_base(seg);
+    auto end = p + s.used;
+    auto now = std::time(0);
+
+    while (p + sizeof(entry_header) + sizeof(item) <= end) {
+        auto header = reinterpret_cast<entry_header *>(p);
+        if (header->size > static_cast<size_t>(end - p) || header->size == 0) {
+            break;
+        }
+
+        p += header->size;
+
+        // Only what was indexed is worth anything, and what was not written
+        // in full when the process stopped is dropped.
+        auto stale = reinterpret_cast<item *>(header + 1);
+        if (!stale->linked.load(std::memory_order_relaxed) || stale->segment != seg
+            || stale->chain || stale->shared || stale->flash_page != flash_store::no_page
+            || stale->hv != header->hv
+            || entry_size(sizeof(item) + stale->data_size + header->key_size) != header->size)
+        {
+            continue;
+        }
+
+        // Counted live before it is indexed, eviction may drop it at once.
+        s.live += header->size;
+
+        auto it = item::restore(stale, header->key_size);
+        if (it->expired(now) || !table.insert_restored(it)) {
+            it->~item();
+            s.live -= header->size;
+            continue;
+        }
+
+        this->nreattached.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool segment_store::reattach(hash_table &table, unsigned nthreads) noexcept {
+    static auto &epoch = epoch_manager::get_instance();
+
+    auto start = std::chrono::steady_clock::now();
+    auto header = reinterpret_cast<arena_header *>(this->map_base);
+
+    bool same_hash = header->hash_seed == table.seed()
+                     && header->hash_fn == static_cast<uint32_t>(table.hash_function_type());
+
+    std::vector<uint32_t> pending;
+    for (uint32_t seg = 0; seg < this->nsegments; seg++) {
+        if (this->segments[seg].state == SEGMENT_PENDING) {
+            pending.push_back(seg);
+        }
+    }
+
+    if (!same_hash || pending.empty()) {
+        {
+            mtx_guard g(this->mtx);
+
+            for (auto seg : pending) {
+                this->free_segment(seg);
+            }
+        }
+
+        this->reset_arena();
+        header->hash_seed = table.seed();
+        header->hash_fn = static_cast<uint32_t>(table.hash_function_type());
+        return false;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < std::max(nthreads, 1u); t++) {
+        workers.emplace_back([&] {
+            epoch_guard g;
+
+            for (size_t i; (i = next.fetch_add(1)) < pending.size(); ) {
+                this->reattach_segment(table, pending[i]);
+                epoch.quiescent();
+            }
+        });
+    }
+
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    {
+        mtx_guard g(this->mtx);
+
+        // Dead entries stay for the cleaner like in any sealed segment.
+        for (auto seg : pending) {
+            auto &s = this->segments[seg];
+
+            s.state = SEGMENT_SEALED;
+            s.sealed_at = std::time(0);
+            if (s.live.load() == 0) {
+                this->free_segment(seg);
+            }
+        }
+    }
+
+    this->reattach_usec = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    std::fprintf(stderr, "reattached %llu items in %s in %.1fs\n",
+                 static_cast<unsigned long long>(this->nreattached.load()),
+                 setting::get_instance().log_arena_path, this->reattach_usec / 1e6);
+
+    return true;
+}
+
+void segment_store::detach() noexcept {
+    if (!this->file_backed()) {
+        return;
+    }
+
+    auto header = reinterpret_cast<arena_header *>(this->map_base);
+
+    // Stops the cleaner between two segments for good.
+    this->clean_mtx.lock();
+
+    if (read_boot_id(header->boot_id)) {
+        header->clean = 1;
+    }
+}
+
+void segment_store::start_cleaner(hash_table &table) {
+    this->cleaner = std::thread(&segment_store::run_cleaner, this, std::ref(table));
+    this->cleaner.detach();
+}
+
+void segment_store::stats(stats_writer &out) noexcept {
+    uint64_t live = 0;
+    for (uint32_t seg = 0; seg < this->nsegments; seg++) {
+        live += this->segments[seg].live.load(std::memory_order_relaxed);
+    }
+
+    size_t nfree;
+    {
+        mtx_guard g(this->mtx);
+        nfree = this->free_list.size();
+    }
+
+    out.add("log_segment_size", static_cast<uint64_t>(this->segment_size));
+    out.add("log_segments", static_cast<uint64_t>(this->nsegments));
+    out.add("log_free_segments", static_cast<uint64_t>(nfree));
+    out.add("log_live_bytes", live);
+    out.add("log_cleaned_segments", this->ncleaned.load());
+    out.add("log_relocated_items", this->nrelocated.load());
+    out.add("log_heap_fallbacks", this->nfallbacks.load());
+    out.add("log_automove_segments", this->nmoves.load());
+    out.add("log_automove_evicted_bytes", this->nmoved_bytes.load());
+    out.add("log_automove_rescued_items", this->nrescued.load());
+
+    if (this->file_backed()) {
+        out.add("log_reattached_items", this->nreattached.load());
+        out.add("log_reattach_usec", this->reattach_usec);
+    }
+}
+
+}
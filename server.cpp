@@ -1,13 +1,27 @@
 #include <thread>
+#include <cstring>
+#include <cstdlib>
+
+#include <poll.h>
 
 #include <master.h>
 #include <common.h>
+#include <snapshot.h>
+#include <segment.h>
+#include <handoff.h>
+#include <journal.h>
 
 #include <ev.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sysexits.h>
 #include <sys/socket.h>
 
 namespace cached {
 
+// Connections still busy this long after a handoff are dropped.
+static const ev_tstamp drain_timeout = 30;
+
 master::listener::listener(int fd, struct sockaddr *address, socklen_t addr_len):
 sfd(fd),
 addr_len(addr_len)
@@ -15,12 +29,12 @@ addr_len(addr_len)
     std::memcpy(&this->addr, address, addr_len);
 
     ev_io_init(&this->evio, [](EV_P_ ev_io *w, int revents) -> void {
-        static auto master = master::get_instance();
+        static auto &master = master::get_instance();
 
-        socklen_t address_len;
         struct sockaddr_storage address;
+        socklen_t address_len = sizeof(address);
 
-        int fd = accept(w->fd, (struct sockaddr *)&address, &address_len);
+        int fd = accept4(w->fd, (struct sockaddr *)&address, &address_len, SOCK_NONBLOCK);
         if (fd == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return;
@@ -44,6 +58,105 @@ void master::listener::bind_ev_loop(struct ev_loop *loop) {
     ev_io_start(loop, &this->evio);
 }
 
+void master::listener::stop(struct ev_loop *loop) {
+    ev_io_stop(loop, &this->evio);
+    close(this->sfd);
+}
+
+bool master::take_over(bool wait_exit) noexcept {
+    static auto &handoff = handoff::get_instance();
+
+    std::vector<int> fds;
+    if (!handoff.connect_predecessor(fds)) {
+        return false;
+    }
+
+    for (auto fd : fds) {
+        struct sockaddr_storage address;
+        socklen_t address_len = sizeof(address);
+
+        getsockname(fd, (struct sockaddr *)&address, &address_len);
+        this->listeners.emplace_back(fd, (struct sockaddr *)&address, address_len);
+    }
+
+    if (wait_exit) {
+        this->parking = true;
+        this->parker = std::thread(&master::park_new_conns, this);
+
+        for (int fd; (fd = handoff.receive_client()) != -1; ) {
+            std::lock_guard<std::mutex> g(this->inherited_mtx);
+            this->inherited_conns.push_back(fd);
+        }
+    }
+
+    return true;
+}
+
+void master::park_new_conns() noexcept {
+    std::vector<struct pollfd> pfds;
+    for (auto &listener : this->listeners) {
+        pfds.push_back({listener.fd(), POLLIN, 0});
+    }
+
+    while (this->parking.load(std::memory_order_acquire)) {
+        if (poll(pfds.data(), pfds.size(), 50) <= 0) {
+            continue;
+        }
+
+        for (auto &p : pfds) {
+            if (!(p.revents & POLLIN)) {
+                continue;
+            }
+
+            for (int fd; (fd = accept4(p.fd, nullptr, nullptr, SOCK_NONBLOCK)) != -1; ) {
+                std::lock_guard<std::mutex> g(this->inherited_mtx);
+                this->inherited_conns.push_back(fd);
+            }
+        }
+    }
+}
+
+void master::drain() noexcept {
+    for (auto &listener : this->listeners) {
+        listener.stop(this->evloop);
+    }
+
+    for (unsigned i = 0; i < this->nworker; i++) {
+        this->workers[i].drain();
+    }
+
+    this->drain_deadline = ev_now(this->evloop) + drain_timeout;
+
+    ev_timer_init(&this->drain_evt, [](EV_P_ ev_timer *w, int revents) -> void {
+        static auto &master = master::get_instance();
+        auto &setting = setting::get_instance();
+
+        for (unsigned i = 0; i < master.nworker; i++) {
+            if (!master.workers[i].drained() && ev_now(loop) < master.drain_deadline) {
+                return;
+            }
+        }
+
+        if (setting.snapshot_path) {
+            snapshot_manager::get_instance().save(hash_table::get_instance());
+        }
+
+        if (setting.journal_path) {
+            journal::get_instance().sync();
+        }
+
+        if (setting.log_arena_path) {
+            segment_store::get_instance().detach();
+        }
+
+        // Worker threads are still parked in their loops, skip the static
+        // destructors.
+        _exit(EXIT_SUCCESS);
+    }, 0.1, 0.1);
+
+    ev_timer_start(this->evloop, &this->drain_evt);
+}
+
 int master::init_listener() noexcept {
     auto setting = setting::get_instance();
     static int flags = 1;
@@ -113,9 +226,14 @@ int master::init_listener() noexcept {
 }
 
 void master::start_listen() noexcept {
-    this->init_listener();
+    static auto &handoff = handoff::get_instance();
+    auto &setting = setting::get_instance();
+
+    if (this->listeners.empty()) {
+        this->init_listener();
+    }
 
-    for (auto listener : this->listeners) {
+    for (auto &listener : this->listeners) {
         listener.bind_ev_loop(this->evloop);
     }
 
@@ -123,13 +241,55 @@ void master::start_listen() noexcept {
         this->workers[i].run_thread();
     }
 
+    if (this->parker.joinable()) {
+        this->parking = false;
+        this->parker.join();
+    }
+
+    for (auto fd : this->inherited_conns) {
+        this->dispatch_new_conn(fd);
+    }
+    this->inherited_conns.clear();
+
+    if (handoff.predecessor() != -1) {
+        ev_io_init(&this->predecessor_evio, [](EV_P_ ev_io *w, int revents) -> void {
+            int fd = handoff.receive_client();
+            if (fd == -1) {
+                ev_io_stop(loop, w);
+                return;
+            }
+
+            master::get_instance().dispatch_new_conn(fd);
+        }, handoff.predecessor(), EV_READ);
+        ev_io_start(this->evloop, &this->predecessor_evio);
+    }
+
+    int fd;
+    if (setting.handoff_path && (fd = handoff.listen()) != -1) {
+        ev_io_init(&this->handoff_evio, [](EV_P_ ev_io *w, int revents) -> void {
+            static auto &master = master::get_instance();
+
+            std::vector<int> fds;
+            for (auto &listener : master.listeners) {
+                fds.push_back(listener.fd());
+            }
+
+            if (handoff.accept_successor(fds)) {
+                ev_io_stop(loop, w);
+                master.drain();
+            }
+        }, fd, EV_READ);
+        ev_io_start(this->evloop, &this->handoff_evio);
+    }
+
     ev_run(this->evloop, 0);
 }
 
 master::master() :
 workers(new worker[std::thread::hardware_concurrency()]),
 nworker(std::thread::hardware_concurrency()),
-evloop(ev_loop_new(EVFLAG_AUTO))
+evloop(ev_loop_new(EVFLAG_AUTO)),
+parking(false)
 { }
 
 master::~master()  {
@@ -139,6 +299,437 @@ master::~master()  {
 
 }
 
+static void usage(const char *prog) {
+    std::fprintf(stderr,
+                 "usage: %s [options]\n"
+                 "  -e, --index-engine=<chained|swiss>  hash index implementation\n"
+                 "  -H, --hash=<murmur3|murmur3-128|crc32c|wyhash>\n"
+                 "                                      key hash function\n"
+                 "  -E, --eviction=<lru|s3fifo|gdsf>    eviction policy\n"
+                 "  -m, --memory=<megabytes>            item memory limit\n"
+                 "  -I, --max-item-size=<megabytes>     largest value accepted\n"
+                 "  -a, --admission                     TinyLFU admission filter\n"
+                 "  -W, --admission-window=<percent>    admission window size\n"
+                 "  -S, --mrc-keys=<n>                  keys sampled for the miss ratio\n"
+                 "                                      curve, 0 disables it\n"
+                 "  -s, --storage=<heap|log>            item memory allocator\n"
+                 "  -z, --segment-size=<megabytes>      log segment size, 1 to 8\n"
+                 "  -A, --no-automove                   never evict whole log segments\n"
+                 "  -R, --arena=<path>                  keep log segments in this file,\n"
+                 "                                      on /dev/shm, to restart warm\n"
+                 "  -x, --flash=<path>                  keep evicted values in this file or\n"
+                 "                                      block device\n"
+                 "  -X, --flash-size=<megabytes>        flash space used, at least 16\n"
+                 "  -y, --flash-min-size=<bytes>        smallest value moved to flash\n"
+                 "  -D, --defrag                        active defragmentation\n"
+                 "  -T, --defrag-threshold=<percent>    fragmentation that starts it\n"
+                 "  -C, --defrag-cpu=<percent>          CPU budget of the defragmenter\n"
+                 "  -c, --compress=<bytes>              compress values of this size or\n"
+                 "                                      larger when stored\n"
+                 "  -o, --compress-cold=<seconds>       compress values not read for this\n"
+                 "                                      long\n"
+                 "  -F, --compress-flag=<bit>           item flag bit of clients reading\n"
+                 "                                      compressed values as stored\n"
+                 "  -d, --dedup=<bytes>                 share identical values of this\n"
+                 "                                      size or larger between items\n"
+                 "  -k, --key-digest                    store 128 bit key digests instead\n"
+                 "                                      of keys, trusting them to be unique\n"
+                 "  -K, --key-verify                    with --key-digest, keep the keys to\n"
+                 "                                      rule out digest collisions\n"
+                 "  -P, --snapshot=<path>               save snapshots to and warm up from\n"
+                 "                                      this file\n"
+                 "  -i, --snapshot-interval=<seconds>   time between snapshots\n"
+                 "  -L, --load-threads=<n>              threads loading the snapshot or\n"
+                 "                                      reattaching to the arena\n"
+                 "  -j, --journal=<path>                log mutations to files named after\n"
+                 "                                      this path and replay them at startup\n"
+                 "  -J, --journal-sync=<ms>             time between journal syncs, 0 to\n"
+                 "                                      sync every write\n"
+                 "  -U, --handoff=<path>                take over from the server listening\n"
+                 "                                      on this Unix socket, and listen on\n"
+                 "                                      it for the next upgrade\n"
+                 "  -u, --handoff-clients               take over its client connections too\n"
+                 "  -h, --help                          show this message\n",
+                 prog);
+}
+
 int main(int argc, char **argv) {
+    auto &setting = cached::setting::get_instance();
+
+    static const struct option long_opts[] = {
+            {"index-engine", required_argument, nullptr, 'e'},
+            {"hash", required_argument, nullptr, 'H'},
+            {"eviction", required_argument, nullptr, 'E'},
+            {"memory", required_argument, nullptr, 'm'},
+            {"max-item-size", required_argument, nullptr, 'I'},
+            {"admission", no_argument, nullptr, 'a'},
+            {"admission-window", required_argument, nullptr, 'W'},
+            {"mrc-keys", required_argument, nullptr, 'S'},
+            {"storage", required_argument, nullptr, 's'},
+            {"segment-size", required_argument, nullptr, 'z'},
+            {"no-automove", no_argument, nullptr, 'A'},
+            {"arena", required_argument, nullptr, 'R'},
+            {"flash", required_argument, nullptr, 'x'},
+            {"flash-size", required_argument, nullptr, 'X'},
+            {"flash-min-size", required_argument, nullptr, 'y'},
+            {"defrag", no_argument, nullptr, 'D'},
+            {"defrag-threshold", required_argument, nullptr, 'T'},
+            {"defrag-cpu", required_argument, nullptr, 'C'},
+            {"compress", required_argument, nullptr, 'c'},
+            {"compress-cold", required_argument, nullptr, 'o'},
+            {"compress-flag", required_argument, nullptr, 'F'},
+            {"dedup", required_argument, nullptr, 'd'},
+            {"key-digest", no_argument, nullptr, 'k'},
+            {"key-verify", no_argument, nullptr, 'K'},
+            {"snapshot", required_argument, nullptr, 'P'},
+            {"snapshot-interval", required_argument, nullptr, 'i'},
+            {"load-threads", required_argument, nullptr, 'L'},
+            {"journal", required_argument, nullptr, 'j'},
+            {"journal-sync", required_argument, nullptr, 'J'},
+            {"handoff", required_argument, nullptr, 'U'},
+            {"handoff-clients", no_argument, nullptr, 'u'},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "e:H:E:m:I:aW:S:s:z:AR:x:X:y:DT:C:c:o:F:d:kKP:i:L:j:J:U:uh", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'e':
+                if (std::strcmp(optarg, "chained") == 0) {
+                    setting.hash_engine = cached::index_engine::CHAINED;
+                } else if (std::strcmp(optarg, "swiss") == 0) {
+                    setting.hash_engine = cached::index_engine::SWISS;
+                } else {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'H':
+                if (std::strcmp(optarg, "murmur3") == 0) {
+                    setting.hash_fn = cached::hash_function::MURMUR3_32;
+                } else if (std::strcmp(optarg, "murmur3-128") == 0) {
+                    setting.hash_fn = cached::hash_function::MURMUR3_X64_128;
+                } else if (std::strcmp(optarg, "crc32c") == 0) {
+                    setting.hash_fn = cached::hash_function::CRC32C;
+                } else if (std::strcmp(optarg, "wyhash") == 0) {
+                    setting.hash_fn = cached::hash_function::WYHASH;
+                } else {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'E':
+                if (std::strcmp(optarg, "lru") == 0) {
+                    setting.eviction = cached::eviction_type::LRU;
+                } else if (std::strcmp(optarg, "s3fifo") == 0) {
+                    setting.eviction = cached::eviction_type::S3FIFO;
+                } else if (std::strcmp(optarg, "gdsf") == 0) {
+                    setting.eviction = cached::eviction_type::GDSF;
+                } else {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'm': {
+                char *end;
+                auto mb = std::strtoull(optarg, &end, 10);
+                if (*end || mb == 0) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.max_lru_queue_size = mb * 1024 * 1024;
+                break;
+            }
+
+            case 'I': {
+                char *end;
+                auto mb = std::strtoull(optarg, &end, 10);
+                if (*end || mb == 0) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.max_item_size = mb * 1024 * 1024;
+                break;
+            }
+
+            case 'a':
+                setting.admission = true;
+                break;
+
+            case 'W': {
+                char *end;
+                auto percent = std::strtoul(optarg, &end, 10);
+                if (*end || percent > 100) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.admission_window = static_cast<unsigned int>(percent);
+                break;
+            }
+
+            case 'S': {
+                char *end;
+                auto keys = std::strtoull(optarg, &end, 10);
+                if (*end) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.mrc_keys = keys;
+                break;
+            }
+
+            case 's':
+                if (std::strcmp(optarg, "heap") == 0) {
+                    setting.storage = cached::storage_engine::HEAP;
+                } else if (std::strcmp(optarg, "log") == 0) {
+                    setting.storage = cached::storage_engine::LOG;
+                } else {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'z': {
+                char *end;
+                auto mb = std::strtoul(optarg, &end, 10);
+                if (*end || mb < 1 || mb > 8) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.log_segment_size = mb * 1024 * 1024;
+                break;
+            }
+
+            case 'A':
+                setting.log_automove = false;
+                break;
+
+            case 'R':
+                setting.log_arena_path = optarg;
+                break;
+
+            case 'x':
+                setting.flash_path = optarg;
+                break;
+
+            case 'X': {
+                char *end;
+                auto mb = std::strtoull(optarg, &end, 10);
+                if (*end || mb < 16) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.flash_size = mb * 1024 * 1024;
+                break;
+            }
+
+            case 'y': {
+                char *end;
+                auto bytes = std::strtoull(optarg, &end, 10);
+                if (*end || bytes == 0) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.flash_min_size = bytes;
+                break;
+            }
+
+            case 'D':
+                setting.defrag = true;
+                break;
+
+            case 'T': {
+                char *end;
+                auto percent = std::strtoul(optarg, &end, 10);
+                if (*end) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.defrag_threshold = static_cast<unsigned int>(percent);
+                break;
+            }
+
+            case 'C': {
+                char *end;
+                auto percent = std::strtoul(optarg, &end, 10);
+                if (*end || percent == 0 || percent > 100) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.defrag_cpu = static_cast<unsigned int>(percent);
+                break;
+            }
+
+            case 'c': {
+                char *end;
+                auto bytes = std::strtoul(optarg, &end, 10);
+                if (*end || bytes == 0) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.compress_min_size = bytes;
+                break;
+            }
+
+            case 'o': {
+                char *end;
+                auto seconds = std::strtoul(optarg, &end, 10);
+                if (*end || seconds == 0) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.compress_cold_age = static_cast<unsigned int>(seconds);
+                break;
+            }
+
+            case 'F': {
+                char *end;
+                auto bit = std::strtoul(optarg, &end, 10);
+                if (*end || bit > 31) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.compress_flag = uint32_t(1) << bit;
+                break;
+            }
+
+            case 'd': {
+                char *end;
+                auto bytes = std::strtoul(optarg, &end, 10);
+                if (*end || bytes == 0) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.dedup_min_size = bytes;
+                break;
+            }
+
+            case 'k':
+                setting.key_digest = true;
+                break;
+
+            case 'K':
+                setting.key_verify = true;
+                break;
+
+            case 'P':
+                setting.snapshot_path = optarg;
+                break;
+
+            case 'i': {
+                char *end;
+                auto seconds = std::strtoul(optarg, &end, 10);
+                if (*end || seconds == 0) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.snapshot_interval = static_cast<unsigned int>(seconds);
+                break;
+            }
+
+            case 'L': {
+                char *end;
+                auto n = std::strtoul(optarg, &end, 10);
+                if (*end || n == 0 || n > 64) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.snapshot_load_threads = static_cast<unsigned int>(n);
+                break;
+            }
+
+            case 'j':
+                setting.journal_path = optarg;
+                break;
+
+            case 'J': {
+                char *end;
+                auto ms = std::strtoul(optarg, &end, 10);
+                if (*end || ms > 3600000) {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+
+                setting.journal_sync = static_cast<unsigned int>(ms);
+                break;
+            }
+
+            case 'U':
+                setting.handoff_path = optarg;
+                break;
+
+            case 'u':
+                setting.handoff_clients = true;
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            default:
+                usage(argv[0]);
+                return EX_USAGE;
+        }
+    }
+
+    if (setting.log_arena_path && setting.storage != cached::storage_engine::LOG) {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    // The predecessor's snapshot, arena or journal is only final once it has
+    // exited, meanwhile new connections are accepted and parked until it is
+    // loaded.
+    if (setting.handoff_path) {
+        cached::master::get_instance().take_over(setting.snapshot_path || setting.log_arena_path
+                                                  || setting.journal_path);
+    }
+
+    auto load_threads = setting.snapshot_load_threads
+                        ? setting.snapshot_load_threads
+                        : std::thread::hardware_concurrency();
+    bool warm = false;
+
+    if (setting.log_arena_path) {
+        auto &hash_table = cached::hash_table::get_instance();
+        warm = cached::segment_store::get_instance().reattach(hash_table, load_threads);
+    }
+
+    auto &hash_table = cached::hash_table::get_instance();
+
+    // Warm before accepting connections, and before the first save could
+    // replace the snapshot with an empty one. The arena is fresher, it
+    // already holds what the journal would replay.
+    if (setting.snapshot_path && !warm) {
+        cached::snapshot_manager::get_instance().load(hash_table, load_threads);
+    }
+
+    if (setting.journal_path) {
+        cached::journal::get_instance().start(hash_table, !warm);
+    }
+
+    if (setting.snapshot_path) {
+        cached::snapshot_manager::get_instance().start(hash_table);
+    }
+
     cached::master::get_instance().start_listen();
 }
\ No newline at end of file
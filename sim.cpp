@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sysexits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assoc.h>
+#include <epoch.h>
+#include <eviction.h>
+#include <setting.h>
+
+using namespace cached;
+
+// Replays a recorded key trace through hash_table and an eviction policy,
+// once per memory size, each in its own thread.
+//
+// A trace is a flat array of little endian records. A get that misses is
+// filled with a set of the recorded size, the way a look-aside client would.
+
+enum class trace_op : uint8_t {
+    GET = 0,
+    SET = 1,
+    DELETE = 2
+};
+
+struct __attribute__((packed)) trace_record {
+    uint32_t timestamp;
+    uint64_t key;
+    uint32_t size;
+    uint8_t op;
+    uint8_t reserved[3];
+};
+
+static_assert(sizeof(trace_record) == 20, "trace records are 20 bytes");
+
+struct sim_result {
+    size_t memory;
+    uint64_t gets;
+    uint64_t hits;
+    uint64_t get_bytes;
+    uint64_t hit_bytes;
+    uint64_t evictions;
+};
+
+struct sim_trace {
+    const trace_record *records;
+    size_t nrecords;
+    size_t mean_size;
+    char *zeroes;
+};
+
+static void set_item(hash_table &table, std::string &key, const sim_trace &trace,
+                     uint32_t size)
+{
+    bucket *bp;
+    auto it = table.find_item(key, bp);
+
+    if (!it) {
+        table.insert_item(key, 0, 0, trace.zeroes, size);
+        return;
+    }
+
+    std::string new_key(key);
+    auto new_it = item::create(new_key, 0, 0, size);
+    new_it->cas_key = it->cas_key + 1;
+
+    table.replace_item(*bp, it, new_it);
+    bp->unlock();
+    table.evict();
+}
+
+static void simulate(const sim_trace &trace, sim_result &result) {
+    static auto &setting = setting::get_instance();
+    static auto &epoch = epoch_manager::get_instance();
+
+    auto policy = eviction_policy::create(setting.eviction,
+                                          result.memory,
+                                          setting.admission,
+                                          setting.admission_window);
+
+    // One bucket per expected item, so the index need not grow mid trace.
+    unsigned int power = 10;
+    while (power < 26 && (size_t(1) << power) < result.memory / trace.mean_size) {
+        power++;
+    }
+
+    auto table = new hash_table(*policy, result.memory, power);
+    epoch_guard g;
+
+    for (size_t i = 0; i < trace.nrecords; i++) {
+        auto &rec = trace.records[i];
+        std::string key(reinterpret_cast<const char *>(&rec.key), sizeof(rec.key));
+        bucket *bp;
+
+        switch (static_cast<trace_op>(rec.op)) {
+            case trace_op::GET:
+                result.gets++;
+                result.get_bytes += rec.size;
+
+                if (table->find_item_nolock(key)) {
+                    result.hits++;
+                    result.hit_bytes += rec.size;
+                } else {
+                    set_item(*table, key, trace, rec.size);
+                }
+                break;
+
+            case trace_op::SET:
+                set_item(*table, key, trace, rec.size);
+                break;
+
+            case trace_op::DELETE:
+                if (auto it = table->find_item(key, bp, false)) {
+                    table->remove_item(*bp, it);
+                    bp->unlock();
+                }
+                break;
+        }
+
+        if ((i & 255) == 0) {
+            epoch.quiescent();
+        }
+    }
+
+    result.evictions = table->evictions();
+
+    // Tables and policies have no teardown, their memory goes with the
+    // process.
+}
+
+static bool parse_size(const char *s, size_t &size) {
+    char *end;
+    auto n = std::strtoull(s, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': n <<= 10; end++; break;
+        case 'g': case 'G': n <<= 30; end++; break;
+        case 'm': case 'M': end++;
+        case '\0': n <<= 20; break;
+    }
+
+    size = n;
+    return *end == '\0' && n > 0;
+}
+
+static void usage(const char *prog) {
+    std::fprintf(stderr,
+                 "usage: %s [options] <trace> <memory>...\n"
+                 "  memory sizes take a K, M or G suffix, megabytes by default\n"
+                 "  -e, --index-engine=<chained|swiss>  hash index implementation\n"
+                 "  -E, --eviction=<lru|s3fifo|gdsf>    eviction policy\n"
+                 "  -a, --admission                     TinyLFU admission filter\n"
+                 "  -W, --admission-window=<percent>    admission window size\n"
+                 "  -h, --help                          show this message\n",
+                 prog);
+}
+
+int main(int argc, char **argv) {
+    auto &setting = setting::get_instance();
+
+    static const struct option long_opts[] = {
+            {"index-engine", required_argument, nullptr, 'e'},
+            {"eviction", required_argument, nullptr, 'E'},
+            {"admission", no_argument, nullptr, 'a'},
+            {"admission-window", required_argument, nullptr, 'W'},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "e:E:aW:h", long_opts, nullptr)) != -1) {
+        switch (c) {
+            case 'e':
+                if (std::strcmp(optarg, "chained") == 0) {
+                    setting.hash_engine = index_engine::CHAINED;
+                } else if (std::strcmp(optarg, "swiss") == 0) {
+                    setting.hash_engine = index_engine::SWISS;
+                } else {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'E':
+                if (std::strcmp(optarg, "lru") == 0) {
+                    setting.eviction = eviction_type::LRU;
+                } else if (std::strcmp(optarg, "s3fifo") == 0) {
+                    setting.eviction = eviction_type::S3FIFO;
+                } else if (std::strcmp(optarg, "gdsf") == 0) {
+                    setting.eviction = eviction_type::GDSF;
+                } else {
+                    usage(argv[0]);
+                    return EX_USAGE;
+                }
+                break;
+
+            case 'a':
+                setting.admission = true;
+                break;
+
+            case 'W':
+                setting.admission_window = static_cast<unsigned int>(std::atoi(optarg));
+                break;
+
+            case 'h':
+                usage(argv[0]);
+                return 0;
+
+            default:
+                usage(argv[0]);
+                return EX_USAGE;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return EX_USAGE;
+    }
+
+    // The replay runs far faster than the trace was recorded, a wall clock
+    // throttle on LRU bumps would turn LRU into FIFO.
+    setting.lru_update_interval = 0;
+
+    std::vector<sim_result> results;
+    for (int i = optind + 1; i < argc; i++) {
+        sim_result r = {};
+        if (!parse_size(argv[i], r.memory)) {
+            usage(argv[0]);
+            return EX_USAGE;
+        }
+
+        results.push_back(r);
+    }
+
+    auto fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        std::perror(argv[optind]);
+        return EX_NOINPUT;
+    }
+
+    sim_trace trace = {};
+    trace.nrecords = st.st_size / sizeof(trace_record);
+    if (trace.nrecords == 0) {
+        std::fprintf(stderr, "%s: empty trace\n", argv[optind]);
+        return EX_DATAERR;
+    }
+
+    auto map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        std::perror("mmap");
+        return EX_OSERR;
+    }
+    close(fd);
+
+    trace.records = static_cast<const trace_record *>(map);
+
+    size_t max_size = 1, total_size = 0;
+    for (size_t i = 0; i < trace.nrecords; i++) {
+        max_size = std::max<size_t>(max_size, trace.records[i].size);
+        total_size += trace.records[i].size;
+    }
+
+    trace.mean_size = std::max<size_t>(total_size / trace.nrecords + sizeof(item), 1);
+    trace.zeroes = static_cast<char *>(std::calloc(max_size, 1));
+
+    std::vector<std::thread> threads;
+    for (auto &r : results) {
+        threads.emplace_back(simulate, std::cref(trace), std::ref(r));
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    std::sort(results.begin(), results.end(), [](const sim_result &a, const sim_result &b) {
+        return a.memory < b.memory;
+    });
+
+    std::printf("%-12s %12s %12s %10s %10s\n",
+                "memory", "gets", "evictions", "hit", "byte hit");
+
+    for (auto &r : results) {
+        std::printf("%-12zu %12llu %12llu %10.4f %10.4f\n",
+                    r.memory,
+                    static_cast<unsigned long long>(r.gets),
+                    static_cast<unsigned long long>(r.evictions),
+                    r.gets ? static_cast<double>(r.hits) / r.gets : 0.0,
+                    r.get_bytes ? static_cast<double>(r.hit_bytes) / r.get_bytes : 0.0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <new>
+
+#include <sketch.h>
+
+#include <jemalloc.h>
+
+namespace cached {
+
+count_min_sketch::count_min_sketch(size_t capacity) :
+additions(0)
+{
+    size_t words = 64;
+    while (words < capacity) {
+        words <<= 1;
+    }
+
+    this->table = static_cast<std::atomic<uint64_t> *>(
+            je_malloc(words * sizeof(std::atomic<uint64_t>)));
+    for (size_t i = 0; i < words; i++) {
+        new (&this->table[i]) std::atomic<uint64_t>(0);
+    }
+
+    this->table_mask = words - 1;
+    this->sample_size = words * 10;
+}
+
+count_min_sketch::~count_min_sketch() {
+    je_free(this->table);
+}
+
+bool count_min_sketch::increment_at(size_t index, unsigned offset) noexcept {
+    auto &word = this->table[index];
+    auto mask = 0xfull << offset;
+    auto w = word.load(std::memory_order_relaxed);
+
+    while ((w & mask) != mask) {
+        if (word.compare_exchange_weak(w, w + (1ull << offset),
+                                       std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void count_min_sketch::increment(uint32_t hv) noexcept {
+    auto h = rehash(hv);
+    bool added = false;
+
+    for (unsigned row = 0; row < depth; row++) {
+        added |= this->increment_at(this->index_of(h, row), offset_of(hv, row));
+    }
+
+    if (added && this->additions.fetch_add(1, std::memory_order_relaxed) + 1
+                 == this->sample_size)
+    {
+        this->reset();
+    }
+}
+
+unsigned count_min_sketch::estimate(uint32_t hv) const noexcept {
+    auto h = rehash(hv);
+    unsigned freq = 15;
+
+    for (unsigned row = 0; row < depth; row++) {
+        auto w = this->table[this->index_of(h, row)].load(std::memory_order_relaxed);
+        freq = std::min(freq, static_cast<unsigned>((w >> offset_of(hv, row)) & 0xf));
+    }
+
+    return freq;
+}
+
+void count_min_sketch::reset() noexcept {
+    for (size_t i = 0; i <= this->table_mask; i++) {
+        auto w = this->table[i].load(std::memory_order_relaxed);
+
+        while (!this->table[i].compare_exchange_weak(w, (w >> 1) & 0x7777777777777777ull,
+                                                     std::memory_order_relaxed))
+        { }
+    }
+
+    this->additions.store(this->sample_size / 2, std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,465 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <snapshot.h>
+#include <setting.h>
+#include <assoc.h>
+#include <epoch.h>
+#include <dedup.h>
+#include <journal.h>
+#include <flash.h>
+
+namespace cached {
+
+static const char file_magic[8] = {'C', 'A', 'C', 'H', 'E', 'D', 'S', 'N'};
+static const uint32_t file_version = 1;
+static const uint32_t block_magic = 0x4b4c4253;
+
+// Records are buffered into blocks of about this size, the unit of parallel
+// loading.
+static const size_t block_size = 4 * 1024 * 1024;
+
+struct file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t hash_seed;
+    uint32_t hash_fn;
+    uint32_t key_digest;
+    int64_t created_at;
+};
+
+struct block_header {
+    uint32_t magic;
+    uint32_t nrecords;
+    uint64_t size;
+};
+
+// Followed by the key, unless only its digest was kept, and the value as
+// stored, padded to 8 bytes.
+struct record_header {
+    uint32_t key_size;
+    uint32_t flags;
+    int64_t exptime;
+    int64_t created_at;
+    uint64_t cas_key;
+    uint64_t value_size;
+    uint64_t raw_size;
+    uint64_t digest[2];
+    uint32_t hv;
+    uint32_t cost;
+};
+
+static inline size_t padded(size_t n) noexcept {
+    return (n + 7) & ~size_t(7);
+}
+
+static bool write_all(int fd, const void *buf, size_t n) noexcept {
+    auto p = static_cast<const char *>(buf);
+
+    while (n > 0) {
+        auto written = write(fd, p, n);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        p += written;
+        n -= written;
+    }
+
+    return true;
+}
+
+static uint64_t usec_since(std::chrono::steady_clock::time_point start) noexcept {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+snapshot_manager::snapshot_manager() :
+nsaves(0),
+nfailed(0),
+last_items(0),
+last_bytes(0),
+last_time(0),
+last_usec(0),
+nloaded(0),
+nexpired(0),
+nskipped(0),
+load_usec(0)
+{
+}
+
+bool snapshot_manager::save(hash_table &table) noexcept {
+    static auto &setting = setting::get_instance();
+    static auto &epoch = epoch_manager::get_instance();
+    static auto &flash = flash_store::get_instance();
+
+    std::lock_guard<std::mutex> g(this->save_mtx);
+
+    auto start = std::chrono::steady_clock::now();
+    auto now = std::time(0);
+
+    // Mutations from here on go to a new journal file, replayed on top of
+    // this snapshot. Those during the walk may be in both, harmlessly.
+    uint64_t generation = setting.journal_path ? journal::get_instance().rotate() : 0;
+
+    std::string tmp(setting.snapshot_path);
+    tmp.append(".tmp");
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        std::perror("open()");
+        this->nfailed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    file_header header;
+    std::memcpy(header.magic, file_magic, sizeof(header.magic));
+    header.version = file_version;
+    header.hash_seed = table.seed();
+    header.hash_fn = static_cast<uint32_t>(table.hash_function_type());
+    header.key_digest = setting.key_digest;
+    header.created_at = now;
+
+    bool ok = write_all(fd, &header, sizeof(header));
+    uint64_t nitems = 0, nbytes = sizeof(header);
+
+    std::vector<char> block;
+    block.reserve(block_size + block_size / 4);
+    uint32_t nrecords = 0;
+
+    // Written offline, a slow disk must not hold back reclamation.
+    auto flush = [&] {
+        if (nrecords == 0) {
+            return true;
+        }
+
+        block_header bh = {block_magic, nrecords, block.size()};
+
+        epoch.offline();
+        auto written = write_all(fd, &bh, sizeof(bh)) && write_all(fd, block.data(), block.size());
+        epoch.online();
+
+        nbytes += sizeof(bh) + block.size();
+        block.clear();
+        nrecords = 0;
+
+        return written;
+    };
+
+    std::vector<item_ptr> items;
+    std::vector<char> flash_value;
+    epoch.online();
+
+    // By hash position rather than bucket index, so a table growing during
+    // the walk does not hand out the buckets already written a second time.
+    uint64_t pos = 0;
+
+    for (size_t i = 0; ok && pos < hash_table::end_position; i++) {
+        items.clear();
+        auto first = pos;
+        pos = table.walk(pos, items);
+
+        for (auto it : items) {
+            if (hash_table::position(it->hv) < first || it->expired(now)) {
+                continue;
+            }
+
+            // Values on the flash tier are read back, cold ones are worth
+            // keeping too.
+            if (it->on_flash() && !flash.read_value(it, flash_value)) {
+                continue;
+            }
+
+            record_header r;
+            r.key_size = static_cast<uint32_t>(it->key.size());
+            r.flags = it->flags;
+            r.exptime = it->exptime;
+            r.created_at = it->created_at;
+            r.cas_key = it->cas_key;
+            r.value_size = it->data_size;
+            r.raw_size = it->raw_size;
+            r.digest[0] = it->digest[0];
+            r.digest[1] = it->digest[1];
+            r.hv = it->hv;
+            r.cost = it->cost;
+
+            auto off = block.size();
+            block.resize(off + padded(sizeof(r) + r.key_size + r.value_size));
+
+            auto p = block.data() + off;
+            std::memcpy(p, &r, sizeof(r));
+            std::memcpy(p + sizeof(r), it->key.data(), r.key_size);
+
+            p += sizeof(r) + r.key_size;
+            if (it->on_flash()) {
+                std::memcpy(p, flash_value.data(), r.value_size);
+            } else {
+                it->for_each_piece([&p](const char *data, size_t size) {
+                    std::memcpy(p, data, size);
+                    p += size;
+                });
+            }
+
+            nrecords++;
+            nitems++;
+        }
+
+        if (block.size() >= block_size) {
+            ok = flush();
+        }
+
+        if (i % 16 == 15) {
+            epoch.quiescent();
+        }
+    }
+
+    ok = ok && flush();
+    epoch.offline();
+
+    ok = ok && fdatasync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(tmp.c_str(), setting.snapshot_path) == -1) {
+        std::perror("snapshot");
+        unlink(tmp.c_str());
+        this->nfailed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    if (generation) {
+        journal::get_instance().compact(generation);
+    }
+
+    this->nsaves.fetch_add(1, std::memory_order_relaxed);
+    this->last_items = nitems;
+    this->last_bytes = nbytes;
+    this->last_time = static_cast<uint64_t>(now);
+    this->last_usec = usec_since(start);
+
+    return true;
+}
+
+item *snapshot_manager::build_item(std::string &key,
+                                   uint32_t flags,
+                                   unsigned int exptime,
+                                   const char *value,
+                                   size_t value_size,
+                                   size_t raw_size) noexcept
+{
+    static auto &setting = setting::get_instance();
+    static auto &dedup = dedup_store::get_instance();
+
+    item_ptr it;
+
+    if (value_size > setting.value_chunk_size && raw_size == 0) {
+        it = item::create_chained(key, flags, exptime);
+
+        for (size_t off = 0; off < value_size; off += setting.value_chunk_size) {
+            it->chain_append(value_chunk::create(value + off,
+                                                 std::min<size_t>(setting.value_chunk_size,
+                                                                  value_size - off)));
+        }
+
+        return it;
+    }
+
+    shared_value *v = nullptr;
+
+    if (raw_size == 0 && setting.dedup_min_size > 0 && value_size >= setting.dedup_min_size) {
+        v = dedup.acquire(value, value_size);
+    }
+
+    if (v) {
+        it = item::create_shared(key, flags, exptime, v);
+    } else {
+        it = item::create(key, flags, exptime, value, value_size);
+        it->raw_size = raw_size;
+    }
+
+    return it;
+}
+
+void snapshot_manager::load_block(hash_table &table, const char *p, uint32_t nrecords,
+                                  bool same_hash) noexcept
+{
+    static auto &setting = setting::get_instance();
+
+    auto now = std::time(0);
+
+    for (uint32_t i = 0; i < nrecords; i++) {
+        record_header r;
+        std::memcpy(&r, p, sizeof(r));
+
+        std::string key(p + sizeof(r), r.key_size);
+        auto value = p + sizeof(r) + r.key_size;
+        p += padded(sizeof(r) + r.key_size + r.value_size);
+
+        item_ptr it;
+
+        if (r.key_size == 0) {
+            // A digest is only good for the same hash and seed.
+            if (!same_hash || !setting.key_digest) {
+                this->nskipped.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            it = item::create(r.hv, r.digest, r.flags, static_cast<unsigned int>(r.exptime),
+                              r.value_size);
+            std::memcpy(it->data, value, r.value_size);
+            it->raw_size = r.raw_size;
+        } else {
+            it = build_item(key, r.flags, static_cast<unsigned int>(r.exptime),
+                            value, r.value_size, r.raw_size);
+        }
+
+        it->created_at = r.created_at;
+        it->cas_key = r.cas_key;
+        it->cost = r.cost;
+
+        if (it->expired(now)) {
+            item::destroy(it);
+            this->nexpired.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        // Only one item per key, whatever the file holds.
+        if (!table.insert_restored(it)) {
+            item::destroy(it);
+            this->nskipped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        this->nloaded.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool snapshot_manager::load(hash_table &table, unsigned nthreads) noexcept {
+    static auto &setting = setting::get_instance();
+    static auto &epoch = epoch_manager::get_instance();
+
+    auto start = std::chrono::steady_clock::now();
+
+    int fd = open(setting.snapshot_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            std::perror("open()");
+        }
+
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || static_cast<size_t>(st.st_size) < sizeof(file_header)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    auto base = static_cast<const char *>(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        std::perror("mmap()");
+        return false;
+    }
+
+    madvise(const_cast<char *>(base), size, MADV_WILLNEED);
+
+    file_header header;
+    std::memcpy(&header, base, sizeof(header));
+
+    if (std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0
+        || header.version != file_version)
+    {
+        std::fprintf(stderr, "%s is not a snapshot, ignored\n", setting.snapshot_path);
+        munmap(const_cast<char *>(base), size);
+        return false;
+    }
+
+    bool same_hash = header.hash_seed == table.seed()
+                     && header.hash_fn == static_cast<uint32_t>(table.hash_function_type());
+
+    // Block headers chain through the file, a torn last block is dropped.
+    std::vector<std::pair<size_t, uint32_t>> blocks;
+
+    for (size_t off = sizeof(header); off + sizeof(block_header) <= size; ) {
+        block_header bh;
+        std::memcpy(&bh, base + off, sizeof(bh));
+
+        if (bh.magic != block_magic || bh.size > size - off - sizeof(bh)) {
+            break;
+        }
+
+        blocks.emplace_back(off + sizeof(bh), bh.nrecords);
+        off += sizeof(bh) + bh.size;
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> loaders;
+
+    for (unsigned t = 0; t < std::max(nthreads, 1u); t++) {
+        loaders.emplace_back([&] {
+            epoch_guard g;
+
+            for (size_t i; (i = next.fetch_add(1)) < blocks.size(); ) {
+                this->load_block(table, base + blocks[i].first, blocks[i].second, same_hash);
+                epoch.quiescent();
+            }
+        });
+    }
+
+    for (auto &t : loaders) {
+        t.join();
+    }
+
+    munmap(const_cast<char *>(base), size);
+
+    this->load_usec = usec_since(start);
+
+    std::fprintf(stderr, "loaded %llu items from %s in %.1fs\n",
+                 static_cast<unsigned long long>(this->nloaded.load()),
+                 setting.snapshot_path, this->load_usec.load() / 1e6);
+
+    return true;
+}
+
+void snapshot_manager::run(hash_table &table) noexcept {
+    static auto &setting = setting::get_instance();
+
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(setting.snapshot_interval));
+        this->save(table);
+    }
+}
+
+void snapshot_manager::start(hash_table &table) {
+    this->worker = std::thread(&snapshot_manager::run, this, std::ref(table));
+    this->worker.detach();
+}
+
+void snapshot_manager::stats(stats_writer &out) noexcept {
+    out.add("snapshot_saves", this->nsaves.load());
+    out.add("snapshot_failed_saves", this->nfailed.load());
+    out.add("snapshot_last_items", this->last_items.load());
+    out.add("snapshot_last_bytes", this->last_bytes.load());
+    out.add("snapshot_last_time", this->last_time.load());
+    out.add("snapshot_last_usec", this->last_usec.load());
+    out.add("snapshot_loaded_items", this->nloaded.load());
+    out.add("snapshot_expired_items", this->nexpired.load());
+    out.add("snapshot_skipped_items", this->nskipped.load());
+    out.add("snapshot_load_usec", this->load_usec.load());
+}
+
+}
@@ -0,0 +1,208 @@
+#include <cstring>
+
+#include <emmintrin.h>
+
+#include <swiss.h>
+#include <assoc.h>
+#include <epoch.h>
+
+#include <jemalloc.h>
+
+namespace cached {
+
+static inline uint32_t match_byte(const int8_t *group, int8_t b) noexcept {
+    auto ctrl = _mm_load_si128(reinterpret_cast<const __m128i *>(group));
+    return static_cast<uint32_t>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(b), ctrl)));
+}
+
+// Empty and deleted control bytes are the only ones with the sign bit set.
+static inline uint32_t match_empty_or_deleted(const int8_t *group) noexcept {
+    auto ctrl = _mm_load_si128(reinterpret_cast<const __m128i *>(group));
+    return static_cast<uint32_t>(_mm_movemask_epi8(ctrl));
+}
+
+swiss_table::layout *swiss_table::new_layout(size_t ngroups) noexcept {
+    auto header = (sizeof(layout) + group_width - 1) & ~(group_width - 1);
+    auto nslots = ngroups * group_width;
+
+    auto l = static_cast<layout *>(je_malloc(header + nslots + nslots * sizeof(item *)));
+
+    l->ngroups = ngroups;
+    l->ctrl = reinterpret_cast<int8_t *>(l) + header;
+    l->slots = reinterpret_cast<item **>(l->ctrl + nslots);
+
+    std::memset(l->ctrl, ctrl_empty, nslots);
+    return l;
+}
+
+void swiss_table::free_layout(void *l) noexcept {
+    je_free(l);
+}
+
+swiss_table::swiss_table() :
+tbl(new_layout(1)),
+nitems(0),
+ndeleted(0),
+max_load_factor(0.875f)
+{ }
+
+swiss_table::~swiss_table() {
+    free_layout(this->tbl.load());
+}
+
+item *swiss_table::find(const std::string &key, uint32_t hv, const uint64_t *digest) const noexcept {
+    auto l = this->tbl.load(std::memory_order_acquire);
+    auto h = mix(hv);
+    auto mask = l->ngroups - 1;
+    auto g = h & mask;
+
+    for (size_t i = 1; i <= l->ngroups; i++) {
+        auto group = l->ctrl + g * group_width;
+
+        for (auto m = match_byte(group, h2(h)); m; m &= m - 1) {
+            auto it = l->slots[g * group_width + __builtin_ctz(m)];
+            if (it->has_key(key, digest)) {
+                return it;
+            }
+        }
+
+        if (match_byte(group, ctrl_empty)) {
+            return nullptr;
+        }
+
+        g = (g + i) & mask;
+    }
+
+    return nullptr;
+}
+
+item **swiss_table::find_slot(const item *it, uint32_t hv) const noexcept {
+    auto l = this->tbl.load(std::memory_order_relaxed);
+    auto h = mix(hv);
+    auto mask = l->ngroups - 1;
+    auto g = h & mask;
+
+    for (size_t i = 1; i <= l->ngroups; i++) {
+        auto group = l->ctrl + g * group_width;
+
+        for (auto m = match_byte(group, h2(h)); m; m &= m - 1) {
+            auto slot = &l->slots[g * group_width + __builtin_ctz(m)];
+            if (*slot == it) {
+                return slot;
+            }
+        }
+
+        if (match_byte(group, ctrl_empty)) {
+            return nullptr;
+        }
+
+        g = (g + i) & mask;
+    }
+
+    return nullptr;
+}
+
+int8_t swiss_table::insert_slot(layout *l, item *it, uint32_t h) noexcept {
+    auto mask = l->ngroups - 1;
+    auto g = h & mask;
+
+    for (size_t i = 1; ; i++) {
+        auto group = l->ctrl + g * group_width;
+        auto m = match_empty_or_deleted(group);
+
+        if (m) {
+            auto idx = g * group_width + __builtin_ctz(m);
+            auto prev = l->ctrl[idx];
+
+            // Publish the slot before its fingerprint, so a racing reader
+            // matching the new control byte never sees a stale pointer.
+            l->slots[idx] = it;
+            std::atomic_thread_fence(std::memory_order_release);
+            l->ctrl[idx] = h2(h);
+            return prev;
+        }
+
+        g = (g + i) & mask;
+    }
+}
+
+void swiss_table::rehash(size_t ngroups) noexcept {
+    static auto &epoch = epoch_manager::get_instance();
+
+    auto old = this->tbl.load(std::memory_order_relaxed);
+    auto l = new_layout(ngroups);
+
+    for (size_t i = 0; i < old->ngroups * group_width; i++) {
+        if (old->ctrl[i] >= 0) {
+            auto it = old->slots[i];
+            insert_slot(l, it, mix(it->hv));
+        }
+    }
+
+    this->ndeleted = 0;
+    this->tbl.store(l, std::memory_order_release);
+
+    epoch.retire(old, swiss_table::free_layout);
+}
+
+void swiss_table::reserve(size_t capacity) noexcept {
+    size_t ngroups = 1;
+    while (ngroups * group_width < capacity) {
+        ngroups <<= 1;
+    }
+
+    if (ngroups > this->tbl.load(std::memory_order_relaxed)->ngroups) {
+        this->rehash(ngroups);
+    }
+}
+
+void swiss_table::insert(item *it, uint32_t hv) noexcept {
+    auto l = this->tbl.load(std::memory_order_relaxed);
+    auto cap = l->ngroups * group_width;
+
+    if (this->nitems + this->ndeleted + 1 > cap * this->max_load_factor) {
+        // Mostly tombstones, clean up in place instead of growing.
+        if (this->nitems + 1 <= cap * this->max_load_factor / 2) {
+            this->rehash(l->ngroups);
+        } else {
+            this->rehash(l->ngroups * 2);
+        }
+
+        l = this->tbl.load(std::memory_order_relaxed);
+    }
+
+    if (insert_slot(l, it, mix(hv)) == ctrl_deleted) {
+        this->ndeleted--;
+    }
+
+    this->nitems++;
+}
+
+bool swiss_table::erase(item *it, uint32_t hv) noexcept {
+    auto slot = this->find_slot(it, hv);
+    if (!slot) {
+        return false;
+    }
+
+    auto l = this->tbl.load(std::memory_order_relaxed);
+    auto idx = slot - l->slots;
+
+    l->ctrl[idx] = ctrl_deleted;
+    this->nitems--;
+    this->ndeleted++;
+
+    return true;
+}
+
+bool swiss_table::replace(item *old_it, item *new_it, uint32_t hv) noexcept {
+    auto slot = this->find_slot(old_it, hv);
+    if (!slot) {
+        return false;
+    }
+
+    *slot = new_it;
+    return true;
+}
+
+}
@@ -9,10 +9,15 @@
 #include <sysexits.h>
 
 #include <worker.h>
+#include <epoch.h>
+#include <handoff.h>
 
 namespace cached {
 
-worker::worker() {
+worker::worker() :
+draining(false),
+drained_flag(false)
+{
     int p[2];
     if (pipe(p) == -1) {
         perror("cannot create pipe for worker thread");
@@ -23,6 +28,9 @@ worker::worker() {
     this->write_pipe = p[1];
 
     ev_io_init(&this->read_pipe_evio, worker::recv_master_sig, this->read_pipe, EV_READ);
+    ev_prepare_init(&this->before_block_evp, worker::before_block);
+    ev_check_init(&this->after_block_evc, worker::after_block);
+    ev_async_init(&this->flash_evasync, worker::recv_flash_reads);
 }
 
 void worker::recv_master_sig(EV_P_ ev_io *evio, int revents) noexcept {
@@ -50,13 +58,27 @@ void worker::recv_master_sig(EV_P_ ev_io *evio, int revents) noexcept {
             case 'p':
                 break;
 
+            case 'd':
+                w->draining = true;
+
+                for (auto it = w->conns.begin(); it != w->conns.end(); ) {
+                    auto &conn = (it++)->second;
+                    w->conn_idle(conn);
+                }
+
+                w->check_drained();
+                return;
+
             default:
                 return;
         }
 
-        w->conns.emplace(std::piecewise_construct,
-                         std::make_tuple(cfd),
-                         std::make_tuple(cfd, std::ref(*w)));
+        auto res = w->conns.emplace(std::piecewise_construct,
+                                    std::make_tuple(cfd),
+                                    std::make_tuple(cfd, std::ref(*w)));
+
+        // Accepted just before the handoff.
+        w->conn_idle(res.first->second);
     } else if (nread == 0) {
         fprintf(stderr, "unexpected pipe close");
         exit(1);
@@ -65,6 +87,69 @@ void worker::recv_master_sig(EV_P_ ev_io *evio, int revents) noexcept {
     }
 }
 
+// A worker holds no item pointers across loop iterations, so it goes offline
+// while blocked in the backend and lets reclamation proceed without it.
+void worker::before_block(EV_P_ ev_prepare *w, int revents) noexcept {
+    static auto &epoch = epoch_manager::get_instance();
+    epoch.offline();
+}
+
+void worker::after_block(EV_P_ ev_check *w, int revents) noexcept {
+    static auto &epoch = epoch_manager::get_instance();
+    epoch.online();
+}
+
+void worker::recv_flash_reads(EV_P_ ev_async *evasync, int revents) noexcept {
+    static const auto offsetof_ev_async =
+            reinterpret_cast<uint64_t>(&((worker *)0)->flash_evasync);
+
+    worker *w = reinterpret_cast<worker *>((uint64_t)(evasync) - offsetof_ev_async);
+    std::vector<flash_read *> done;
+
+    {
+        std::lock_guard<std::mutex> guard(w->flash_mtx);
+        done.swap(w->flash_done);
+    }
+
+    for (auto r : done) {
+        static_cast<connection *>(r->owner)->flash_read_done(r);
+    }
+}
+
+void worker::flash_complete(flash_read *r) noexcept {
+    {
+        std::lock_guard<std::mutex> guard(this->flash_mtx);
+        this->flash_done.push_back(r);
+    }
+
+    ev_async_send(this->evloop, &this->flash_evasync);
+}
+
+void worker::drain() noexcept {
+    if (write(this->write_pipe, "d", 1) != 1) {
+        perror("cannot write to worker pipe");
+    }
+}
+
+void worker::release_conn(connection& conn) noexcept {
+    static auto &handoff = handoff::get_instance();
+
+    int fd = conn.sfd;
+
+    // The socket outlives the connection, for the successor.
+    conn.sfd = -1;
+    this->conns.erase(fd);
+
+    handoff.release_client(fd);
+    this->check_drained();
+}
+
+void worker::check_drained() noexcept {
+    if (this->conns.empty()) {
+        this->drained_flag.store(true, std::memory_order_release);
+    }
+}
+
 void worker::dispatch_new_conn(int fd) noexcept {
     {
         std::lock_guard<std::mutex> guard(this->wait_queue_mtx);
@@ -84,6 +169,11 @@ void worker::run_thread() {
 void worker::run(worker& w) noexcept {
     w.evloop = ev_loop_new(EVFLAG_AUTO);
     ev_io_start(w.evloop, &w.read_pipe_evio);
+    ev_prepare_start(w.evloop, &w.before_block_evp);
+    ev_check_start(w.evloop, &w.after_block_evc);
+    ev_async_start(w.evloop, &w.flash_evasync);
+
+    epoch_manager::get_instance().online();
     ev_run(w.evloop, 0);
 }
 